@@ -33,6 +33,18 @@ android {
                     "-DLLAMA_NATIVE=OFF",
                     "-DLLAMA_LTO=OFF"
                 )
+                // ./gradlew assembleRelease -Pnanoai.bench=true also builds nanoai_bench
+                if (project.findProperty("nanoai.bench") == "true") {
+                    arguments += "-DNANOAI_BUILD_BENCH=ON"
+                }
+                // -Pnanoai.gpu=vulkan or opencl builds a GPU offload backend in
+                project.findProperty("nanoai.gpu")?.let {
+                    arguments += "-DNANOAI_GPU_BACKEND=$it"
+                }
+                // -Pnanoai.cpuVariants=false links one ARMv8.0 CPU backend statically
+                if (project.findProperty("nanoai.cpuVariants") == "false") {
+                    arguments += "-DNANOAI_CPU_VARIANTS=OFF"
+                }
                 cppFlags += listOf(
                     "-O3",
                     "-ffast-math",
@@ -0,0 +1,317 @@
+/**
+ * NanoAi Benchmark - Standalone pp/tg throughput sweeps for on-device runs
+ *
+ * Measures prompt processing (pp) and text generation (tg) speed over
+ * thread counts, batch sizes and context depths for one or more GGUF
+ * files, and prints one JSON object per measurement on stdout. Diagnostics
+ * go to stderr, so the output can be redirected straight into a file.
+ *
+ * Build with -DNANOAI_BUILD_BENCH=ON (gradle: -Pnanoai.bench=true), then:
+ *
+ *   adb push nanoai_bench libc++_shared.so model-q4_k_m.gguf /data/local/tmp/
+ *   (with CPU variants, also push libllama.so and the libggml*.so files)
+ *   adb shell 'cd /data/local/tmp && LD_LIBRARY_PATH=. ./nanoai_bench \
+ *       -m model-q4_k_m.gguf -t 2,4,6 -b 128,512 -d 0,1024' > results.jsonl
+ */
+
+#include <string>
+#include <vector>
+#include <random>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <unistd.h>
+
+#ifdef __ANDROID__
+#include <sys/system_properties.h>
+#endif
+
+#include "llama.h"
+
+// Compute micro-batch used when -ub is not given, as in the app
+static const int DEFAULT_N_UBATCH = 256;
+
+struct BenchArgs {
+    std::vector<std::string> models;
+    std::vector<int> threads = {4};
+    std::vector<int> batches = {512};
+    std::vector<int> depths = {0};   // tokens already in the KV cache
+    int n_ubatch = DEFAULT_N_UBATCH;
+    int n_prompt = 512;
+    int n_gen = 128;
+    int reps = 3;
+};
+
+// Mean and spread of one test's repetitions, in tokens per second
+struct BenchResult {
+    double mean = 0;
+    double stddev = 0;
+};
+
+static void print_usage(const char* prog) {
+    fprintf(stderr,
+            "usage: %s -m MODEL [-m MODEL ...] [options]\n"
+            "  -t LIST   thread counts (default 4)\n"
+            "  -b LIST   batch sizes (default 512)\n"
+            "  -d LIST   context depths before each test (default 0)\n"
+            "  -ub N     compute micro-batch size (default %d)\n"
+            "  -p N      prompt tokens for pp (default 512, 0 skips)\n"
+            "  -n N      generated tokens for tg (default 128, 0 skips)\n"
+            "  -r N      repetitions per test (default 3)\n"
+            "LIST is comma-separated, e.g. 2,4,6\n",
+            prog, DEFAULT_N_UBATCH);
+}
+
+// Helper: Parse a comma-separated list of positive integers
+static bool parse_list(const char* text, std::vector<int>& out, bool allow_zero) {
+    out.clear();
+    const char* p = text;
+    while (*p) {
+        char* end = nullptr;
+        long value = strtol(p, &end, 10);
+        if (end == p || value < (allow_zero ? 0 : 1)) return false;
+        out.push_back((int)value);
+        p = *end == ',' ? end + 1 : end;
+        if (*end != ',' && *end != '\0') return false;
+    }
+    return !out.empty();
+}
+
+static bool parse_args(int argc, char** argv, BenchArgs& args) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) return false;
+        const char* value = argv[++i];
+        bool ok = true;
+        if (arg == "-m") {
+            args.models.push_back(value);
+        } else if (arg == "-t") {
+            ok = parse_list(value, args.threads, false);
+        } else if (arg == "-b") {
+            ok = parse_list(value, args.batches, false);
+        } else if (arg == "-d") {
+            ok = parse_list(value, args.depths, true);
+        } else if (arg == "-ub") {
+            args.n_ubatch = atoi(value);
+            ok = args.n_ubatch > 0;
+        } else if (arg == "-p") {
+            args.n_prompt = atoi(value);
+            ok = args.n_prompt >= 0;
+        } else if (arg == "-n") {
+            args.n_gen = atoi(value);
+            ok = args.n_gen >= 0;
+        } else if (arg == "-r") {
+            args.reps = atoi(value);
+            ok = args.reps > 0;
+        } else {
+            ok = false;
+        }
+        if (!ok) {
+            fprintf(stderr, "invalid argument: %s %s\n", arg.c_str(), value);
+            return false;
+        }
+    }
+    return !args.models.empty();
+}
+
+// Helper: Quantization label from a file name. Mirrors
+// ModelManager.detectQuantization so results group like the app's list.
+static std::string detect_quantization(const std::string& path) {
+    std::string name = path.substr(path.find_last_of('/') + 1);
+    std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+    static const char* labels[] = {
+        "q2_k", "q3_k_s", "q3_k_m", "q3_k_l", "q4_0", "q4_1", "q4_k_s", "q4_k_m",
+        "q5_0", "q5_1", "q5_k_s", "q5_k_m", "q6_k", "q8_0", "f16", "f32",
+    };
+    for (const char* label : labels) {
+        if (name.find(label) != std::string::npos) {
+            std::string upper = label;
+            std::transform(upper.begin(), upper.end(), upper.begin(), ::toupper);
+            return upper;
+        }
+    }
+    return "Unknown";
+}
+
+// Helper: Device model, so results from several phones can be merged
+static std::string device_name() {
+#ifdef __ANDROID__
+    char model[PROP_VALUE_MAX] = {0};
+    if (__system_property_get("ro.product.model", model) > 0) return model;
+#endif
+    return "unknown";
+}
+
+// Helper: Escape a string for a JSON value
+static std::string json_escape(const std::string& text) {
+    std::string out;
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if ((unsigned char)c < 0x20) {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", c);
+            out += buf;
+        } else {
+            out += c;
+        }
+    }
+    return out;
+}
+
+// Helper: Decode n arbitrary tokens at positions [pos, pos + n) in chunks
+// of n_batch; only the last token of each chunk requests logits
+static bool decode_tokens(llama_context* ctx, llama_batch& batch, int n_batch,
+                          int pos, int n, int n_vocab, std::mt19937& rng) {
+    std::uniform_int_distribution<llama_token> token_dist(0, n_vocab - 1);
+    for (int start = 0; start < n; start += n_batch) {
+        int count = std::min(n_batch, n - start);
+        batch.n_tokens = count;
+        for (int i = 0; i < count; i++) {
+            batch.token[i] = token_dist(rng);
+            batch.pos[i] = pos + start + i;
+            batch.n_seq_id[i] = 1;
+            batch.seq_id[i][0] = 0;
+            batch.logits[i] = i == count - 1;
+        }
+        if (llama_decode(ctx, batch) != 0) return false;
+    }
+    llama_synchronize(ctx);
+    return true;
+}
+
+static BenchResult summarize(const std::vector<double>& rates) {
+    BenchResult result;
+    if (rates.empty()) return result;
+    for (double r : rates) result.mean += r;
+    result.mean /= rates.size();
+    for (double r : rates) result.stddev += (r - result.mean) * (r - result.mean);
+    result.stddev = rates.size() > 1 ? std::sqrt(result.stddev / (rates.size() - 1)) : 0;
+    return result;
+}
+
+// Run one pp or tg test: n_prompt tokens in one go, or n_gen one at a time,
+// after filling the cache to depth. Returns false if a decode fails.
+static bool run_test(llama_context* ctx, llama_batch& batch, int n_batch, int n_vocab,
+                     int depth, bool generation, int n_tokens, int reps, BenchResult& out) {
+    std::mt19937 rng(42);
+    std::vector<double> rates;
+    for (int r = 0; r < reps; r++) {
+        llama_kv_cache_clear(ctx);
+        if (depth > 0 && !decode_tokens(ctx, batch, n_batch, 0, depth, n_vocab, rng)) return false;
+
+        int64_t t_start = llama_time_us();
+        if (generation) {
+            for (int i = 0; i < n_tokens; i++) {
+                if (!decode_tokens(ctx, batch, 1, depth + i, 1, n_vocab, rng)) return false;
+            }
+        } else if (!decode_tokens(ctx, batch, n_batch, depth, n_tokens, n_vocab, rng)) {
+            return false;
+        }
+        int64_t t_us = std::max<int64_t>(llama_time_us() - t_start, 1);
+        rates.push_back(n_tokens * 1e6 / t_us);
+    }
+    out = summarize(rates);
+    return true;
+}
+
+int main(int argc, char** argv) {
+    BenchArgs args;
+    if (!parse_args(argc, argv, args)) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+#ifdef NANOAI_BACKEND_DL
+    // CPU backend variants are pushed next to the binary; ggml loads the
+    // best one for this CPU
+    ggml_backend_load_all();
+#endif
+    llama_backend_init();
+    std::string device = json_escape(device_name());
+    int max_batch = *std::max_element(args.batches.begin(), args.batches.end());
+    int failures = 0;
+
+    for (const std::string& path : args.models) {
+        llama_model_params model_params = llama_model_default_params();
+        model_params.use_mmap = true;
+        llama_model* model = llama_load_model_from_file(path.c_str(), model_params);
+        if (!model) {
+            fprintf(stderr, "failed to load model: %s\n", path.c_str());
+            failures++;
+            continue;
+        }
+
+        char desc[128];
+        llama_model_desc(model, desc, sizeof(desc));
+        int n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(model));
+        std::string model_fields =
+            "\"device\":\"" + device + "\"" +
+            ",\"model\":\"" + json_escape(path.substr(path.find_last_of('/') + 1)) + "\"" +
+            ",\"desc\":\"" + json_escape(desc) + "\"" +
+            ",\"quant\":\"" + detect_quantization(path) + "\"" +
+            ",\"size\":" + std::to_string(llama_model_size(model)) +
+            ",\"params\":" + std::to_string(llama_model_n_params(model));
+
+        llama_batch batch = llama_batch_init(max_batch, 0, 1);
+
+        for (int depth : args.depths) {
+            for (int n_batch : args.batches) {
+                // One context per shape; thread counts change in place
+                llama_context_params ctx_params = llama_context_default_params();
+                ctx_params.n_ctx = depth + std::max(args.n_prompt, args.n_gen) + 16;
+                ctx_params.n_batch = n_batch;
+                ctx_params.n_ubatch = std::min(args.n_ubatch, n_batch);
+                ctx_params.n_threads = args.threads[0];
+                ctx_params.n_threads_batch = args.threads[0];
+                llama_context* ctx = llama_new_context_with_model(model, ctx_params);
+                if (!ctx) {
+                    fprintf(stderr, "failed to create context (depth %d, batch %d)\n", depth, n_batch);
+                    failures++;
+                    continue;
+                }
+
+                for (int n_threads : args.threads) {
+                    llama_set_n_threads(ctx, n_threads, n_threads);
+
+                    // Untimed warm-up so page-ins of the mapped weights do not count
+                    std::mt19937 rng(0);
+                    decode_tokens(ctx, batch, 1, 0, 1, n_vocab, rng);
+
+                    struct Test { const char* name; bool generation; int n_tokens; };
+                    const Test tests[] = {{"pp", false, args.n_prompt}, {"tg", true, args.n_gen}};
+                    for (const Test& test : tests) {
+                        if (test.n_tokens <= 0) continue;
+                        fprintf(stderr, "%s: %s%d, depth %d, batch %d, threads %d\n",
+                                desc, test.name, test.n_tokens, depth, n_batch, n_threads);
+
+                        BenchResult result;
+                        if (!run_test(ctx, batch, n_batch, n_vocab, depth, test.generation,
+                                      test.n_tokens, args.reps, result)) {
+                            fprintf(stderr, "decode failed\n");
+                            failures++;
+                            continue;
+                        }
+                        printf("{%s,\"test\":\"%s\",\"n_tokens\":%d,\"depth\":%d,\"n_batch\":%d,"
+                               "\"n_ubatch\":%d,\"n_threads\":%d,\"reps\":%d,"
+                               "\"tokens_per_sec\":%.3f,\"stddev\":%.3f}\n",
+                               model_fields.c_str(), test.name, test.n_tokens, depth, n_batch,
+                               ctx_params.n_ubatch, n_threads, args.reps,
+                               result.mean, result.stddev);
+                        fflush(stdout);
+                    }
+                }
+                llama_free(ctx);
+            }
+        }
+
+        llama_batch_free(batch);
+        llama_free_model(model);
+    }
+
+    llama_backend_free();
+    return failures > 0 ? 2 : 0;
+}
@@ -0,0 +1,239 @@
+/**
+ * NanoAi - HNSW approximate nearest-neighbor graph over a VectorIndex
+ *
+ * Follows Malkov & Yashunin: greedy descent through the upper layers, a
+ * beam search of width ef on each insertion layer, and the diversity
+ * heuristic for neighbor selection. Scores are inner products of
+ * normalized rows, so higher is closer.
+ */
+
+#include "hnsw_index.h"
+#include "vector_store.h"
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <queue>
+
+HnswIndex::HnswIndex(const VectorIndex& vectors, int m, int ef_construction)
+    : vectors_(vectors),
+      m_(std::max(m, 2)),
+      ef_construction_(std::max(ef_construction, m_)),
+      level_mult_(1.0 / std::log((double)m_)),
+      rng_(0x4E414E4F) {}
+
+std::vector<HnswIndex::Scored> HnswIndex::search_layer(
+    const float* query, const std::vector<Scored>& entry, int ef, int level) const {
+    if (visited_.size() < nodes_.size()) {
+        visited_.resize(nodes_.size(), 0);
+    }
+    if (++visit_gen_ == 0) {
+        std::fill(visited_.begin(), visited_.end(), 0);
+        visit_gen_ = 1;
+    }
+
+    // candidates: best first; results: worst on top, capped at ef
+    std::priority_queue<Scored> candidates;
+    std::priority_queue<Scored, std::vector<Scored>, std::greater<Scored>> results;
+    for (const Scored& e : entry) {
+        visited_[e.second] = visit_gen_;
+        candidates.push(e);
+        results.push(e);
+    }
+    while ((int)results.size() > ef) results.pop();
+
+    while (!candidates.empty()) {
+        Scored current = candidates.top();
+        if ((int)results.size() >= ef && current.first < results.top().first) break;
+        candidates.pop();
+
+        const std::vector<std::vector<int32_t>>& links = nodes_[current.second].links;
+        if (level >= (int)links.size()) continue;
+        for (int32_t next : links[level]) {
+            if (visited_[next] == visit_gen_) continue;
+            visited_[next] = visit_gen_;
+
+            float score = vectors_.score(query, next);
+            if ((int)results.size() < ef || score > results.top().first) {
+                candidates.emplace(score, next);
+                results.emplace(score, next);
+                if ((int)results.size() > ef) results.pop();
+            }
+        }
+    }
+
+    std::vector<Scored> out;
+    out.reserve(results.size());
+    while (!results.empty()) {
+        out.push_back(results.top());
+        results.pop();
+    }
+    std::reverse(out.begin(), out.end());
+    return out;
+}
+
+std::vector<int32_t> HnswIndex::select_neighbors(const std::vector<Scored>& candidates,
+                                                 size_t max_links) const {
+    // Keep a candidate only if it is closer to the base than to any
+    // neighbor already kept, then top up with the best of the rest
+    std::vector<int32_t> selected;
+    std::vector<int32_t> skipped;
+    for (const Scored& c : candidates) {
+        if (selected.size() >= max_links) break;
+        bool diverse = true;
+        for (int32_t s : selected) {
+            if (vectors_.score_rows(c.second, s) > c.first) {
+                diverse = false;
+                break;
+            }
+        }
+        (diverse ? selected : skipped).push_back(c.second);
+    }
+    for (size_t i = 0; i < skipped.size() && selected.size() < max_links; i++) {
+        selected.push_back(skipped[i]);
+    }
+    return selected;
+}
+
+void HnswIndex::add(int32_t row) {
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+    int level = (int)(-std::log(std::max(uniform(rng_), 1e-12)) * level_mult_);
+
+    nodes_.emplace_back();
+    nodes_[row].links.resize(level + 1);
+
+    if (entry_ < 0) {
+        entry_ = row;
+        max_level_ = level;
+        return;
+    }
+
+    const float* query = vectors_.row_data(row);
+    std::vector<Scored> entry{{vectors_.score(query, entry_), entry_}};
+
+    // Greedy descent to the insertion level
+    for (int l = max_level_; l > level; l--) {
+        entry = search_layer(query, entry, 1, l);
+    }
+
+    for (int l = std::min(level, max_level_); l >= 0; l--) {
+        std::vector<Scored> found = search_layer(query, entry, ef_construction_, l);
+        std::vector<int32_t> neighbors = select_neighbors(found, m_);
+        nodes_[row].links[l] = neighbors;
+
+        // Link back, pruning neighbors that now have too many links
+        size_t limit = max_links(l);
+        for (int32_t n : neighbors) {
+            std::vector<int32_t>& links = nodes_[n].links[l];
+            links.push_back(row);
+            if (links.size() > limit) {
+                std::vector<Scored> scored;
+                scored.reserve(links.size());
+                for (int32_t other : links) {
+                    scored.emplace_back(vectors_.score_rows(n, other), other);
+                }
+                std::sort(scored.begin(), scored.end(), std::greater<Scored>());
+                links = select_neighbors(scored, limit);
+            }
+        }
+        entry = std::move(found);
+    }
+
+    if (level > max_level_) {
+        entry_ = row;
+        max_level_ = level;
+    }
+}
+
+int HnswIndex::search(const float* query, int k, int ef, float min_score,
+                      const std::vector<bool>& deleted,
+                      int32_t* out_rows, float* out_scores) const {
+    if (entry_ < 0 || k <= 0) return 0;
+
+    std::vector<Scored> entry{{vectors_.score(query, entry_), entry_}};
+    for (int l = max_level_; l > 0; l--) {
+        entry = search_layer(query, entry, 1, l);
+    }
+    std::vector<Scored> found = search_layer(query, entry, std::max(ef, k), 0);
+
+    int n = 0;
+    for (const Scored& s : found) {
+        if (n >= k || s.first < min_score) break;
+        if (deleted[s.second]) continue;
+        out_rows[n] = s.second;
+        out_scores[n] = s.first;
+        n++;
+    }
+    return n;
+}
+
+void HnswIndex::compact(const std::vector<int32_t>& remap) {
+    size_t live = 0;
+    for (int32_t r : remap) {
+        if (r >= 0) live++;
+    }
+
+    // The owner has already moved the rows, so new ids score correctly
+    std::vector<Node> nodes(live);
+    std::vector<int32_t> candidates;
+    std::vector<Scored> scored;
+    int32_t entry = -1;
+    int max_level = -1;
+    for (size_t old = 0; old < nodes_.size(); old++) {
+        int32_t id = remap[old];
+        if (id < 0) continue;
+        const Node& src = nodes_[old];
+        Node& node = nodes[id];
+        node.links.resize(src.links.size());
+        for (size_t l = 0; l < node.links.size(); l++) {
+            candidates.clear();
+            bool lost = false;
+            for (int32_t n : src.links[l]) {
+                if (remap[n] >= 0) {
+                    candidates.push_back(remap[n]);
+                } else {
+                    lost = true;
+                }
+            }
+            if (!lost) {
+                node.links[l] = candidates;
+                continue;
+            }
+
+            // Reconnect through the removed neighbors' surviving links so
+            // the region they bridged stays reachable
+            for (int32_t n : src.links[l]) {
+                if (remap[n] >= 0 || l >= nodes_[n].links.size()) continue;
+                for (int32_t nn : nodes_[n].links[l]) {
+                    if (remap[nn] >= 0 && remap[nn] != id) candidates.push_back(remap[nn]);
+                }
+            }
+            std::sort(candidates.begin(), candidates.end());
+            candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+
+            scored.clear();
+            for (int32_t c : candidates) {
+                scored.emplace_back(vectors_.score_rows(id, c), c);
+            }
+            std::sort(scored.begin(), scored.end(), std::greater<Scored>());
+            if ((int)scored.size() > ef_construction_) scored.resize(ef_construction_);
+            node.links[l] = select_neighbors(scored, max_links(l));
+        }
+        if ((int)node.links.size() - 1 > max_level) {
+            max_level = node.links.size() - 1;
+            entry = id;
+        }
+    }
+
+    // Keep the entry point if it survived, otherwise the first of the
+    // highest remaining level
+    if (entry_ >= 0 && remap[entry_] >= 0) {
+        entry = remap[entry_];
+        max_level = max_level_;
+    }
+
+    nodes_ = std::move(nodes);
+    entry_ = entry;
+    max_level_ = max_level;
+    visited_.clear();
+}
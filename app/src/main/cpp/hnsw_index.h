@@ -0,0 +1,65 @@
+/**
+ * NanoAi - HNSW approximate nearest-neighbor graph over a VectorIndex
+ *
+ * Nodes are physical rows of the owning VectorIndex and are inserted in
+ * row order as rows are appended. Deleted rows stay in the graph as
+ * tombstones (still traversed, never returned) until the owner compacts.
+ *
+ * Not thread-safe: the owning VectorIndex is accessed serially.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <random>
+#include <utility>
+#include <vector>
+
+class VectorIndex;
+
+class HnswIndex {
+public:
+    HnswIndex(const VectorIndex& vectors, int m, int ef_construction);
+
+    // Insert the next physical row; row must equal size()
+    void add(int32_t row);
+
+    // Up to k live rows by score, best first. query is a padded row.
+    int search(const float* query, int k, int ef, float min_score,
+               const std::vector<bool>& deleted,
+               int32_t* out_rows, float* out_scores) const;
+
+    // Drop rows mapped to -1 and renumber the rest (remap[old] = new).
+    // Nodes that lose links are reconnected through the removed
+    // neighbors' links; the owner must already have moved the rows.
+    void compact(const std::vector<int32_t>& remap);
+
+    size_t size() const { return nodes_.size(); }
+
+private:
+    using Scored = std::pair<float, int32_t>;
+
+    struct Node {
+        std::vector<std::vector<int32_t>> links; // links[level]
+    };
+
+    std::vector<Scored> search_layer(const float* query, const std::vector<Scored>& entry,
+                                     int ef, int level) const;
+    std::vector<int32_t> select_neighbors(const std::vector<Scored>& candidates,
+                                          size_t max_links) const;
+    int max_links(int level) const { return level == 0 ? 2 * m_ : m_; }
+
+    const VectorIndex& vectors_;
+    int m_;
+    int ef_construction_;
+    double level_mult_;
+    std::mt19937 rng_;
+
+    std::vector<Node> nodes_;
+    int32_t entry_ = -1;
+    int max_level_ = -1;
+
+    // Visited marks for search_layer, reset by bumping the generation
+    mutable std::vector<uint32_t> visited_;
+    mutable uint32_t visit_gen_ = 0;
+};
@@ -9,16 +9,41 @@
 #include <android/log.h>
 #include <string>
 #include <vector>
+#include <map>
+#include <unordered_map>
 #include <mutex>
+#include <shared_mutex>
 #include <atomic>
+#include <condition_variable>
+#include <thread>
+#include <algorithm>
 #include <memory>
+#include <functional>
 #include <cstring>
 #include <cmath>
 #include <unistd.h>
+#include <sched.h>
 #include <sys/mman.h>
+#include <climits>
+#include <sys/stat.h>
+#include <sys/auxv.h>
+#include <dirent.h>
+#include <dlfcn.h>
+
+#if defined(__aarch64__)
+#include <asm/hwcap.h>
+#endif
 
 // Llama.cpp headers
 #include "llama.h"
+#include "ggml-cpu.h"
+#include "gguf.h"
+
+#include "vector_store.h"
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 // Logging macros
 #define LOG_TAG "NanoAi-JNI"
@@ -27,13 +52,188 @@
 #define LOGE(...) __android_log_print(ANDROID_LOG_ERROR, LOG_TAG, __VA_ARGS__)
 #define LOGD(...) __android_log_print(ANDROID_LOG_DEBUG, LOG_TAG, __VA_ARGS__)
 
+// Sessions multiplexed over the single context, one KV sequence each.
+// Session 0 always exists and backs the session-less API. The sequences
+// share the context's n_ctx cells rather than each getting a fixed slice:
+// an idle session keeps its sequence for prefix reuse until another
+// request needs the cells, and idle sequences are then evicted least
+// recently used first.
+static const int MAX_SESSIONS = 8;
+static const int DEFAULT_SESSION = 0;
+
+// Embedding context: texts decoded per batch and its size in tokens
+static const int EMBED_SEQS = 8;
+static const int EMBED_CTX = 1024;
+
+// Prompt chunk and compute micro-batch sizes when loadModel passes 0.
+// Smaller chunks make stop requests and other sessions wait less during a
+// long prefill; n_ubatch bounds the activation buffers.
+static const int DEFAULT_N_BATCH = 512;
+static const int DEFAULT_N_UBATCH = 256;
+
+// Speculative decoding: tokens drafted per step when loadModel passes 0
+static const int DEFAULT_N_DRAFT = 4;
+
+// Memory-pressure responses for trimMemory(), matching LlamaBridge.TrimLevel.
+// Each level includes the ones below it.
+enum TrimLevel {
+    TRIM_COLD = 1,            // mark weight pages as the first to reclaim
+    TRIM_DROP_PAGES = 2,      // drop resident weight pages; they fault back in from the file
+    TRIM_RELEASE_CONTEXT = 3, // also free the contexts, keeping the models mapped
+};
+
+// Reclaim hint from Linux 5.4; older kernels reject it with EINVAL
+#ifndef MADV_COLD
+#define MADV_COLD 20
+#endif
+
+// Warm-up passes after loadModel, matching LlamaBridge.WarmUp flags
+enum WarmUpFlags {
+    WARMUP_PAGES = 1,  // fault the mapped weights in on a background thread
+    WARMUP_DECODE = 2, // decode one token before the model is published
+};
+
+// Weights touched per slice of the background warm-up; unload waits for at
+// most one slice
+static const size_t WARMUP_SLICE_BYTES = 16 * 1024 * 1024;
+
+// arm64 hwcaps checked for the CPU report; older NDK headers lack some
+#if defined(__aarch64__)
+#ifndef HWCAP_ASIMDHP
+#define HWCAP_ASIMDHP (1 << 10)
+#endif
+#ifndef HWCAP_ASIMDDP
+#define HWCAP_ASIMDDP (1 << 20)
+#endif
+#ifndef HWCAP_SVE
+#define HWCAP_SVE (1 << 22)
+#endif
+#ifndef HWCAP2_SVE2
+#define HWCAP2_SVE2 (1 << 1)
+#endif
+#ifndef HWCAP2_I8MM
+#define HWCAP2_I8MM (1 << 13)
+#endif
+#ifndef HWCAP2_SME
+#define HWCAP2_SME (1 << 23)
+#endif
+#endif
+
+// Hot swap keeps the old model resident while the new one loads, so it
+// needs room for the new weights and KV cache with this much to spare
+static const uint64_t SWAP_HEADROOM_BYTES = 256ull * 1024 * 1024;
+
+// GPU offload: loadModel's nGpuLayers value that picks the count from free
+// device memory, and the share of that memory the weights may take
+static const int GPU_LAYERS_AUTO = -1;
+static const double GPU_MEMORY_FRACTION = 0.7;
+
+// KV cache element types accepted by loadModel, matching LlamaBridge.KvCacheType
+enum KvCacheType {
+    KV_CACHE_F16 = 0,
+    KV_CACHE_Q8_0 = 1,
+    KV_CACHE_Q4_0 = 2,
+};
+
 // Global state
-static std::mutex g_mutex;
+//
+// Lock order: g_load_mutex -> Session::mutex -> g_mutex -> g_embed_mutex ->
+// g_ctx_mutex.
+// g_mutex guards the model/context lifetime: load and unload take it
+// exclusively to swap models, everything that uses the model takes it shared.
+// g_ctx_mutex is held only around each llama_decode and the reads of its
+// outputs, so sessions interleave at token granularity.
+static std::shared_mutex g_mutex;
+static std::mutex g_ctx_mutex;
 static llama_model* g_model = nullptr;
 static llama_context* g_ctx = nullptr;
-static llama_sampler* g_sampler = nullptr;
-static std::atomic<bool> g_is_generating{false};
-static std::atomic<bool> g_stop_requested{false};
+
+// Optional draft model for speculative decoding, sharing g_model's
+// vocabulary. Its context mirrors the session sequences of g_ctx and is
+// used only by the scheduler thread, under g_ctx_mutex.
+static llama_model* g_draft_model = nullptr;
+static llama_context* g_draft_ctx = nullptr;
+static int g_n_draft = 0; // tokens drafted per step
+static std::atomic<int64_t> g_spec_drafted{0};
+static std::atomic<int64_t> g_spec_accepted{0};
+static std::atomic<int> g_active_generations{0};
+static std::atomic<int> g_last_perf_session{-1}; // session of the last finished generation
+
+// Worker threadpools shared by the chat and draft contexts, confined to
+// the performance cores. Replaced whenever the thread counts change.
+static ggml_threadpool* g_threadpool = nullptr;       // decode
+static ggml_threadpool* g_threadpool_batch = nullptr; // prefill, null when same as decode
+
+// Identity of the loaded GGUF, written into saved sessions so a snapshot is
+// never restored against a different model file
+static std::string g_model_fingerprint;
+
+// Memory-pressure state: resolved paths of the mapped chat and draft GGUFs,
+// for madvise, and the parameters to recreate contexts freed by
+// trimMemory(TRIM_RELEASE_CONTEXT) while the models stay mapped
+static std::vector<std::string> g_mapped_paths;
+static llama_context_params g_ctx_params;
+static bool g_ctx_released = false;
+
+// Loading runs outside g_mutex, one load at a time, so other calls keep
+// using the old model or fail fast instead of blocking for its duration;
+// cancelLoad() aborts it.
+// g_model_generation (guarded by g_mutex) changes whenever the loaded
+// model does, which stops a background warm-up of a model that is gone.
+static std::mutex g_load_mutex;
+static std::atomic<bool> g_load_cancelled{false};
+static uint64_t g_model_generation = 0;
+
+// Layers of g_model offloaded to the GPU; 0 when it runs on the CPU
+static int g_gpu_layers = 0;
+
+// Weights plus estimated KV cache of g_model: what unloading it frees
+static uint64_t g_model_bytes = 0;
+
+// Saved session file layout (little-endian):
+//   u32 magic, u32 version, u32 fingerprint length, fingerprint bytes,
+//   u32 token count, tokens, u64 state size, llama_state_seq data
+static const uint32_t SESSION_MAGIC = 0x5353414E; // "NASS"
+static const uint32_t SESSION_VERSION = 1;
+
+// Prefix KV cache: llama_state_seq snapshots of sequences after long
+// prefills, restored into a session when a new prompt shares more of its
+// start with a snapshot than with the session's own KV cache. Snapshots
+// live in RAM up to ram_budget; the least recently used spill to files in
+// spill_dir up to disk_budget, and are dropped after that. Everything is
+// dropped with the model. Guarded by g_prefix_mutex (after g_mutex; never
+// held together with g_ctx_mutex).
+static const size_t PREFIX_MIN_TOKENS = 256; // newly prefilled tokens worth a snapshot
+static const size_t PREFIX_MIN_GAIN = 64;    // extra matched tokens worth a restore
+
+struct PrefixEntry {
+    uint64_t id = 0;
+    std::vector<llama_token> tokens;     // KV contents, positions [0, n)
+    std::shared_ptr<std::vector<uint8_t>> state; // null while spilled
+    size_t state_size = 0;
+    uint64_t last_used = 0;
+};
+
+struct PrefixCacheStats {
+    uint64_t hits = 0;
+    uint64_t disk_hits = 0;   // hits that had to read a spilled snapshot
+    uint64_t misses = 0;
+    uint64_t tokens_saved = 0; // prompt tokens restored instead of decoded
+    uint64_t stores = 0;
+    uint64_t spills = 0;
+    uint64_t evictions = 0;
+};
+
+static std::mutex g_prefix_mutex;
+static std::vector<PrefixEntry> g_prefix_entries;
+static size_t g_prefix_ram_budget = 0;  // 0 disables the cache
+static size_t g_prefix_disk_budget = 0;
+static std::string g_prefix_spill_dir;
+static size_t g_prefix_ram_bytes = 0;
+static size_t g_prefix_disk_bytes = 0;
+static uint64_t g_prefix_clock = 0;
+static uint64_t g_prefix_next_id = 1;
+static PrefixCacheStats g_prefix_stats;
 
 // Generation parameters
 struct GenerationParams {
@@ -42,29 +242,242 @@ struct GenerationParams {
     float top_p = 0.9f;
     int top_k = 40;
     float repeat_penalty = 1.1f;
-    int n_threads = 4;
+    int repeat_last_n = 64;
+    float min_p = 0.05f;
+    float typical_p = 1.0f;
+    float mirostat_tau = 5.0f;
+    float mirostat_eta = 0.1f;
+    int n_threads = 4;       // decode
+    int n_threads_batch = 4; // prefill and embeddings
     int n_ctx = 2048;
 };
 static GenerationParams g_params;
 
+// Resolved sampling settings for one generation. A session keeps its chain
+// while these stay the same and rebuilds it when they change.
+struct SamplerConfig {
+    float temperature = 0.0f;
+    float top_p = 1.0f;
+    int top_k = 0;
+    float min_p = 0.0f;
+    float typical_p = 1.0f;
+    float repeat_penalty = 1.0f;
+    int repeat_last_n = 0;
+    int mirostat = 0;          // 0 = off, 1 = Mirostat, 2 = Mirostat 2.0
+    float mirostat_tau = 5.0f;
+    float mirostat_eta = 0.1f;
+    std::string grammar;       // GBNF, empty for unconstrained output
+
+    bool operator==(const SamplerConfig& o) const {
+        return temperature == o.temperature && top_p == o.top_p && top_k == o.top_k &&
+               min_p == o.min_p && typical_p == o.typical_p &&
+               repeat_penalty == o.repeat_penalty && repeat_last_n == o.repeat_last_n &&
+               mirostat == o.mirostat && mirostat_tau == o.mirostat_tau &&
+               mirostat_eta == o.mirostat_eta && grammar == o.grammar;
+    }
+    bool operator!=(const SamplerConfig& o) const { return !(*this == o); }
+};
+
 // Embedding cache for RAG
 struct EmbeddingResult {
     std::vector<float> embedding;
     bool success;
 };
 
-// Helper: Convert Java string to C++ string
+// Metrics of one finished generation, reported by getPerfStats()
+struct PerfStats {
+    int session_id = 0;
+    double t_tokenize_ms = 0;
+    int n_prompt = 0;          // prompt tokens after truncation
+    int n_cached = 0;          // of which reused from the KV cache
+    double t_prefill_ms = 0;   // decode steps that carried prompt tokens
+    int n_decode = 0;          // tokens generated
+    double t_decode_ms = 0;    // decode steps after the prompt
+    double t_sample_ms = 0;
+    double t_first_token_ms = 0; // from the call until the first token
+    double t_total_ms = 0;
+    int n_drafted = 0;
+    int n_accepted = 0;
+    int kv_used = 0;           // cells in use across all sequences
+    int kv_size = 0;
+    size_t rss_kb = 0;
+    size_t rss_peak_kb = 0;
+};
+
+// One conversation or embedding stream, bound to its own KV sequence
+struct Session {
+    int id = 0;
+    llama_seq_id seq_id = 0;
+
+    // Serializes calls on this session; other sessions are unaffected
+    std::mutex mutex;
+
+    // Tokens currently held in the KV cache for seq_id, in position order.
+    // Lets the next prompt skip re-decoding the prefix it shares with this one.
+    std::vector<llama_token> kv_tokens;
+
+    // Context shifting: the first n_keep tokens are pinned, and n_shifted
+    // tokens of the conversation after them have been evicted from the KV
+    // cache. The next prompt drops the same span so it still lines up.
+    int n_keep = 0;
+    int n_shifted = 0;
+
+    // Sampling candidates, one per vocab entry. Reused across tokens so the
+    // decode loop does not allocate; only touched by the scheduler thread.
+    std::vector<llama_token_data> candidates;
+
+    // Tokens held in the draft context for seq_id, like kv_tokens.
+    // Only touched by the scheduler thread.
+    std::vector<llama_token> draft_kv_tokens;
+
+    // Sampler chain built for smpl_config, reset at the start of each
+    // generation. Freed with the model, since a grammar refers to its vocab.
+    llama_sampler* smpl = nullptr;
+    SamplerConfig smpl_config;
+
+    // Last generation's metrics; perf_mutex lets them be read while the
+    // next generation holds mutex
+    std::mutex perf_mutex;
+    PerfStats perf;
+    bool has_perf = false;
+
+    std::atomic<bool> stop_requested{false};
+    std::atomic<bool> is_generating{false};
+
+    // g_session_clock at the last generation, for evicting idle sequences
+    // least recently used first. Guarded by mutex.
+    uint64_t last_used = 0;
+
+    ~Session() {
+        if (smpl) llama_sampler_free(smpl);
+    }
+};
+
+static std::mutex g_sessions_mutex;
+static std::map<int, std::shared_ptr<Session>> g_sessions;
+static int g_next_session_id = 1;
+static std::atomic<uint64_t> g_session_clock{0};
+
+// Embedding state, separate from the chat context. g_embd_model is only
+// set when a dedicated embedding GGUF is loaded; otherwise g_embd_ctx is a
+// second context on g_model. Guarded by g_embed_mutex (after g_mutex,
+// before g_ctx_mutex), which also guards writes to g_params.n_threads and
+// n_threads_batch under a shared g_mutex.
+static std::mutex g_embed_mutex;
+static llama_model* g_embd_model = nullptr;
+static llama_context* g_embd_ctx = nullptr;
+static int g_embd_pooling = 0; // EmbeddingPooling, MEAN by default
+
+// Tokenized chat segments (one formatted message each), keyed by a hash of
+// their text, so a system prompt or repeated message is tokenized once.
+// Dropped with the model, and all at once when it outgrows the limit.
+// Guarded by g_segment_mutex.
+static const size_t SEGMENT_CACHE_TOKENS = 16384;
+struct CachedSegment {
+    std::string text;
+    std::vector<llama_token> tokens;
+};
+static std::mutex g_segment_mutex;
+static std::unordered_map<uint64_t, CachedSegment> g_segment_cache;
+static size_t g_segment_cache_tokens = 0;
+
+// Helper: Convert Java string to C++ string in standard UTF-8.
+// GetStringUTFChars would return modified UTF-8, where emoji and other
+// characters outside the BMP become surrogate pairs the tokenizer cannot read.
 static std::string jstring_to_string(JNIEnv* env, jstring jstr) {
     if (jstr == nullptr) return "";
-    const char* chars = env->GetStringUTFChars(jstr, nullptr);
-    std::string result(chars);
-    env->ReleaseStringUTFChars(jstr, chars);
+    jsize len = env->GetStringLength(jstr);
+    std::string result;
+    result.reserve(len + len / 2);
+
+    const jchar* chars = env->GetStringCritical(jstr, nullptr);
+    if (!chars) return "";
+    for (jsize i = 0; i < len; i++) {
+        uint32_t c = chars[i];
+        if (c >= 0xD800 && c <= 0xDBFF && i + 1 < len && chars[i + 1] >= 0xDC00 && chars[i + 1] <= 0xDFFF) {
+            c = 0x10000 + ((c - 0xD800) << 10) + (chars[++i] - 0xDC00);
+        } else if (c >= 0xD800 && c <= 0xDFFF) {
+            c = 0xFFFD; // unpaired surrogate
+        }
+
+        if (c < 0x80) {
+            result += (char)c;
+        } else if (c < 0x800) {
+            result += (char)(0xC0 | (c >> 6));
+            result += (char)(0x80 | (c & 0x3F));
+        } else if (c < 0x10000) {
+            result += (char)(0xE0 | (c >> 12));
+            result += (char)(0x80 | ((c >> 6) & 0x3F));
+            result += (char)(0x80 | (c & 0x3F));
+        } else {
+            result += (char)(0xF0 | (c >> 18));
+            result += (char)(0x80 | ((c >> 12) & 0x3F));
+            result += (char)(0x80 | ((c >> 6) & 0x3F));
+            result += (char)(0x80 | (c & 0x3F));
+        }
+    }
+    env->ReleaseStringCritical(jstr, chars);
     return result;
 }
 
-// Helper: Convert C++ string to Java string
+// Helper: Convert UTF-8 C++ string to Java string. NewStringUTF expects
+// modified UTF-8 and rejects 4-byte sequences, so this decodes to UTF-16;
+// malformed bytes become U+FFFD.
 static jstring string_to_jstring(JNIEnv* env, const std::string& str) {
-    return env->NewStringUTF(str.c_str());
+    std::vector<jchar> out;
+    out.reserve(str.size());
+
+    const unsigned char* p = (const unsigned char*)str.data();
+    const unsigned char* end = p + str.size();
+    while (p < end) {
+        uint32_t c = *p++;
+        int extra = 0;
+        if (c >= 0xF8) extra = -1;
+        else if (c >= 0xF0) extra = 3;
+        else if (c >= 0xE0) extra = 2;
+        else if (c >= 0xC0) extra = 1;
+        else if (c >= 0x80) extra = -1;
+
+        if (extra < 0) {
+            c = 0xFFFD; // stray continuation byte, or an invalid lead byte
+        } else if (extra > 0) {
+            c &= 0x3F >> extra;
+            int i = 0;
+            for (; i < extra && p < end && (*p & 0xC0) == 0x80; i++) {
+                c = (c << 6) | (*p++ & 0x3F);
+            }
+            if (i < extra) c = 0xFFFD; // truncated sequence
+        }
+
+        if (c >= 0x10000 && c <= 0x10FFFF) {
+            c -= 0x10000;
+            out.push_back((jchar)(0xD800 + (c >> 10)));
+            out.push_back((jchar)(0xDC00 + (c & 0x3FF)));
+        } else {
+            out.push_back((jchar)(c > 0x10FFFF ? 0xFFFD : c));
+        }
+    }
+    return env->NewString(out.data(), out.size());
+}
+
+// Helper: Read a Java String[] into UTF-8 strings
+static std::vector<std::string> jstring_array_to_vector(JNIEnv* env, jobjectArray texts) {
+    int count = texts ? env->GetArrayLength(texts) : 0;
+    std::vector<std::string> text_vec(count);
+    for (int i = 0; i < count; i++) {
+        jstring text = (jstring)env->GetObjectArrayElement(texts, i);
+        text_vec[i] = jstring_to_string(env, text);
+        env->DeleteLocalRef(text);
+    }
+    return text_vec;
+}
+
+// Helper: Copy a Java byte[] of UTF-8 into a string
+static std::string jbytes_to_string(JNIEnv* env, jbyteArray bytes) {
+    if (bytes == nullptr) return "";
+    std::string result(env->GetArrayLength(bytes), '\0');
+    env->GetByteArrayRegion(bytes, 0, result.size(), reinterpret_cast<jbyte*>(&result[0]));
+    return result;
 }
 
 // Helper: Get available memory
@@ -85,438 +498,3851 @@ static size_t get_available_memory() {
     return available;
 }
 
-// Helper: Tokenize text
-static std::vector<llama_token> tokenize(const std::string& text, bool add_bos) {
-    if (!g_model) return {};
+// Helper: Resident set size and its peak (VmRSS, VmHWM) in KB
+static void get_rss_kb(size_t& rss, size_t& peak) {
+    rss = peak = 0;
+    FILE* status = fopen("/proc/self/status", "r");
+    if (!status) return;
 
-    const llama_vocab* vocab = llama_model_get_vocab(g_model);
-    int n_tokens = text.length() + (add_bos ? 1 : 0);
-    std::vector<llama_token> tokens(n_tokens);
+    char line[256];
+    while (fgets(line, sizeof(line), status)) {
+        if (strncmp(line, "VmRSS:", 6) == 0) {
+            sscanf(line, "VmRSS: %zu", &rss);
+        } else if (strncmp(line, "VmHWM:", 6) == 0) {
+            sscanf(line, "VmHWM: %zu", &peak);
+        }
+    }
+    fclose(status);
+}
 
-    n_tokens = llama_tokenize(vocab, text.c_str(), text.length(),
-                              tokens.data(), tokens.size(), add_bos, false);
+// CPU cores, read once from sysfs. Performance cores are those with at
+// least half the capacity of the fastest one, which on big.LITTLE SoCs
+// selects the big and prime clusters and leaves out the little cores.
+struct CpuTopology {
+    int n_cpus = 0;
+    std::vector<int> perf_cpus;
+};
 
-    if (n_tokens < 0) {
-        tokens.resize(-n_tokens);
-        n_tokens = llama_tokenize(vocab, text.c_str(), text.length(),
-                                  tokens.data(), tokens.size(), add_bos, false);
+// Helper: Read one integer from a sysfs file, -1 if unreadable
+static long read_sysfs_long(const char* path) {
+    FILE* f = fopen(path, "r");
+    if (!f) return -1;
+    long value = -1;
+    if (fscanf(f, "%ld", &value) != 1) value = -1;
+    fclose(f);
+    return value;
+}
+
+// Helper: Detect performance cores from cpu_capacity, falling back to the
+// cpufreq maximum. If neither is readable every core counts as one.
+static const CpuTopology& cpu_topology() {
+    static CpuTopology topo;
+    static std::once_flag once;
+    std::call_once(once, [] {
+        topo.n_cpus = std::max(1, (int)sysconf(_SC_NPROCESSORS_CONF));
+        const char* sources[] = {
+            "/sys/devices/system/cpu/cpu%d/cpu_capacity",
+            "/sys/devices/system/cpu/cpu%d/cpufreq/cpuinfo_max_freq",
+        };
+        std::vector<long> capacity(topo.n_cpus);
+        for (const char* source : sources) {
+            long max_capacity = 0;
+            for (int cpu = 0; cpu < topo.n_cpus; cpu++) {
+                char path[96];
+                snprintf(path, sizeof(path), source, cpu);
+                capacity[cpu] = read_sysfs_long(path);
+                max_capacity = std::max(max_capacity, capacity[cpu]);
+            }
+            if (max_capacity <= 0) continue;
+            for (int cpu = 0; cpu < topo.n_cpus; cpu++) {
+                if (capacity[cpu] * 2 >= max_capacity) topo.perf_cpus.push_back(cpu);
+            }
+            break;
+        }
+        if (topo.perf_cpus.empty()) {
+            for (int cpu = 0; cpu < topo.n_cpus; cpu++) topo.perf_cpus.push_back(cpu);
+        }
+        LOGI("CPU topology: %d cores, %zu performance", topo.n_cpus, topo.perf_cpus.size());
+    });
+    return topo;
+}
+
+// Helper: Thread count used when the caller passes 0. Decode is bound by
+// memory bandwidth, so the performance cores alone are as fast as all
+// cores and avoid every barrier waiting on a little core.
+static int default_thread_count() {
+    return std::clamp((int)cpu_topology().perf_cpus.size(), 1, 8);
+}
+
+// Helper: Confine the calling thread to the performance cores. The
+// scheduler thread computes its own share of every graph, so it must not
+// run on a little core either.
+static void pin_thread_to_perf_cores() {
+    const CpuTopology& topo = cpu_topology();
+    if ((int)topo.perf_cpus.size() >= topo.n_cpus) return;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : topo.perf_cpus) CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+        LOGW("Failed to pin thread to performance cores (errno: %d)", errno);
     }
+}
 
-    tokens.resize(n_tokens);
-    return tokens;
+// Helper: Build an identity string for a model file. Combines size, mtime
+// and a hash of the GGUF header region, which covers metadata and tensor
+// layout without reading the whole multi-GB file.
+static std::string model_fingerprint(const std::string& path) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) return "";
+
+    FILE* f = fopen(path.c_str(), "rb");
+    if (!f) return "";
+
+    // FNV-1a over the first 1 MB
+    uint64_t hash = 1469598103934665603ULL;
+    std::vector<unsigned char> buf(64 * 1024);
+    size_t remaining = 1024 * 1024;
+    while (remaining > 0) {
+        size_t n = fread(buf.data(), 1, std::min(remaining, buf.size()), f);
+        if (n == 0) break;
+        for (size_t i = 0; i < n; i++) {
+            hash ^= buf[i];
+            hash *= 1099511628211ULL;
+        }
+        remaining -= n;
+    }
+    fclose(f);
+
+    char id[96];
+    snprintf(id, sizeof(id), "%lld-%lld-%016llx",
+             (long long)st.st_size, (long long)st.st_mtime, (unsigned long long)hash);
+    return id;
 }
 
-// Helper: Detokenize
-static std::string detokenize(const std::vector<llama_token>& tokens) {
-    if (!g_model) return "";
+static ggml_type to_ggml_kv_type(int type) {
+    switch (type) {
+        case KV_CACHE_Q8_0: return GGML_TYPE_Q8_0;
+        case KV_CACHE_Q4_0: return GGML_TYPE_Q4_0;
+        default: return GGML_TYPE_F16;
+    }
+}
 
-    const llama_vocab* vocab = llama_model_get_vocab(g_model);
-    std::string result;
-    for (llama_token token : tokens) {
-        char buf[256];
-        int n = llama_token_to_piece(vocab, token, buf, sizeof(buf), 0, false);
-        if (n > 0) {
-            result.append(buf, n);
+// Helper: Read an integer GGUF key, def if missing. Per-layer arrays give
+// their largest entry, which bounds every layer.
+static int64_t gguf_get_int(const gguf_context* gguf, const std::string& key, int64_t def) {
+    auto id = gguf_find_key(gguf, key.c_str());
+    if (id < 0) return def;
+
+    switch (gguf_get_kv_type(gguf, id)) {
+        case GGUF_TYPE_UINT32: return gguf_get_val_u32(gguf, id);
+        case GGUF_TYPE_INT32: return gguf_get_val_i32(gguf, id);
+        case GGUF_TYPE_UINT64: return (int64_t)gguf_get_val_u64(gguf, id);
+        case GGUF_TYPE_ARRAY: {
+            enum gguf_type type = gguf_get_arr_type(gguf, id);
+            if (type != GGUF_TYPE_UINT32 && type != GGUF_TYPE_INT32) return def;
+            const int32_t* values = (const int32_t*)gguf_get_arr_data(gguf, id);
+            size_t n = gguf_get_arr_n(gguf, id);
+            if (n == 0) return def;
+            return *std::max_element(values, values + n);
         }
+        default: return def;
     }
-    return result;
 }
 
-extern "C" {
+// Helper: KV cache size in bytes for n_ctx tokens of a GGUF model, from its
+// metadata alone, so it can be checked before anything is allocated.
+// Returns 0 if the file cannot be read.
+static uint64_t estimate_kv_bytes(const std::string& path, int n_ctx, ggml_type type_k, ggml_type type_v) {
+    gguf_init_params params = {/* no_alloc */ true, /* ctx */ nullptr};
+    gguf_context* gguf = gguf_init_from_file(path.c_str(), params);
+    if (!gguf) return 0;
 
-// ============================================================================
-// Model Management
-// ============================================================================
+    std::string arch;
+    auto arch_id = gguf_find_key(gguf, "general.architecture");
+    if (arch_id >= 0) arch = gguf_get_val_str(gguf, arch_id);
 
-JNIEXPORT jboolean JNICALL
-Java_com_nanoai_llm_LlamaBridge_loadModel(
-    JNIEnv* env,
-    jobject /* this */,
-    jstring modelPath,
-    jint nCtx,
-    jint nThreads
-) {
-    std::lock_guard<std::mutex> lock(g_mutex);
+    int64_t n_layer = gguf_get_int(gguf, arch + ".block_count", 0);
+    int64_t n_embd = gguf_get_int(gguf, arch + ".embedding_length", 0);
+    int64_t n_head = gguf_get_int(gguf, arch + ".attention.head_count", 0);
+    int64_t n_head_kv = gguf_get_int(gguf, arch + ".attention.head_count_kv", n_head);
+    int64_t head_k = gguf_get_int(gguf, arch + ".attention.key_length", n_head > 0 ? n_embd / n_head : 0);
+    int64_t head_v = gguf_get_int(gguf, arch + ".attention.value_length", head_k);
+    gguf_free(gguf);
+
+    if (n_layer <= 0 || n_head_kv <= 0 || head_k <= 0 || head_v <= 0) return 0;
+    uint64_t per_layer_token = ggml_row_size(type_k, head_k * n_head_kv) +
+                               ggml_row_size(type_v, head_v * n_head_kv);
+    return per_layer_token * n_layer * n_ctx;
+}
 
-    // Unload existing model first
-    if (g_sampler) {
-        llama_sampler_free(g_sampler);
-        g_sampler = nullptr;
+// Helper: The GPU device ggml registered, or null in CPU-only builds and
+// when the backend found no usable device
+static ggml_backend_dev_t gpu_device() {
+    for (size_t i = 0; i < ggml_backend_dev_count(); i++) {
+        ggml_backend_dev_t dev = ggml_backend_dev_get(i);
+        if (ggml_backend_dev_type(dev) == GGML_BACKEND_DEVICE_TYPE_GPU) return dev;
     }
-    if (g_ctx) {
-        llama_free(g_ctx);
-        g_ctx = nullptr;
+    return nullptr;
+}
+
+// Helper: Layers to offload for a loadModel request. GPU_LAYERS_AUTO offloads
+// every layer (and the output) if weights and KV cache fit in the memory the
+// GPU and system can spare, else the share that fits. A request without a
+// GPU runs on the CPU.
+static int resolve_gpu_layers(int requested, const std::string& path, uint64_t file_size, uint64_t kv_bytes) {
+    if (requested == 0) return 0;
+    ggml_backend_dev_t dev = gpu_device();
+    if (!dev) {
+        LOGI("No GPU backend available, running on the CPU");
+        return 0;
     }
-    if (g_model) {
-        llama_free_model(g_model);
-        g_model = nullptr;
+    if (requested > 0) return requested;
+
+    gguf_init_params params = {/* no_alloc */ true, /* ctx */ nullptr};
+    gguf_context* gguf = gguf_init_from_file(path.c_str(), params);
+    if (!gguf) return 0;
+    std::string arch;
+    auto arch_id = gguf_find_key(gguf, "general.architecture");
+    if (arch_id >= 0) arch = gguf_get_val_str(gguf, arch_id);
+    int64_t n_layer = gguf_get_int(gguf, arch + ".block_count", 0);
+    gguf_free(gguf);
+    if (n_layer <= 0) return 0;
+
+    // Mobile GPUs share system RAM, so free device memory alone overstates it
+    size_t free_bytes = 0, total_bytes = 0;
+    ggml_backend_dev_memory(dev, &free_bytes, &total_bytes);
+    double budget = std::min<double>(free_bytes, get_available_memory()) * GPU_MEMORY_FRACTION;
+    double per_layer = (double)(file_size + kv_bytes) / (n_layer + 1);
+    int layers = (int)std::min<double>(n_layer + 1, budget / per_layer);
+    LOGI("GPU %s: %.0f of %.0f MB free, offloading %d of %lld layers",
+         ggml_backend_dev_description(dev), free_bytes / (1024.0 * 1024.0), total_bytes / (1024.0 * 1024.0),
+         layers, (long long)n_layer + 1);
+    return std::max(layers, 0);
+}
+
+// Helper: Check that a file is a complete GGUF model before it is loaded:
+// the magic, header and metadata parse, an architecture is named, and every
+// tensor's data lies inside the file, which catches truncated downloads.
+// Reads the metadata only. Sets error and returns false otherwise.
+static bool validate_gguf(const std::string& path, std::string& error) {
+    struct stat st;
+    FILE* file = fopen(path.c_str(), "rb");
+    if (!file || fstat(fileno(file), &st) != 0) {
+        if (file) fclose(file);
+        error = "Cannot open file";
+        return false;
+    }
+    char magic[4] = {0};
+    size_t n_read = fread(magic, 1, sizeof(magic), file);
+    fclose(file);
+    if (n_read != sizeof(magic) || memcmp(magic, "GGUF", sizeof(magic)) != 0) {
+        error = "Not a GGUF file";
+        return false;
     }
 
-    std::string path = jstring_to_string(env, modelPath);
-    LOGI("Loading model from: %s", path.c_str());
+    gguf_init_params params = {/* no_alloc */ true, /* ctx */ nullptr};
+    gguf_context* gguf = gguf_init_from_file(path.c_str(), params);
+    if (!gguf) {
+        error = "Corrupt GGUF header or metadata";
+        return false;
+    }
 
-    // Check available memory
-    size_t available = get_available_memory();
-    LOGI("Available memory: %zu MB", available / (1024 * 1024));
+    if (gguf_find_key(gguf, "general.architecture") < 0) {
+        error = "No model architecture in metadata";
+    } else if (gguf_get_n_tensors(gguf) == 0) {
+        error = "No tensors";
+    } else {
+        size_t data_offset = gguf_get_data_offset(gguf);
+        uint64_t data_end = data_offset;
+        for (int64_t i = 0; i < gguf_get_n_tensors(gguf); i++) {
+            data_end = std::max<uint64_t>(data_end, data_offset + gguf_get_tensor_offset(gguf, i) +
+                                                    gguf_get_tensor_size(gguf, i));
+        }
+        if (data_end > (uint64_t)st.st_size) {
+            char buf[96];
+            snprintf(buf, sizeof(buf), "Truncated: %lld of %llu bytes",
+                     (long long)st.st_size, (unsigned long long)data_end);
+            error = buf;
+        }
+    }
+    gguf_free(gguf);
+    return error.empty();
+}
 
-    // Initialize llama backend (only once)
-    static bool backend_initialized = false;
-    if (!backend_initialized) {
-        llama_backend_init();
-        backend_initialized = true;
+// Helper: Look up a session by handle, nullptr if unknown
+static std::shared_ptr<Session> get_session(int session_id) {
+    std::lock_guard<std::mutex> lock(g_sessions_mutex);
+    auto it = g_sessions.find(session_id);
+    return it != g_sessions.end() ? it->second : nullptr;
+}
+
+// Helper: Ensure the default session exists
+static void ensure_default_session() {
+    std::lock_guard<std::mutex> lock(g_sessions_mutex);
+    if (g_sessions.find(DEFAULT_SESSION) == g_sessions.end()) {
+        auto session = std::make_shared<Session>();
+        session->id = DEFAULT_SESSION;
+        session->seq_id = 0;
+        g_sessions[DEFAULT_SESSION] = session;
     }
+}
 
-    // Model parameters
-    llama_model_params model_params = llama_model_default_params();
-    model_params.use_mmap = true;  // Memory-mapped for efficiency
-    model_params.use_mlock = false; // Don't lock in RAM (save memory)
+// Helper: Forget what every session has in the KV cache, and drop sampler
+// chains. Used when the context is freed or recreated; caller must hold
+// g_mutex exclusively.
+static void reset_session_caches() {
+    std::lock_guard<std::mutex> lock(g_sessions_mutex);
+    for (auto& entry : g_sessions) {
+        Session& session = *entry.second;
+        session.kv_tokens.clear();
+        session.draft_kv_tokens.clear();
+        session.n_shifted = 0;
+        if (session.smpl) {
+            llama_sampler_free(session.smpl);
+            session.smpl = nullptr;
+        }
+    }
+}
 
-    // Check file exists and is readable
-    FILE* test_file = fopen(path.c_str(), "rb");
-    if (!test_file) {
-        LOGE("Cannot open model file: %s (errno: %d)", path.c_str(), errno);
-        return JNI_FALSE;
+// Helper: Features the CPU reports through AT_HWCAP/AT_HWCAP2 that ggml
+// has kernels for
+static std::vector<std::string> cpu_hwcaps() {
+    std::vector<std::string> caps;
+#if defined(__aarch64__)
+    unsigned long hwcap = getauxval(AT_HWCAP);
+    unsigned long hwcap2 = getauxval(AT_HWCAP2);
+    if (hwcap & HWCAP_ASIMDHP) caps.push_back("fp16");
+    if (hwcap & HWCAP_ASIMDDP) caps.push_back("dotprod");
+    if (hwcap2 & HWCAP2_I8MM) caps.push_back("i8mm");
+    if (hwcap & HWCAP_SVE) caps.push_back("sve");
+    if (hwcap2 & HWCAP2_SVE2) caps.push_back("sve2");
+    if (hwcap2 & HWCAP2_SME) caps.push_back("sme");
+#endif
+    return caps;
+}
+
+// Helper: Features the CPU backend in use was compiled with, e.g. DOTPROD
+// or MATMUL_INT8; with variants, those of the one ggml picked
+static std::vector<std::string> cpu_backend_features() {
+    std::vector<std::string> features;
+    ggml_backend_dev_t dev = ggml_backend_dev_by_type(GGML_BACKEND_DEVICE_TYPE_CPU);
+    ggml_backend_reg_t reg = dev ? ggml_backend_dev_backend_reg(dev) : nullptr;
+    auto get_features = reg ? (ggml_backend_get_features_t)
+        ggml_backend_reg_get_proc_address(reg, "ggml_backend_get_features") : nullptr;
+    if (!get_features) return features;
+    for (ggml_backend_feature* f = get_features(reg); f->name; f++) {
+        if (strcmp(f->value, "0") != 0) features.push_back(f->name);
     }
-    fseek(test_file, 0, SEEK_END);
-    long file_size = ftell(test_file);
-    fclose(test_file);
-    LOGI("Model file size: %ld bytes", file_size);
+    return features;
+}
 
-    // Load model
-    LOGI("Calling llama_load_model_from_file...");
-    g_model = llama_load_model_from_file(path.c_str(), model_params);
-    if (!g_model) {
-        LOGE("Failed to load model from: %s", path.c_str());
-        LOGE("This may be due to: incompatible model format, corrupted file, or insufficient memory");
-        return JNI_FALSE;
+#ifdef NANOAI_BACKEND_DL
+// Helper: Load ggml's backend libraries from the directory this library
+// was loaded from, where the APK's native libraries are extracted. For the
+// CPU, ggml loads the variant scoring highest against this CPU's hwcaps.
+static void load_backend_variants() {
+    Dl_info info;
+    std::string dir;
+    if (dladdr((void*)&load_backend_variants, &info) && info.dli_fname) {
+        dir = info.dli_fname;
+        dir = dir.substr(0, dir.find_last_of('/'));
+    }
+    if (dir.empty()) {
+        ggml_backend_load_all();
+    } else {
+        ggml_backend_load_all_from_path(dir.c_str());
+    }
+    if (!ggml_backend_dev_by_type(GGML_BACKEND_DEVICE_TYPE_CPU)) {
+        LOGE("No CPU backend variant could be loaded from %s", dir.c_str());
     }
+}
+#endif
 
-    // Context parameters
-    llama_context_params ctx_params = llama_context_default_params();
-    ctx_params.n_ctx = nCtx > 0 ? nCtx : g_params.n_ctx;
-    ctx_params.n_threads = nThreads > 0 ? nThreads : g_params.n_threads;
-    ctx_params.n_threads_batch = ctx_params.n_threads;
-    ctx_params.seed = (uint32_t)time(nullptr);
+// Helper: Initialize llama backend (only once)
+static void init_backend() {
+    static std::once_flag backend_once;
+    std::call_once(backend_once, [] {
+#ifdef NANOAI_BACKEND_DL
+        load_backend_variants();
+#endif
+        llama_backend_init();
 
-    // Create context
-    g_ctx = llama_new_context_with_model(g_model, ctx_params);
-    if (!g_ctx) {
-        LOGE("Failed to create context");
-        llama_free_model(g_model);
-        g_model = nullptr;
-        return JNI_FALSE;
+        std::string caps, features;
+        for (const std::string& cap : cpu_hwcaps()) caps += " " + cap;
+        for (const std::string& feature : cpu_backend_features()) features += " " + feature;
+        LOGI("CPU hwcaps:%s; kernels:%s", caps.empty() ? " none" : caps.c_str(),
+             features.empty() ? " none" : features.c_str());
+    });
+}
+
+// ggml CPU backend functions. With NANOAI_BACKEND_DL the backend is a
+// library chosen at runtime, so they are looked up rather than linked.
+struct CpuBackendProcs {
+    decltype(ggml_threadpool_new)* threadpool_new = nullptr;
+    decltype(ggml_threadpool_free)* threadpool_free = nullptr;
+};
+
+static const CpuBackendProcs& cpu_backend_procs() {
+    static const CpuBackendProcs procs = [] {
+        init_backend();
+        CpuBackendProcs p;
+        ggml_backend_dev_t dev = ggml_backend_dev_by_type(GGML_BACKEND_DEVICE_TYPE_CPU);
+        ggml_backend_reg_t reg = dev ? ggml_backend_dev_backend_reg(dev) : nullptr;
+        if (reg) {
+            p.threadpool_new = (decltype(p.threadpool_new))
+                ggml_backend_reg_get_proc_address(reg, "ggml_threadpool_new");
+            p.threadpool_free = (decltype(p.threadpool_free))
+                ggml_backend_reg_get_proc_address(reg, "ggml_threadpool_free");
+        }
+        return p;
+    }();
+    return procs;
+}
+
+// Helper: Model that embeddings run on
+static llama_model* embedding_model() {
+    return g_embd_model ? g_embd_model : g_model;
+}
+
+// Helper: Free the embedding context and dedicated model. Caller must hold
+// g_embed_mutex, or g_mutex exclusively.
+static void free_embedding_locked() {
+    if (g_embd_ctx) {
+        llama_free(g_embd_ctx);
+        g_embd_ctx = nullptr;
+    }
+    if (g_embd_model) {
+        llama_free_model(g_embd_model);
+        g_embd_model = nullptr;
     }
+}
 
-    // Update params
-    g_params.n_ctx = ctx_params.n_ctx;
-    g_params.n_threads = ctx_params.n_threads;
+// Helper: Create a ggml threadpool of n_threads workers, confined to the
+// performance cores when they can hold one worker each
+static ggml_threadpool* create_threadpool(int n_threads) {
+    const CpuTopology& topo = cpu_topology();
+    ggml_threadpool_params params = ggml_threadpool_params_default(n_threads);
+    if (n_threads <= (int)topo.perf_cpus.size() && (int)topo.perf_cpus.size() < topo.n_cpus) {
+        for (int cpu : topo.perf_cpus) {
+            if (cpu < GGML_MAX_N_THREADS) params.cpumask[cpu] = true;
+        }
+        // Workers float within the mask rather than one core each, so a
+        // busy core does not stall a fixed worker
+        params.strict_cpu = false;
+    }
 
-    LOGI("Model loaded successfully. Context size: %d, Threads: %d",
-         ctx_params.n_ctx, ctx_params.n_threads);
+    // ggml also applies the mask to the creating thread; keep the caller's
+    cpu_set_t saved;
+    bool restore = sched_getaffinity(0, sizeof(saved), &saved) == 0;
+    auto threadpool_new = cpu_backend_procs().threadpool_new;
+    ggml_threadpool* pool = threadpool_new ? threadpool_new(&params) : nullptr;
+    if (restore) sched_setaffinity(0, sizeof(saved), &saved);
+    if (!pool) LOGW("Failed to create threadpool of %d threads", n_threads);
+    return pool;
+}
 
-    return JNI_TRUE;
+// Helper: Free the worker threadpools. Contexts must be detached or freed.
+static void free_threadpools() {
+    auto threadpool_free = cpu_backend_procs().threadpool_free;
+    if (g_threadpool_batch) {
+        threadpool_free(g_threadpool_batch);
+        g_threadpool_batch = nullptr;
+    }
+    if (g_threadpool) {
+        threadpool_free(g_threadpool);
+        g_threadpool = nullptr;
+    }
 }
 
-JNIEXPORT void JNICALL
-Java_com_nanoai_llm_LlamaBridge_unloadModel(
-    JNIEnv* env,
-    jobject /* this */
-) {
-    std::lock_guard<std::mutex> lock(g_mutex);
+// Helper: Use n_threads for decode and n_threads_batch for prefill on the
+// chat and draft contexts, on fresh threadpools. Without a pool llama.cpp
+// falls back to spawning threads per graph. Caller must hold g_embed_mutex
+// and g_ctx_mutex, or g_mutex exclusively; ensure_embedding_ctx reads the
+// counts under g_embed_mutex.
+static void apply_threads_locked(int n_threads, int n_threads_batch) {
+    ggml_threadpool* pool = create_threadpool(n_threads);
+    ggml_threadpool* pool_batch =
+        pool && n_threads_batch != n_threads ? create_threadpool(n_threads_batch) : nullptr;
 
-    LOGI("Unloading model");
+    for (llama_context* ctx : {g_ctx, g_draft_ctx}) {
+        if (!ctx) continue;
+        llama_detach_threadpool(ctx);
+        llama_set_n_threads(ctx, n_threads, n_threads_batch);
+        if (pool) llama_attach_threadpool(ctx, pool, pool_batch);
+    }
+
+    free_threadpools();
+    g_threadpool = pool;
+    g_threadpool_batch = pool_batch;
+    g_params.n_threads = n_threads;
+    g_params.n_threads_batch = n_threads_batch;
+}
+
+// Helper: Spill file of a prefix snapshot
+static std::string prefix_spill_path(const PrefixEntry& entry) {
+    char name[48];
+    snprintf(name, sizeof(name), "/prefix-%llu.kv", (unsigned long long)entry.id);
+    return g_prefix_spill_dir + name;
+}
+
+// Helper: Forget a snapshot, deleting its spill file. Caller must hold
+// g_prefix_mutex.
+static void drop_prefix_entry_locked(size_t i) {
+    PrefixEntry& entry = g_prefix_entries[i];
+    if (entry.state) {
+        g_prefix_ram_bytes -= entry.state_size;
+    } else {
+        remove(prefix_spill_path(entry).c_str());
+        g_prefix_disk_bytes -= entry.state_size;
+    }
+    g_prefix_entries.erase(g_prefix_entries.begin() + i);
+}
+
+// Helper: Drop every snapshot. Caller must hold g_prefix_mutex.
+static void clear_prefix_cache_locked() {
+    while (!g_prefix_entries.empty()) {
+        drop_prefix_entry_locked(g_prefix_entries.size() - 1);
+    }
+}
+
+// Helper: Least recently used snapshot, in RAM or on disk, other than keep
+static int lru_prefix_entry_locked(bool in_ram, uint64_t keep) {
+    int best = -1;
+    for (size_t i = 0; i < g_prefix_entries.size(); i++) {
+        const PrefixEntry& entry = g_prefix_entries[i];
+        if (entry.id == keep || (bool)entry.state != in_ram) continue;
+        if (best < 0 || entry.last_used < g_prefix_entries[best].last_used) best = i;
+    }
+    return best;
+}
+
+// Helper: Bring RAM and disk use back under budget, spilling the least
+// recently used snapshots to disk and then dropping the oldest spilled.
+// keep (an entry id) stays in RAM. Caller must hold g_prefix_mutex.
+static void enforce_prefix_budget_locked(uint64_t keep = 0) {
+    while (g_prefix_ram_bytes > g_prefix_ram_budget) {
+        int i = lru_prefix_entry_locked(true, keep);
+        if (i < 0) break;
+        PrefixEntry& entry = g_prefix_entries[i];
+
+        bool spilled = false;
+        if (!g_prefix_spill_dir.empty() && entry.state_size <= g_prefix_disk_budget) {
+            std::string path = prefix_spill_path(entry);
+            FILE* f = fopen(path.c_str(), "wb");
+            if (f) {
+                spilled = fwrite(entry.state->data(), 1, entry.state_size, f) == entry.state_size;
+                spilled = (fclose(f) == 0) && spilled;
+                if (!spilled) remove(path.c_str());
+            }
+        }
+        if (!spilled) {
+            drop_prefix_entry_locked(i);
+            g_prefix_stats.evictions++;
+            continue;
+        }
+        entry.state.reset();
+        g_prefix_ram_bytes -= entry.state_size;
+        g_prefix_disk_bytes += entry.state_size;
+        g_prefix_stats.spills++;
+    }
+    while (g_prefix_disk_bytes > g_prefix_disk_budget) {
+        int i = lru_prefix_entry_locked(false, keep);
+        if (i < 0) break;
+        drop_prefix_entry_locked(i);
+        g_prefix_stats.evictions++;
+    }
+}
 
-    if (g_sampler) {
-        llama_sampler_free(g_sampler);
-        g_sampler = nullptr;
+// Helper: Free the chat and draft contexts, their threadpools and an
+// embedding context on the chat model, keeping the models. Sessions forget
+// their KV cache. Caller must hold g_mutex exclusively.
+static void free_contexts_locked() {
+    // An embedding context on the chat model cannot outlive it
+    if (g_embd_ctx && !g_embd_model) {
+        llama_free(g_embd_ctx);
+        g_embd_ctx = nullptr;
+    }
+    if (g_draft_ctx) {
+        llama_free(g_draft_ctx);
+        g_draft_ctx = nullptr;
     }
     if (g_ctx) {
         llama_free(g_ctx);
         g_ctx = nullptr;
     }
+    free_threadpools();
+    reset_session_caches();
+}
+
+// Helper: Free model, context and session samplers. Caller must hold g_mutex exclusively.
+static void free_model_locked() {
+    free_contexts_locked();
+    if (g_draft_model) {
+        llama_free_model(g_draft_model);
+        g_draft_model = nullptr;
+    }
+    g_n_draft = 0;
+    g_spec_drafted = 0;
+    g_spec_accepted = 0;
     if (g_model) {
         llama_free_model(g_model);
         g_model = nullptr;
     }
+    g_model_fingerprint.clear();
+    g_mapped_paths.clear();
+    g_ctx_released = false;
+    g_gpu_layers = 0;
+    g_model_bytes = 0;
+    g_model_generation++;
+
+    {
+        std::lock_guard<std::mutex> segment_lock(g_segment_mutex);
+        g_segment_cache.clear();
+        g_segment_cache_tokens = 0;
+    }
+
+    // Snapshots only fit the model they were taken from
+    std::lock_guard<std::mutex> prefix_lock(g_prefix_mutex);
+    clear_prefix_cache_locked();
+}
+
+// Helper: Check that a draft model tokenizes exactly like g_model, so its
+// token ids can be verified against the target directly
+static bool draft_vocab_compatible(const llama_model* draft) {
+    const llama_vocab* target_vocab = llama_model_get_vocab(g_model);
+    const llama_vocab* draft_vocab = llama_model_get_vocab(draft);
+    return llama_vocab_type(target_vocab) == llama_vocab_type(draft_vocab) &&
+           llama_vocab_n_tokens(target_vocab) == llama_vocab_n_tokens(draft_vocab) &&
+           llama_vocab_bos(target_vocab) == llama_vocab_bos(draft_vocab) &&
+           llama_vocab_eos(target_vocab) == llama_vocab_eos(draft_vocab);
+}
+
+// Helper: Load the draft model and its context for speculative decoding.
+// Failure only disables speculation. Caller must hold g_mutex exclusively,
+// with g_model and g_ctx loaded.
+static void load_draft_model_locked(const std::string& path, const llama_context_params& target_params,
+                                    int n_draft) {
+    LOGI("Loading draft model from: %s", path.c_str());
+
+    llama_model_params model_params = llama_model_default_params();
+    model_params.use_mmap = true;
+    model_params.use_mlock = false;
+    model_params.n_gpu_layers = 0; // drafting is latency-bound, the CPU suits it
+    g_draft_model = llama_load_model_from_file(path.c_str(), model_params);
+    if (!g_draft_model) {
+        LOGE("Failed to load draft model, speculation disabled");
+        return;
+    }
+    if (!draft_vocab_compatible(g_draft_model)) {
+        LOGE("Draft model vocabulary differs from target, speculation disabled");
+        llama_free_model(g_draft_model);
+        g_draft_model = nullptr;
+        return;
+    }
+
+    // Same sequences and context length as the target, so every session
+    // has a mirrored draft sequence
+    llama_context_params ctx_params = target_params;
+    g_draft_ctx = llama_new_context_with_model(g_draft_model, ctx_params);
+    if (!g_draft_ctx) {
+        LOGE("Failed to create draft context, speculation disabled");
+        llama_free_model(g_draft_model);
+        g_draft_model = nullptr;
+        return;
+    }
+
+    g_n_draft = n_draft;
+    LOGI("Speculative decoding enabled, drafting %d tokens per step", g_n_draft);
+}
+
+// Helper: Address ranges of every mapping of the loaded model files. They
+// are found through /proc/self/maps, since llama.cpp does not expose its
+// mmap. Caller must hold g_mutex.
+static std::vector<std::pair<uintptr_t, size_t>> model_mapping_ranges() {
+    std::vector<std::pair<uintptr_t, size_t>> ranges;
+    if (g_mapped_paths.empty()) return ranges;
+    FILE* maps = fopen("/proc/self/maps", "r");
+    if (!maps) return ranges;
+
+    char line[PATH_MAX + 128];
+    while (fgets(line, sizeof(line), maps)) {
+        unsigned long start, end;
+        if (sscanf(line, "%lx-%lx", &start, &end) != 2) continue;
+        const char* path = strchr(line, '/');
+        if (!path) continue;
+        std::string mapped(path);
+        if (!mapped.empty() && mapped.back() == '\n') mapped.pop_back();
+        if (std::find(g_mapped_paths.begin(), g_mapped_paths.end(), mapped) == g_mapped_paths.end()) {
+            continue;
+        }
+        ranges.emplace_back((uintptr_t)start, (size_t)(end - start));
+    }
+    fclose(maps);
+    return ranges;
+}
+
+// Helper: Apply madvise to every mapping of the loaded model files.
+// Returns the bytes advised.
+static size_t advise_model_mappings(int advice) {
+    size_t advised = 0;
+    for (const auto& range : model_mapping_ranges()) {
+        if (madvise((void*)range.first, range.second, advice) == 0) {
+            advised += range.second;
+        } else {
+            LOGD("madvise(%d) failed at %p (errno: %d)", advice, (void*)range.first, errno);
+        }
+    }
+    return advised;
+}
+
+// Helper: Fault in the mapped weights of the model loaded as generation,
+// so the first prompt does not pay for page faults. Works in slices under
+// a shared g_mutex, so an unload waits for one slice at most, and stops as
+// soon as that model is gone. Runs on its own thread.
+static void warm_up_pages(uint64_t generation) {
+    std::vector<std::pair<uintptr_t, size_t>> ranges;
+    {
+        std::shared_lock<std::shared_mutex> lock(g_mutex);
+        if (g_model_generation != generation) return;
+        ranges = model_mapping_ranges();
+    }
+
+    const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    int64_t t_start = llama_time_us();
+    size_t touched = 0;
+    for (const auto& range : ranges) {
+        for (size_t offset = 0; offset < range.second; offset += WARMUP_SLICE_BYTES) {
+            std::shared_lock<std::shared_mutex> lock(g_mutex);
+            if (g_model_generation != generation) {
+                LOGD("Warm-up stopped, model unloaded");
+                return;
+            }
+            size_t len = std::min(WARMUP_SLICE_BYTES, range.second - offset);
+            uintptr_t start = range.first + offset;
+            // Read-ahead for the slice, then one read per page to wait for it
+            madvise((void*)start, len, MADV_WILLNEED);
+            const volatile uint8_t* bytes = (const volatile uint8_t*)start;
+            uint8_t sink = 0;
+            for (size_t i = 0; i < len; i += page) sink ^= bytes[i];
+            (void)sink;
+            touched += len;
+        }
+    }
+    LOGI("Warm-up paged in %.1f MB in %.1f ms", touched / (1024.0 * 1024.0),
+         (llama_time_us() - t_start) / 1000.0);
+}
+
+// Helper: Decode one token on a new context and clear it again, so compute
+// buffers are allocated and every weight has been read before the first
+// real prompt
+static void warm_up_decode(llama_model* model, llama_context* ctx) {
+    llama_token token = llama_vocab_bos(llama_model_get_vocab(model));
+    if (token == LLAMA_TOKEN_NULL) token = 0;
+
+    int64_t t_start = llama_time_us();
+    if (llama_decode(ctx, llama_batch_get_one(&token, 1)) != 0) {
+        LOGW("Warm-up decode failed");
+    }
+    llama_kv_cache_clear(ctx);
+    LOGI("Warm-up decode took %.1f ms", (llama_time_us() - t_start) / 1000.0);
+}
+
+// Helper: Tokenize UTF-8 text with a given model's vocabulary. There is at
+// most one token per byte, plus BOS and the space some vocabularies prepend,
+// so a single pass always fits. parse_special turns control-token text such
+// as <|im_start|> into those tokens, as chat templates need.
+static std::vector<llama_token> tokenize(const llama_model* model, const char* text, size_t len,
+                                         bool add_bos, bool parse_special = false) {
+    if (!model) return {};
+
+    const llama_vocab* vocab = llama_model_get_vocab(model);
+    std::vector<llama_token> tokens(len + 2);
+    int n_tokens = llama_tokenize(vocab, text, len, tokens.data(), tokens.size(),
+                                  add_bos, parse_special);
+    if (n_tokens < 0) {
+        // Not expected, but a vocabulary may expand text further
+        tokens.resize(-n_tokens);
+        n_tokens = llama_tokenize(vocab, text, len, tokens.data(), tokens.size(),
+                                  add_bos, parse_special);
+    }
+
+    tokens.resize(std::max(n_tokens, 0));
+    return tokens;
+}
+
+static std::vector<llama_token> tokenize(const llama_model* model, const std::string& text,
+                                         bool add_bos) {
+    return tokenize(model, text.data(), text.size(), add_bos);
+}
+
+// Helper: Count the tokens of UTF-8 text without storing them; llama_tokenize
+// reports the size it would need when given no room
+static int count_tokens(const char* text, size_t len, bool add_bos) {
+    if (!g_model) return 0;
+    const llama_vocab* vocab = llama_model_get_vocab(g_model);
+    int n_tokens = llama_tokenize(vocab, text, len, nullptr, 0, add_bos, false);
+    return n_tokens < 0 ? -n_tokens : n_tokens;
+}
+
+// Helper: Byte offset in text where each token starts, plus len at the end,
+// found by walking the pieces. They concatenate back to the text except for
+// the space some vocabularies prepend to a word. A byte-fallback token can
+// end inside a character, so boundaries move to the next character start.
+static std::vector<size_t> token_offsets(const std::vector<llama_token>& tokens,
+                                         const char* text, size_t len) {
+    const llama_vocab* vocab = llama_model_get_vocab(g_model);
+    std::vector<size_t> offsets;
+    offsets.reserve(tokens.size() + 1);
+
+    size_t pos = 0;
+    char piece[256];
+    for (llama_token token : tokens) {
+        while (pos < len && ((unsigned char)text[pos] & 0xC0) == 0x80) pos++;
+        offsets.push_back(pos);
+        int n = llama_token_to_piece(vocab, token, piece, sizeof(piece), 0, false);
+        if (n < 0) {
+            n = -n; // longer than the buffer; only its length matters
+        } else if (n > 0 && piece[0] == ' ' && pos < len && text[pos] != ' ') {
+            n--;
+        }
+        pos = std::min(len, pos + n);
+    }
+    offsets.push_back(len);
+    return offsets;
+}
+
+// Helper: Whether a chunk may end at byte offset pos, after a sentence or line
+static bool is_chunk_break(const char* text, size_t len, size_t pos) {
+    if (pos == 0 || pos >= len) return true;
+    char last = text[pos - 1];
+    if (last == '\n') return true;
+    return (last == '.' || last == '!' || last == '?') &&
+           (text[pos] == ' ' || text[pos] == '\n');
+}
+
+// Helper: Split UTF-8 text into chunks of at most max_tokens tokens, each
+// starting overlap tokens before the previous one ended, tokenizing once.
+// A chunk ends at the last sentence or line break in its second half when
+// there is one. Returns [start, end) byte ranges as flat pairs.
+static std::vector<int> chunk_by_tokens(const char* text, size_t len, int max_tokens, int overlap) {
+    std::vector<int> ranges;
+    std::vector<llama_token> tokens = tokenize(g_model, text, len, false);
+    if (tokens.empty()) return ranges;
+
+    std::vector<size_t> offsets = token_offsets(tokens, text, len);
+    size_t n = tokens.size();
+    size_t window = std::max(max_tokens, 1);
+    size_t step_back = std::clamp(overlap, 0, (int)window / 2);
+
+    size_t start = 0;
+    for (;;) {
+        size_t end = std::min(start + window, n);
+        if (end < n) {
+            for (size_t k = end; k > start + window / 2; k--) {
+                if (is_chunk_break(text, len, offsets[k])) {
+                    end = k;
+                    break;
+                }
+            }
+        }
+        if (offsets[end] > offsets[start]) {
+            ranges.push_back((int)offsets[start]);
+            ranges.push_back((int)offsets[end]);
+        }
+        if (end >= n) break;
+        start = std::max(end - step_back, start + 1);
+    }
+    return ranges;
+}
+
+// Helper: Tokenize text
+static std::vector<llama_token> tokenize(const std::string& text, bool add_bos) {
+    return tokenize(g_model, text, add_bos);
+}
+
+// Helper: Format the first n messages with a chat template; add_assistant
+// appends the prefix of the assistant's reply. Returns false if the
+// template is not supported.
+static bool format_chat(const char* tmpl, const std::vector<std::string>& roles,
+                        const std::vector<std::string>& contents, size_t n,
+                        bool add_assistant, std::string& out) {
+    std::vector<llama_chat_message> messages(n);
+    size_t guess = 128;
+    for (size_t i = 0; i < n; i++) {
+        messages[i] = {roles[i].c_str(), contents[i].c_str()};
+        guess += roles[i].size() + contents[i].size() + 32;
+    }
+
+    out.resize(guess);
+    int32_t len = llama_chat_apply_template(tmpl, messages.data(), n, add_assistant,
+                                            &out[0], out.size());
+    if (len > (int32_t)out.size()) {
+        out.resize(len);
+        len = llama_chat_apply_template(tmpl, messages.data(), n, add_assistant,
+                                        &out[0], out.size());
+    }
+    if (len < 0) return false;
+    out.resize(len);
+    return true;
+}
+
+// Helper: Tokenize one formatted chat segment, from the segment cache when
+// the same text was tokenized before
+static std::vector<llama_token> tokenize_segment(const std::string& text, bool add_bos) {
+    // FNV-1a, as in model_fingerprint; the flag keeps BOS and non-BOS apart
+    uint64_t key = 1469598103934665603ULL;
+    for (unsigned char c : text) {
+        key ^= c;
+        key *= 1099511628211ULL;
+    }
+    key ^= add_bos ? 1 : 0;
+
+    {
+        std::lock_guard<std::mutex> lock(g_segment_mutex);
+        auto it = g_segment_cache.find(key);
+        if (it != g_segment_cache.end() && it->second.text == text) {
+            return it->second.tokens;
+        }
+    }
+
+    std::vector<llama_token> tokens = tokenize(g_model, text.data(), text.size(), add_bos, true);
+
+    std::lock_guard<std::mutex> lock(g_segment_mutex);
+    if (g_segment_cache_tokens + tokens.size() > SEGMENT_CACHE_TOKENS) {
+        g_segment_cache.clear();
+        g_segment_cache_tokens = 0;
+    }
+    if (tokens.size() <= SEGMENT_CACHE_TOKENS) {
+        CachedSegment& entry = g_segment_cache[key];
+        g_segment_cache_tokens += tokens.size() - entry.tokens.size();
+        entry.text = text;
+        entry.tokens = tokens;
+    }
+    return tokens;
+}
+
+// Helper: Format messages with the model's chat template (ChatML if it has
+// none or llama.cpp does not support it) and tokenize them one message at
+// a time through the segment cache, so only new messages cost
+// tokenization. Templates whose output for a conversation does not extend
+// the output for its earlier messages are tokenized whole instead.
+// n_system is set to the tokens through a leading system message, or 1.
+// Caller must hold g_mutex (shared).
+static bool tokenize_chat(const std::vector<std::string>& roles,
+                          const std::vector<std::string>& contents,
+                          std::vector<llama_token>& tokens, int& n_system) {
+    size_t n = roles.size();
+    const char* tmpl = llama_model_chat_template(g_model, nullptr);
+    std::string full;
+    if (!tmpl || !format_chat(tmpl, roles, contents, n, true, full)) {
+        tmpl = "chatml";
+        if (!format_chat(tmpl, roles, contents, n, true, full)) return false;
+    }
+
+    // Templates that write BOS themselves must not get a second one
+    const llama_vocab* vocab = llama_model_get_vocab(g_model);
+    llama_token bos = llama_vocab_bos(vocab);
+    char bos_text[64];
+    int n_bos = bos == LLAMA_TOKEN_NULL ? 0 :
+        llama_token_to_piece(vocab, bos, bos_text, sizeof(bos_text), 0, true);
+    bool add_bos = !(n_bos > 0 && full.compare(0, n_bos, bos_text, n_bos) == 0);
+
+    std::vector<std::string> segments;
+    std::string prev;
+    std::string cur;
+    for (size_t i = 0; i < n; i++) {
+        if (i == n - 1) {
+            cur = full;
+        } else if (!format_chat(tmpl, roles, contents, i + 1, false, cur)) {
+            break;
+        }
+        if (cur.compare(0, prev.size(), prev) != 0) break;
+        segments.push_back(cur.substr(prev.size()));
+        prev.swap(cur);
+    }
+    bool per_message = segments.size() == n;
+    if (!per_message) {
+        LOGD("Chat template is not prefix-stable, tokenizing the prompt whole");
+        segments.assign(1, full);
+    }
+
+    tokens.clear();
+    n_system = 1;
+    for (size_t i = 0; i < segments.size(); i++) {
+        std::vector<llama_token> segment = tokenize_segment(segments[i], i == 0 && add_bos);
+        tokens.insert(tokens.end(), segment.begin(), segment.end());
+        if (i == 0 && per_message && roles[0] == "system") n_system = tokens.size();
+    }
+    return !tokens.empty();
+}
+
+// Helper: Detokenize
+static std::string detokenize(const std::vector<llama_token>& tokens) {
+    if (!g_model) return "";
+
+    const llama_vocab* vocab = llama_model_get_vocab(g_model);
+    std::string result;
+    for (llama_token token : tokens) {
+        char buf[256];
+        int n = llama_token_to_piece(vocab, token, buf, sizeof(buf), 0, false);
+        if (n > 0) {
+            result.append(buf, n);
+        }
+    }
+    return result;
+}
+
+// Helper: Length of the longest prefix of str that does not end inside a
+// multi-byte UTF-8 sequence. Token pieces can split a character, so the
+// trailing bytes are held back until the rest of the sequence arrives.
+static size_t utf8_complete_prefix(const std::string& str) {
+    size_t len = str.size();
+    // A UTF-8 sequence is at most 4 bytes, so only the tail needs checking
+    for (size_t back = 1; back <= 4 && back <= len; back++) {
+        unsigned char c = (unsigned char)str[len - back];
+        if ((c & 0xC0) == 0x80) continue; // continuation byte
+
+        size_t need = 1;
+        if ((c & 0xE0) == 0xC0) need = 2;
+        else if ((c & 0xF0) == 0xE0) need = 3;
+        else if ((c & 0xF8) == 0xF0) need = 4;
+        return back >= need ? len : len - back;
+    }
+    return len;
+}
+
+// Streaming callback: receives complete UTF-8 text, returns false to stop
+using PieceCallback = std::function<bool(const std::string&)>;
+
+// Prefill callback: prompt tokens in the KV cache so far and in total,
+// called after each chunk; returns false to stop
+using ProgressCallback = std::function<bool(int, int)>;
+
+// ============================================================================
+// Scheduler
+// ============================================================================
+
+// Stop conditions matched on a request's generated text as it grows
+struct StopMatcher {
+    std::vector<std::string> strings; // stop before the first match, excluded
+    bool json_object = false;  // stop after the first complete top-level {...}
+    size_t longest = 0;        // longest stop string, in bytes
+
+    // JSON scanner state, carried across tokens
+    size_t scanned = 0;        // bytes of text already scanned
+    int depth = 0;
+    bool in_string = false;
+    bool escaped = false;
+
+    bool empty() const { return strings.empty() && !json_object; }
+};
+
+// Prompt for one generation: plain text, or chat messages formatted with
+// the model's template when roles is not empty
+struct PromptInput {
+    std::string text;
+    std::vector<std::string> roles;
+    std::vector<std::string> contents;
+
+    bool is_chat() const { return !roles.empty(); }
+};
+
+// One generation driven by the scheduler thread. The JNI caller owns it:
+// it submits the request, waits on cv and delivers text to Kotlin from its
+// own thread. The scheduler decodes and samples.
+struct GenRequest {
+    Session* session = nullptr;
+    llama_sampler* smpl = nullptr;
+    std::vector<llama_token> prompt;
+    size_t n_prefilled = 0;   // prompt tokens already in the KV cache
+    int max_gen = 0;
+    int n_keep = 0;           // pinned prefix kept by context shifts
+    bool context_shift = false;
+
+    // Scheduler-only state
+    int n_generated = 0;
+    int n_cur = 0;            // position of the next decoded token
+    llama_token last_token = -1; // sampled, waiting to be decoded
+    int logits_idx = -1;      // batch index of this step's logits
+    std::vector<llama_token> draft; // drafted after last_token this step
+    int n_drafted = 0;
+    int n_accepted = 0;
+    size_t step_begin = 0;    // prompt range decoded in this step
+    size_t step_end = 0;
+    bool retire = false;
+    StopMatcher stop;
+    std::string text;         // generated text; bytes past n_emitted are held back
+    size_t n_emitted = 0;     // bytes of text handed to the caller
+
+    // Time spent in steps this request took part in, split by whether they
+    // carried its prompt, and in its own sampling
+    int64_t t_prefill_us = 0;
+    int64_t t_decode_us = 0;
+    int64_t t_sample_us = 0;
+    int64_t t_first_token_us = 0; // llama_time_us() when the first token was sampled
+
+    // Shared with the caller, guarded by mutex
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::string out;          // bytes not yet picked up by the caller
+    size_t prefill_done = 0;  // prompt tokens decoded, for on_progress
+    bool progress = false;    // prefill_done changed since the caller looked
+    std::string result;
+    std::string error;
+    bool done = false;
+
+    std::atomic<bool> cancelled{false};
+};
+
+// Submitted requests, picked up by the scheduler at the next step
+static std::mutex g_sched_mutex;
+static std::condition_variable g_sched_cv;
+static std::vector<GenRequest*> g_sched_queue;
+static std::once_flag g_sched_once;
+
+// Helper: Sample the next token from batch output idx. Caller holds g_ctx_mutex.
+// Same steps as llama_sampler_sample(), but into the session's candidate
+// buffer instead of a vector allocated per call.
+static llama_token sample_token(Session& session, llama_sampler* smpl, int idx, int n_vocab) {
+    const float* logits = llama_get_logits_ith(g_ctx, idx);
+
+    std::vector<llama_token_data>& candidates = session.candidates;
+    candidates.resize(n_vocab);
+    for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
+        candidates[token_id] = llama_token_data{token_id, logits[token_id], 0.0f};
+    }
+    llama_token_data_array candidates_p = {candidates.data(), candidates.size(), -1, false};
+
+    // Apply sampler chain
+    llama_sampler_apply(smpl, &candidates_p);
+    llama_token token = candidates_p.data[candidates_p.selected].id;
+
+    // Accept token in sampler
+    llama_sampler_accept(smpl, token);
+    return token;
+}
+
+// Helper: Grow a reusable batch to hold at least n tokens
+static void ensure_batch(llama_batch& batch, int& cap, int n) {
+    if (n <= cap) return;
+    if (cap > 0) llama_batch_free(batch);
+    batch = llama_batch_init(n, 0, 1);
+    cap = n;
+}
+
+// Helper: Append one token to a batch, returning its index
+static int batch_add(llama_batch& batch, llama_token token, int pos, llama_seq_id seq, bool logits) {
+    batch.token[batch.n_tokens] = token;
+    batch.pos[batch.n_tokens] = pos;
+    batch.n_seq_id[batch.n_tokens] = 1;
+    batch.seq_id[batch.n_tokens][0] = seq;
+    batch.logits[batch.n_tokens] = logits;
+    return batch.n_tokens++;
+}
+
+// Helper: Evict n_discard tokens following the first n_keep from a
+// sequence and move the rest down, so the cache keeps what follows without
+// re-decoding it. tokens mirrors the sequence. Caller holds g_ctx_mutex.
+static bool shift_sequence(llama_context* ctx, llama_seq_id seq, std::vector<llama_token>& tokens,
+                           int n_keep, int n_discard) {
+    if (n_discard <= 0 || (size_t)(n_keep + n_discard) > tokens.size()) return false;
+    if (!llama_kv_cache_can_shift(ctx)) return false;
+
+    llama_kv_cache_seq_rm(ctx, seq, n_keep, n_keep + n_discard);
+    llama_kv_cache_seq_add(ctx, seq, n_keep + n_discard, -1, -n_discard);
+    tokens.erase(tokens.begin() + n_keep, tokens.begin() + n_keep + n_discard);
+    return true;
+}
+
+// Helper: Apply a target context shift to the session's draft sequence
+// too, or drop the draft sequence if it cannot follow. Caller holds
+// g_ctx_mutex.
+static void shift_draft_sequence(Session& session, int n_keep, int n_discard) {
+    if (!g_draft_ctx) return;
+    if (!shift_sequence(g_draft_ctx, session.seq_id, session.draft_kv_tokens, n_keep, n_discard)) {
+        llama_kv_cache_seq_rm(g_draft_ctx, session.seq_id, -1, -1);
+        session.draft_kv_tokens.clear();
+    }
+}
+
+// Helper: KV cells not held by any sequence. Caller holds g_ctx_mutex.
+static int kv_free_cells_locked() {
+    return (int)llama_n_ctx(g_ctx) - llama_get_kv_cache_used_cells(g_ctx);
+}
+
+// Helper: Evict idle sessions' sequences, least recently used first, until
+// n_needed cells are free, and return the free cells. A session is idle
+// when its mutex can be taken: no call is using it, so its sequence can go
+// without racing the owner. Sessions of active requests are never idle,
+// since their callers hold the mutex. Caller holds g_ctx_mutex.
+static int evict_idle_sequences_locked(int n_needed, const Session* except) {
+    int n_free = kv_free_cells_locked();
+    if (n_free >= n_needed) return n_free;
+
+    std::vector<std::shared_ptr<Session>> sessions;
+    {
+        std::lock_guard<std::mutex> lock(g_sessions_mutex);
+        for (auto& entry : g_sessions) {
+            if (entry.second.get() != except) sessions.push_back(entry.second);
+        }
+    }
+
+    // try_lock never waits, so taking these under g_ctx_mutex cannot deadlock
+    struct Idle {
+        Session* session;
+        std::unique_lock<std::mutex> lock;
+    };
+    std::vector<Idle> idle;
+    for (auto& session : sessions) {
+        std::unique_lock<std::mutex> lock(session->mutex, std::try_to_lock);
+        if (lock.owns_lock() && !session->kv_tokens.empty()) {
+            idle.push_back({session.get(), std::move(lock)});
+        }
+    }
+    std::sort(idle.begin(), idle.end(), [](const Idle& a, const Idle& b) {
+        return a.session->last_used < b.session->last_used;
+    });
+
+    for (Idle& entry : idle) {
+        Session* session = entry.session;
+        if (n_free >= n_needed) break;
+        LOGI("Evicting idle session %d (%zu tokens) from the KV cache",
+             session->id, session->kv_tokens.size());
+        llama_kv_cache_seq_rm(g_ctx, session->seq_id, -1, -1);
+        if (g_draft_ctx) llama_kv_cache_seq_rm(g_draft_ctx, session->seq_id, -1, -1);
+        session->kv_tokens.clear();
+        session->draft_kv_tokens.clear();
+        session->n_shifted = 0;
+        n_free = kv_free_cells_locked();
+    }
+    return n_free;
+}
+
+// Helper: Most likely token in the draft context's batch output idx
+static llama_token draft_argmax(int idx, int n_vocab) {
+    const float* logits = llama_get_logits_ith(g_draft_ctx, idx);
+    llama_token best = 0;
+    for (llama_token t = 1; t < n_vocab; t++) {
+        if (logits[t] > logits[best]) best = t;
+    }
+    return best;
+}
+
+// Helper: Greedily draft up to n_draft tokens following r->last_token into
+// r->draft. The draft sequence is first brought in line with the target's
+// KV cache; only tokens it does not yet hold are decoded. Caller holds
+// g_ctx_mutex.
+static void draft_tokens(GenRequest* r, int n_draft, llama_batch& batch, int& batch_cap) {
+    r->draft.clear();
+    Session& session = *r->session;
+    std::vector<llama_token>& draft_kv = session.draft_kv_tokens;
+    const std::vector<llama_token>& kv = session.kv_tokens;
+
+    size_t n_common = 0;
+    while (n_common < draft_kv.size() && n_common < kv.size() && draft_kv[n_common] == kv[n_common]) {
+        n_common++;
+    }
+    if (!llama_kv_cache_seq_rm(g_draft_ctx, session.seq_id, n_common, -1)) {
+        llama_kv_cache_seq_rm(g_draft_ctx, session.seq_id, -1, -1);
+        n_common = 0;
+    }
+    draft_kv.resize(n_common);
+
+    const int n_batch = llama_n_batch(g_draft_ctx);
+    const int n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(g_draft_model));
+    ensure_batch(batch, batch_cap, n_batch);
+
+    // Catch up on the verified tokens, then last_token, in n_batch chunks
+    size_t n_total = kv.size() + 1;
+    for (size_t i = n_common; i < n_total; ) {
+        batch.n_tokens = 0;
+        for (; i < n_total && batch.n_tokens < n_batch; i++) {
+            llama_token token = i < kv.size() ? kv[i] : r->last_token;
+            batch_add(batch, token, i, session.seq_id, i == n_total - 1);
+        }
+        if (llama_decode(g_draft_ctx, batch) != 0) {
+            LOGW("Draft decode failed, skipping speculation this step");
+            llama_kv_cache_seq_rm(g_draft_ctx, session.seq_id, -1, -1);
+            draft_kv.clear();
+            return;
+        }
+    }
+    draft_kv.insert(draft_kv.end(), kv.begin() + n_common, kv.end());
+    draft_kv.push_back(r->last_token);
+
+    // Each drafted token is decoded to draft the next; the last one is not
+    for (int k = 0; k < n_draft; k++) {
+        llama_token token = draft_argmax(batch.n_tokens - 1, n_vocab);
+        if (llama_token_is_eog(g_model, token)) break;
+        r->draft.push_back(token);
+        if (k == n_draft - 1) break;
+
+        batch.n_tokens = 0;
+        batch_add(batch, token, draft_kv.size(), session.seq_id, true);
+        if (llama_decode(g_draft_ctx, batch) != 0) break;
+        draft_kv.push_back(token);
+    }
+}
+
+// Helper: Offset just past the '}' that closes the first top-level JSON
+// object in text, or npos. Scans only bytes added since the last call.
+// Braces inside strings are ignored; text before the object is not JSON.
+static size_t scan_json_object(StopMatcher& m, const std::string& text) {
+    for (size_t i = m.scanned; i < text.size(); i++) {
+        char c = text[i];
+        if (m.in_string) {
+            if (m.escaped) m.escaped = false;
+            else if (c == '\\') m.escaped = true;
+            else if (c == '"') m.in_string = false;
+        } else if (c == '"' && m.depth > 0) {
+            m.in_string = true;
+        } else if (c == '{') {
+            m.depth++;
+        } else if (c == '}' && m.depth > 0 && --m.depth == 0) {
+            m.scanned = i + 1;
+            return i + 1;
+        }
+    }
+    m.scanned = text.size();
+    return std::string::npos;
+}
+
+// Helper: Length of the longest suffix of text that is a proper prefix of
+// a stop string; those bytes may still turn into a match
+static size_t stop_prefix_len(const StopMatcher& m, const std::string& text) {
+    size_t best = 0;
+    for (const std::string& stop : m.strings) {
+        size_t max_len = std::min(stop.size() - 1, text.size());
+        for (size_t len = max_len; len > best; len--) {
+            if (text.compare(text.size() - len, len, stop, 0, len) == 0) {
+                best = len;
+                break;
+            }
+        }
+    }
+    return best;
+}
+
+// Helper: Hand held-back text up to end to the request's caller
+static void deliver_text(GenRequest* r, size_t end) {
+    if (end <= r->n_emitted) return;
+    std::lock_guard<std::mutex> lock(r->mutex);
+    r->result.append(r->text, r->n_emitted, end - r->n_emitted);
+    r->out.append(r->text, r->n_emitted, end - r->n_emitted);
+    r->n_emitted = end;
+    r->cv.notify_one();
+}
+
+// Helper: Append a sampled token's text and hand the caller what can no
+// longer be part of a stop string. Returns true if a stop condition
+// matched; the text is then cut at the match.
+static bool emit_token(GenRequest* r, const llama_vocab* vocab, llama_token token) {
+    char buf[256];
+    int n = llama_token_to_piece(vocab, token, buf, sizeof(buf), 0, false);
+    if (n <= 0) return false;
+    r->text.append(buf, n);
+
+    StopMatcher& m = r->stop;
+    if (m.empty()) {
+        deliver_text(r, r->text.size());
+        return false;
+    }
+
+    // A match can begin at most longest - 1 bytes before the new piece
+    size_t end = std::string::npos;
+    size_t from = r->text.size() - n;
+    from = from > m.longest ? from - m.longest : 0;
+    for (const std::string& stop : m.strings) {
+        end = std::min(end, r->text.find(stop, from));
+    }
+    if (m.json_object) {
+        end = std::min(end, scan_json_object(m, r->text));
+    }
+
+    if (end != std::string::npos) {
+        r->text.resize(end);
+        deliver_text(r, end);
+        return true;
+    }
+    deliver_text(r, r->text.size() - stop_prefix_len(m, r->text));
+    return false;
+}
+
+// Helper: Out of context mid-reply: evict half of the request's unpinned
+// tokens. Returns false if it does not shift. Caller holds g_ctx_mutex.
+static bool shift_request(GenRequest* r) {
+    Session& session = *r->session;
+    int n_discard = (r->n_cur - r->n_keep) / 2;
+    if (!r->context_shift ||
+        !shift_sequence(g_ctx, session.seq_id, session.kv_tokens, r->n_keep, n_discard)) {
+        return false;
+    }
+    shift_draft_sequence(session, r->n_keep, n_discard);
+    r->n_cur -= n_discard;
+    session.n_shifted += n_discard;
+    LOGI("Session %d context shifted by %d tokens", session.id, n_discard);
+    return true;
+}
+
+// Helper: Handle a failed llama_decode of this step's batch. Every
+// sequence first loses what the step added, so it again matches its
+// kv_tokens. With no KV slot (status 1), idle sequences are evicted and
+// the step retried; failing that, the prompt chunks are dropped, or else
+// one generating sequence shifts. Anything else drops the batch's
+// sequences. Requests retired here carry an error, so a cut-off reply is
+// not mistaken for a finished one. Caller holds g_ctx_mutex.
+static void recover_decode_failure(std::vector<GenRequest*>& active, int decode_status,
+                                   int n_tokens) {
+    bool rolled_back = true;
+    std::vector<GenRequest*> failed;
+    for (GenRequest* r : active) {
+        if (r->retire || (r->logits_idx < 0 && r->step_end == r->step_begin)) continue;
+        llama_pos from = r->step_end > r->step_begin ? (llama_pos)r->step_begin : r->n_cur;
+        rolled_back = llama_kv_cache_seq_rm(g_ctx, r->session->seq_id, from, -1) && rolled_back;
+        failed.push_back(r);
+    }
+
+    if (decode_status == 1 && rolled_back) {
+        int n_free = kv_free_cells_locked();
+        if (evict_idle_sequences_locked(n_free + 1, nullptr) > n_free) {
+            LOGW("No KV slot for %d tokens; evicted idle sequences, retrying", n_tokens);
+            return;
+        }
+
+        bool prefilling = false;
+        for (GenRequest* r : failed) {
+            if (r->step_end == r->step_begin) continue;
+            LOGW("Session %d: no KV slot for its prompt", r->session->id);
+            r->error = "[Error: KV cache full]";
+            r->retire = true;
+            prefilling = true;
+        }
+        if (prefilling) return;
+
+        // Only replies left: shift one and retry, else none can go on
+        for (GenRequest* r : failed) {
+            if (shift_request(r)) return;
+        }
+        for (GenRequest* r : failed) {
+            LOGW("Session %d: no KV slot to continue its reply", r->session->id);
+            r->error = "[Error: KV cache full]";
+            r->retire = true;
+        }
+        return;
+    }
+
+    LOGE("Decode failed for batch of %d tokens (status %d)", n_tokens, decode_status);
+    for (GenRequest* r : failed) {
+        llama_kv_cache_seq_rm(g_ctx, r->session->seq_id, -1, -1);
+        r->session->kv_tokens.clear();
+        r->session->n_shifted = 0;
+        r->error = "[Error: Decode failed]";
+        r->retire = true;
+    }
+}
+
+// One scheduler step: pack the next token of every generating sequence,
+// then fill the rest of the batch with pending prompt tokens, and decode
+// it all with a single llama_decode.
+//
+// With a draft model loaded, a generating sequence also packs the tokens
+// the draft predicts after its next token. Every output is still sampled
+// from the target with the session's chain, in order, and a draft token is
+// kept only if it equals what was sampled at its position, so the output
+// distribution is that of plain decoding.
+static void scheduler_step(std::vector<GenRequest*>& active, llama_batch& batch, int& batch_cap,
+                           llama_batch& draft_batch, int& draft_cap) {
+    std::lock_guard<std::mutex> ctx_lock(g_ctx_mutex);
+
+    int n_batch = llama_n_batch(g_ctx);
+    int n_ctx = llama_n_ctx(g_ctx);
+    ensure_batch(batch, batch_cap, n_batch);
+    batch.n_tokens = 0;
+
+    // Generating sequences first, so a long prefill cannot stall them
+    for (GenRequest* r : active) {
+        r->logits_idx = -1;
+        r->draft.clear();
+        r->step_begin = r->step_end = r->n_prefilled;
+        if (r->session->stop_requested || r->cancelled) {
+            r->retire = true;
+            continue;
+        }
+        if (r->n_prefilled != r->prompt.size() || batch.n_tokens >= n_batch) continue;
+
+        // Shift when this sequence reaches n_ctx, or when the shared cache
+        // has no cell for its next token even after evicting idle sequences
+        bool at_limit = r->n_cur >= n_ctx - 1;
+        int n_spare = evict_idle_sequences_locked(batch.n_tokens + 1, nullptr) - batch.n_tokens;
+        if (at_limit || n_spare < 1) {
+            if (!shift_request(r)) {
+                if (at_limit) {
+                    LOGW("Session %d reached the context limit", r->session->id);
+                } else {
+                    // Cut short by other sessions' cells, not its own length
+                    LOGW("Session %d: no free KV cell for its reply", r->session->id);
+                    r->error = "[Error: KV cache full]";
+                }
+                r->retire = true;
+                continue;
+            }
+            n_spare = kv_free_cells_locked() - batch.n_tokens;
+        }
+
+        int n_draft = std::min({g_n_draft, r->max_gen - r->n_generated - 1,
+                                n_batch - batch.n_tokens - 1, n_ctx - r->n_cur - 1, n_spare - 1});
+        if (g_draft_ctx && n_draft > 0) {
+            draft_tokens(r, n_draft, draft_batch, draft_cap);
+        }
+        r->logits_idx = batch_add(batch, r->last_token, r->n_cur, r->session->seq_id, true);
+        for (size_t k = 0; k < r->draft.size(); k++) {
+            batch_add(batch, r->draft[k], r->n_cur + 1 + k, r->session->seq_id, true);
+        }
+    }
+    for (GenRequest* r : active) {
+        if (r->retire || r->n_prefilled == r->prompt.size()) continue;
+        // Other sequences may have grown since the prompt was admitted, so
+        // fill only free cells, evicting idle sequences first
+        int n_want = std::min<int>(n_batch - batch.n_tokens, r->prompt.size() - r->n_prefilled);
+        int n_free = evict_idle_sequences_locked(batch.n_tokens + n_want, nullptr) - batch.n_tokens;
+        size_t room = std::max(0, std::min(n_want, n_free));
+        if (room == 0) {
+            // With nothing else in the batch, no step will free cells for it
+            if (n_want > 0 && batch.n_tokens == 0) {
+                LOGW("Session %d: no free KV cells for its prompt", r->session->id);
+                r->error = "[Error: KV cache full]";
+                r->retire = true;
+            }
+            continue;
+        }
+        size_t end = std::min(r->prompt.size(), r->n_prefilled + room);
+        for (size_t i = r->n_prefilled; i < end; i++) {
+            int idx = batch_add(batch, r->prompt[i], i, r->session->seq_id, i == r->prompt.size() - 1);
+            if (i == r->prompt.size() - 1) r->logits_idx = idx;
+        }
+        r->step_end = end;
+    }
+
+    if (batch.n_tokens == 0) return;
+
+    int64_t t_decode_start = llama_time_us();
+    int decode_status = llama_decode(g_ctx, batch);
+    int64_t t_decode = llama_time_us() - t_decode_start;
+
+    if (decode_status != 0) {
+        recover_decode_failure(active, decode_status, batch.n_tokens);
+        return;
+    }
+
+    const llama_vocab* vocab = llama_model_get_vocab(g_model);
+    int n_vocab = llama_vocab_n_tokens(vocab);
+
+    for (GenRequest* r : active) {
+        if (r->retire) continue;
+        if (r->step_end > r->step_begin) {
+            r->t_prefill_us += t_decode;
+        } else if (r->logits_idx >= 0) {
+            r->t_decode_us += t_decode;
+        }
+
+        // Record what this step put into the KV cache
+        std::vector<llama_token>& kv_tokens = r->session->kv_tokens;
+        bool generating = r->step_end == r->step_begin;
+        if (!generating) {
+            kv_tokens.insert(kv_tokens.end(),
+                             r->prompt.begin() + r->step_begin, r->prompt.begin() + r->step_end);
+            r->n_prefilled = r->step_end;
+
+            std::lock_guard<std::mutex> lock(r->mutex);
+            r->prefill_done = r->n_prefilled;
+            r->progress = true;
+            r->cv.notify_one();
+        } else if (r->logits_idx >= 0) {
+            kv_tokens.push_back(r->last_token);
+            r->n_cur++;
+        }
+        if (r->logits_idx < 0) continue;
+
+        // Sample at the next token, then at each draft position while the
+        // draft keeps matching; the first mismatch ends the step
+        size_t n_accepted = 0;
+        for (size_t k = 0; k <= r->draft.size(); k++) {
+            int64_t t_sample_start = llama_time_us();
+            llama_token new_token = sample_token(*r->session, r->smpl, r->logits_idx + k, n_vocab);
+            r->t_sample_us += llama_time_us() - t_sample_start;
+
+            // Check for EOS
+            if (llama_token_is_eog(g_model, new_token)) {
+                LOGD("EOS token reached at position %d", r->n_generated);
+                r->retire = true;
+                break;
+            }
+
+            if (r->n_generated == 0) r->t_first_token_us = llama_time_us();
+            r->n_generated++;
+            if (emit_token(r, vocab, new_token)) {
+                LOGD("Stop condition matched at position %d", r->n_generated);
+                r->retire = true;
+                break;
+            }
+
+            // The last sampled token is returned but never decoded
+            if (r->n_generated >= r->max_gen) {
+                r->retire = true;
+                break;
+            }
+
+            if (k < r->draft.size() && new_token == r->draft[k]) {
+                // Already decoded at this position as part of the draft
+                kv_tokens.push_back(new_token);
+                r->n_cur++;
+                n_accepted++;
+                continue;
+            }
+            r->last_token = new_token;
+            break;
+        }
+
+        if (!r->draft.empty()) {
+            // Drop rejected draft tokens from the target sequence
+            llama_kv_cache_seq_rm(g_ctx, r->session->seq_id, r->n_cur, -1);
+            r->n_drafted += r->draft.size();
+            r->n_accepted += n_accepted;
+            g_spec_drafted += r->draft.size();
+            g_spec_accepted += n_accepted;
+        }
+    }
+}
+
+// Scheduler thread: owns all decoding for generation requests. Callers
+// hold g_mutex shared while their request is active, so the model and
+// context stay valid for as long as there is work. It stays on the
+// performance cores, like the threadpool workers it drives.
+static void scheduler_loop() {
+    pin_thread_to_perf_cores();
+
+    std::vector<GenRequest*> active;
+    llama_batch batch{};
+    int batch_cap = 0;
+    llama_batch draft_batch{};
+    int draft_cap = 0;
+
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lock(g_sched_mutex);
+            g_sched_cv.wait(lock, [&active] { return !active.empty() || !g_sched_queue.empty(); });
+            active.insert(active.end(), g_sched_queue.begin(), g_sched_queue.end());
+            g_sched_queue.clear();
+        }
+
+        scheduler_step(active, batch, batch_cap, draft_batch, draft_cap);
+
+        // Hand finished requests back; the caller may free them right away.
+        // Text held back for a possible stop string is not part of one.
+        active.erase(std::remove_if(active.begin(), active.end(), [](GenRequest* r) {
+            if (!r->retire) return false;
+            deliver_text(r, r->text.size());
+            std::lock_guard<std::mutex> lock(r->mutex);
+            r->done = true;
+            r->cv.notify_one();
+            return true;
+        }), active.end());
+    }
+}
+
+// Helper: Queue a request for the scheduler, starting it on first use
+static void submit_request(GenRequest* request) {
+    std::call_once(g_sched_once, [] {
+        std::thread(scheduler_loop).detach();
+        LOGI("Generation scheduler started");
+    });
+    std::lock_guard<std::mutex> lock(g_sched_mutex);
+    g_sched_queue.push_back(request);
+    g_sched_cv.notify_one();
+}
+
+// Helper: Fill a SamplerConfig from JNI arguments, with unset values
+// (negative, or zero where zero is meaningless) taken from g_params.
+// Caller must hold g_mutex.
+static SamplerConfig make_sampler_config(
+    JNIEnv* env,
+    jfloat temperature, jfloat topP, jint topK, jfloat repeatPenalty,
+    jint repeatLastN, jfloat minP, jfloat typicalP,
+    jint mirostat, jfloat mirostatTau, jfloat mirostatEta,
+    jstring grammar
+) {
+    SamplerConfig config;
+    config.temperature = temperature >= 0 ? temperature : g_params.temperature;
+    config.top_p = topP > 0 ? topP : g_params.top_p;
+    config.top_k = topK > 0 ? topK : g_params.top_k;
+    config.repeat_penalty = repeatPenalty > 0 ? repeatPenalty : g_params.repeat_penalty;
+    config.repeat_last_n = repeatLastN >= 0 ? repeatLastN : g_params.repeat_last_n;
+    config.min_p = minP >= 0 ? minP : g_params.min_p;
+    config.typical_p = typicalP > 0 ? typicalP : g_params.typical_p;
+    config.mirostat = (mirostat == 1 || mirostat == 2) ? mirostat : 0;
+    config.mirostat_tau = mirostatTau > 0 ? mirostatTau : g_params.mirostat_tau;
+    config.mirostat_eta = mirostatEta > 0 ? mirostatEta : g_params.mirostat_eta;
+    config.grammar = jstring_to_string(env, grammar);
+    return config;
+}
+
+// Helper: Prompt from JNI arguments: chat messages when roles is given,
+// otherwise the prompt text. Returns false if the arrays do not pair up.
+static bool make_prompt_input(JNIEnv* env, jstring prompt, jobjectArray roles,
+                              jobjectArray contents, PromptInput& input) {
+    input.roles = jstring_array_to_vector(env, roles);
+    input.contents = jstring_array_to_vector(env, contents);
+    if (input.roles.size() != input.contents.size()) return false;
+    if (!input.is_chat()) input.text = jstring_to_string(env, prompt);
+    return true;
+}
+
+// Helper: Stop conditions from JNI arguments; empty strings are ignored
+static StopMatcher make_stop_matcher(JNIEnv* env, jobjectArray stopStrings, jboolean stopAfterJson) {
+    StopMatcher stop;
+    int count = stopStrings ? env->GetArrayLength(stopStrings) : 0;
+    for (int i = 0; i < count; i++) {
+        jstring jstop = (jstring)env->GetObjectArrayElement(stopStrings, i);
+        std::string str = jstring_to_string(env, jstop);
+        env->DeleteLocalRef(jstop);
+        if (str.empty()) continue;
+        stop.longest = std::max(stop.longest, str.size());
+        stop.strings.push_back(std::move(str));
+    }
+    stop.json_object = stopAfterJson == JNI_TRUE;
+    return stop;
+}
+
+// Helper: Build a sampler chain for config. Order follows llama.cpp's
+// common sampler: grammar first so every later stage sees only valid
+// tokens, then penalties, truncation, temperature and the final pick.
+// Returns nullptr if the grammar does not parse.
+static llama_sampler* build_sampler_chain(const SamplerConfig& config) {
+    const llama_vocab* vocab = llama_model_get_vocab(g_model);
+
+    llama_sampler_chain_params sparams = llama_sampler_chain_default_params();
+    llama_sampler* smpl = llama_sampler_chain_init(sparams);
+
+    if (!config.grammar.empty()) {
+        llama_sampler* grammar = llama_sampler_init_grammar(vocab, config.grammar.c_str(), "root");
+        if (!grammar) {
+            LOGE("Failed to parse grammar");
+            llama_sampler_free(smpl);
+            return nullptr;
+        }
+        llama_sampler_chain_add(smpl, grammar);
+    }
+
+    if (config.repeat_penalty != 1.0f && config.repeat_last_n != 0) {
+        llama_sampler_chain_add(smpl, llama_sampler_init_penalties(
+            config.repeat_last_n, config.repeat_penalty, 0.0f, 0.0f));
+    }
+
+    if (config.temperature <= 0.0f) {
+        // Greedy decoding ignores the rest of the chain
+        llama_sampler_chain_add(smpl, llama_sampler_init_greedy());
+    } else if (config.mirostat == 1) {
+        llama_sampler_chain_add(smpl, llama_sampler_init_temp(config.temperature));
+        llama_sampler_chain_add(smpl, llama_sampler_init_mirostat(
+            llama_vocab_n_tokens(vocab), LLAMA_DEFAULT_SEED,
+            config.mirostat_tau, config.mirostat_eta, 100));
+    } else if (config.mirostat == 2) {
+        llama_sampler_chain_add(smpl, llama_sampler_init_temp(config.temperature));
+        llama_sampler_chain_add(smpl, llama_sampler_init_mirostat_v2(
+            LLAMA_DEFAULT_SEED, config.mirostat_tau, config.mirostat_eta));
+    } else {
+        llama_sampler_chain_add(smpl, llama_sampler_init_top_k(config.top_k));
+        if (config.typical_p < 1.0f) {
+            llama_sampler_chain_add(smpl, llama_sampler_init_typical(config.typical_p, 1));
+        }
+        llama_sampler_chain_add(smpl, llama_sampler_init_top_p(config.top_p, 1));
+        if (config.min_p > 0.0f) {
+            llama_sampler_chain_add(smpl, llama_sampler_init_min_p(config.min_p, 1));
+        }
+        llama_sampler_chain_add(smpl, llama_sampler_init_temp(config.temperature));
+        // Default seed draws a fresh one on every reset
+        llama_sampler_chain_add(smpl, llama_sampler_init_dist(LLAMA_DEFAULT_SEED));
+    }
+    return smpl;
+}
+
+// Helper: Get the session's sampler chain for config, ready for a new
+// generation. Caller must hold session.mutex and g_mutex (shared).
+static llama_sampler* session_sampler(Session& session, const SamplerConfig& config) {
+    if (session.smpl && session.smpl_config == config) {
+        // Clears penalty history and grammar state from the last generation
+        llama_sampler_reset(session.smpl);
+        return session.smpl;
+    }
+
+    if (session.smpl) {
+        llama_sampler_free(session.smpl);
+        session.smpl = nullptr;
+    }
+    session.smpl = build_sampler_chain(config);
+    if (session.smpl) {
+        session.smpl_config = config;
+        LOGD("Session %d sampler rebuilt: temp=%.2f top_k=%d top_p=%.2f min_p=%.2f "
+             "rep_pen=%.2f/%d mirostat=%d grammar=%s",
+             session.id, config.temperature, config.top_k, config.top_p, config.min_p,
+             config.repeat_penalty, config.repeat_last_n, config.mirostat,
+             config.grammar.empty() ? "no" : "yes");
+    }
+    return session.smpl;
+}
+
+// Helper: Tokens at the start of a that match b
+static size_t common_prefix(const std::vector<llama_token>& a, const std::vector<llama_token>& b) {
+    size_t n = 0;
+    size_t max = std::min(a.size(), b.size());
+    while (n < max && a[n] == b[n]) n++;
+    return n;
+}
+
+// Helper: Replace the session's sequence with the cached snapshot that
+// shares the longest start with tokens, if it beats the n_past tokens the
+// session already shares by PREFIX_MIN_GAIN. On success, kv_tokens holds
+// the snapshot's tokens and n_past the reusable count. Caller must hold
+// session.mutex and g_mutex (shared).
+static bool restore_prefix(Session& session, const std::vector<llama_token>& tokens, size_t& n_past) {
+    std::shared_ptr<std::vector<uint8_t>> state;
+    std::vector<llama_token> snapshot_tokens;
+    size_t n_match = 0;
+    {
+        std::lock_guard<std::mutex> lock(g_prefix_mutex);
+        if (g_prefix_ram_budget == 0 || tokens.size() < PREFIX_MIN_TOKENS) return false;
+
+        int best = -1;
+        for (size_t i = 0; i < g_prefix_entries.size(); i++) {
+            size_t n = common_prefix(g_prefix_entries[i].tokens, tokens);
+            if (n > n_match) {
+                n_match = n;
+                best = i;
+            }
+        }
+        // The last prompt token is always decoded again for fresh logits
+        n_match = std::min(n_match, tokens.size() - 1);
+        if (best < 0 || n_match < n_past + PREFIX_MIN_GAIN) {
+            g_prefix_stats.misses++;
+            return false;
+        }
+
+        PrefixEntry& entry = g_prefix_entries[best];
+        if (!entry.state) {
+            // Read the spilled snapshot back; it becomes the newest in RAM
+            auto data = std::make_shared<std::vector<uint8_t>>(entry.state_size);
+            FILE* f = fopen(prefix_spill_path(entry).c_str(), "rb");
+            bool ok = f && fread(data->data(), 1, entry.state_size, f) == entry.state_size;
+            if (f) fclose(f);
+            if (!ok) {
+                LOGW("Prefix snapshot %llu unreadable, dropping it", (unsigned long long)entry.id);
+                drop_prefix_entry_locked(best);
+                g_prefix_stats.misses++;
+                return false;
+            }
+            remove(prefix_spill_path(entry).c_str());
+            entry.state = data;
+            g_prefix_disk_bytes -= entry.state_size;
+            g_prefix_ram_bytes += entry.state_size;
+            g_prefix_stats.disk_hits++;
+        }
+        entry.last_used = ++g_prefix_clock;
+        state = entry.state;
+        snapshot_tokens = entry.tokens;
+        enforce_prefix_budget_locked(entry.id);
+    }
+
+    {
+        std::lock_guard<std::mutex> ctx_lock(g_ctx_mutex);
+        llama_kv_cache_seq_rm(g_ctx, session.seq_id, -1, -1);
+        if (llama_state_seq_set_data(g_ctx, state->data(), state->size(), session.seq_id) == 0) {
+            LOGW("Failed to restore prefix snapshot for session %d", session.id);
+            llama_kv_cache_seq_rm(g_ctx, session.seq_id, -1, -1);
+            session.kv_tokens.clear();
+            n_past = 0;
+            return false;
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(g_prefix_mutex);
+    g_prefix_stats.hits++;
+    g_prefix_stats.tokens_saved += n_match - n_past;
+    LOGI("Session %d restored %zu prompt tokens from the prefix cache (%zu from its own)",
+         session.id, n_match, n_past);
+    session.kv_tokens = std::move(snapshot_tokens);
+    n_past = n_match;
+    return true;
+}
+
+// Helper: Snapshot the session's sequence after a prefill of at least
+// PREFIX_MIN_TOKENS new tokens, unless a snapshot already covers the
+// prompt. Caller must hold session.mutex and g_mutex (shared).
+static void store_prefix(Session& session, size_t n_prompt) {
+    {
+        std::lock_guard<std::mutex> lock(g_prefix_mutex);
+        if (g_prefix_ram_budget == 0) return;
+        for (PrefixEntry& entry : g_prefix_entries) {
+            if (common_prefix(entry.tokens, session.kv_tokens) >= n_prompt) {
+                entry.last_used = ++g_prefix_clock;
+                return;
+            }
+        }
+    }
+
+    auto state = std::make_shared<std::vector<uint8_t>>();
+    {
+        std::lock_guard<std::mutex> ctx_lock(g_ctx_mutex);
+        state->resize(llama_state_seq_get_size(g_ctx, session.seq_id));
+        state->resize(llama_state_seq_get_data(g_ctx, state->data(), state->size(), session.seq_id));
+    }
+
+    std::lock_guard<std::mutex> lock(g_prefix_mutex);
+    if (state->empty() || state->size() > g_prefix_ram_budget) return;
+
+    PrefixEntry entry;
+    entry.id = g_prefix_next_id++;
+    entry.tokens = session.kv_tokens;
+    entry.state_size = state->size();
+    entry.state = std::move(state);
+    entry.last_used = ++g_prefix_clock;
+    g_prefix_ram_bytes += entry.state_size;
+    g_prefix_stats.stores++;
+    LOGD("Prefix snapshot %llu: %zu tokens, %zu KB", (unsigned long long)entry.id,
+         entry.tokens.size(), entry.state_size / 1024);
+    uint64_t id = entry.id;
+    g_prefix_entries.push_back(std::move(entry));
+    enforce_prefix_budget_locked(id);
+}
+
+// Helper: Run one generation on a session's sequence. Caller must hold
+// session.mutex and g_mutex (shared). Decoding happens on the scheduler
+// thread, batched with other sessions; the prompt is decoded in chunks of
+// at most n_batch tokens, so a stop request takes effect between chunks.
+// When on_piece is set, text is delivered incrementally on the calling
+// thread; when on_progress is set, it is called after each prompt chunk.
+// Generation ends early when a stop condition matches; text that may be the
+// start of a stop string is only delivered once it cannot be. The last
+// sampled token is not decoded, so the KV cache holds the prompt and reply
+// and a follow-up prompt that extends them only prefills what is new.
+// Chat prompts pin their system message when n_keep is negative.
+// Returns the full generated text, or an "[Error: ...]" string.
+static std::string run_generation(
+    Session& session,
+    const PromptInput& prompt,
+    int maxTokens,
+    const SamplerConfig& sampler_config,
+    int n_keep,
+    bool context_shift,
+    const StopMatcher& stop,
+    const PieceCallback& on_piece,
+    const ProgressCallback& on_progress
+) {
+    if (!g_model || !g_ctx) {
+        LOGE("Model not loaded");
+        return "[Error: Model not loaded]";
+    }
+
+    session.is_generating = true;
+    session.stop_requested = false;
+    session.last_used = ++g_session_clock;
+    g_active_generations++;
+    struct GenerationGuard {
+        Session& session;
+        ~GenerationGuard() {
+            session.is_generating = false;
+            g_active_generations--;
+        }
+    } guard{session};
+
+    LOGD("Session %d generating with prompt length: %zu%s", session.id,
+         prompt.is_chat() ? prompt.roles.size() : prompt.text.length(),
+         prompt.is_chat() ? " messages" : "");
+
+    // Tokenize prompt
+    int64_t t_start_us = llama_time_us();
+    std::vector<llama_token> tokens;
+    int n_system = 1;
+    if (prompt.is_chat()) {
+        if (!tokenize_chat(prompt.roles, prompt.contents, tokens, n_system)) {
+            return "[Error: Failed to apply chat template]";
+        }
+    } else {
+        tokens = tokenize(prompt.text, true);
+    }
+    int64_t t_tokenize_us = llama_time_us() - t_start_us;
+    if (tokens.empty()) {
+        return "[Error: Failed to tokenize]";
+    }
+
+    // Generation parameters
+    int max_gen = maxTokens > 0 ? maxTokens : g_params.max_tokens;
+
+    // Pinned prefix; BOS always stays
+    if (n_keep < 0) n_keep = n_system;
+    n_keep = std::max(1, std::min(n_keep, (int)tokens.size()));
+    if (session.n_keep != n_keep) {
+        session.n_keep = n_keep;
+        session.n_shifted = 0;
+    }
+
+    // Keep room for the reply; generation shifts again if it runs out. The
+    // room is this session's own cells plus those no sequence holds, after
+    // evicting idle sessions if the prompt needs theirs.
+    std::vector<llama_token>& kv_tokens = session.kv_tokens;
+    int n_ctx = llama_n_ctx(g_ctx);
+    int n_reserve = std::min(max_gen, n_ctx / 4) + 4;
+    int n_room;
+    {
+        std::lock_guard<std::mutex> ctx_lock(g_ctx_mutex);
+        int n_own = kv_tokens.size();
+        n_room = n_own + evict_idle_sequences_locked((int)tokens.size() + n_reserve - n_own,
+                                              &session);
+    }
+    int n_budget = n_room - n_reserve;
+    if ((int)tokens.size() > n_budget) {
+        if (!context_shift || n_keep > n_budget / 2) {
+            LOGW("Prompt too long: %zu tokens > budget %d (%d of %d cells free to this session)",
+                 tokens.size(), n_budget, n_room, n_ctx);
+            return "[Error: Prompt too long]";
+        }
+
+        // Drop the span evicted last turn, so the cache still lines up,
+        // then more from the oldest end if that is not enough
+        int n_discard = session.n_shifted;
+        if (n_discard >= (int)tokens.size() - n_keep) n_discard = 0;
+        if ((int)tokens.size() - n_discard > n_budget) {
+            int n_over = tokens.size() - n_discard - n_budget;
+            // Evict in large steps so the next turns fit without shifting
+            int n_more = std::max(n_over, (n_budget - n_keep) / 2);
+            bool pinned_match = kv_tokens.size() >= (size_t)n_keep &&
+                                std::equal(tokens.begin(), tokens.begin() + n_keep, kv_tokens.begin());
+            std::lock_guard<std::mutex> ctx_lock(g_ctx_mutex);
+            if (pinned_match && shift_sequence(g_ctx, session.seq_id, kv_tokens, n_keep, n_more)) {
+                shift_draft_sequence(session, n_keep, n_more);
+            }
+            n_discard += n_more;
+        }
+
+        tokens.erase(tokens.begin() + n_keep, tokens.begin() + n_keep + n_discard);
+        session.n_shifted = n_discard;
+        LOGI("Session %d prompt truncated: %d tokens evicted after the first %d",
+             session.id, n_discard, n_keep);
+    } else {
+        session.n_shifted = 0;
+    }
+
+    // Reuse the part of the KV cache that matches the new prompt
+    size_t n_past = 0;
+    while (n_past < kv_tokens.size() && n_past < tokens.size() &&
+           kv_tokens[n_past] == tokens[n_past]) {
+        n_past++;
+    }
+    // The last prompt token must be decoded again to get fresh logits
+    if (n_past == tokens.size()) {
+        n_past--;
+    }
+    // A snapshot of an earlier prompt may share more, e.g. the same
+    // retrieved context after a different question in between
+    if (session.n_shifted == 0) {
+        restore_prefix(session, tokens, n_past);
+    }
+
+    {
+        std::lock_guard<std::mutex> ctx_lock(g_ctx_mutex);
+        if (!llama_kv_cache_seq_rm(g_ctx, session.seq_id, n_past, -1)) {
+            // Some architectures cannot drop a partial sequence
+            llama_kv_cache_seq_rm(g_ctx, session.seq_id, -1, -1);
+            n_past = 0;
+        }
+    }
+    kv_tokens.resize(n_past);
+    kv_tokens.reserve(n_ctx);
+    LOGD("Reusing %zu of %zu prompt tokens from KV cache", n_past, tokens.size());
+
+    llama_sampler* smpl = session_sampler(session, sampler_config);
+    if (!smpl) {
+        return "[Error: Invalid grammar]";
+    }
+
+    GenRequest request;
+    request.session = &session;
+    request.smpl = smpl;
+    request.prompt = std::move(tokens);
+    request.n_prefilled = n_past;
+    request.n_cur = request.prompt.size();
+    request.max_gen = max_gen;
+    request.n_keep = n_keep;
+    request.context_shift = context_shift;
+    request.stop = stop;
+    // Pieces average well under 8 bytes; reserving keeps appends off the heap
+    request.result.reserve(max_gen * 8);
+    request.text.reserve(max_gen * 8);
+    request.draft.reserve(g_n_draft);
+    request.out.reserve(256);
+    submit_request(&request);
+
+    // Deliver text as the scheduler produces it, until it retires the request.
+    // chunk and request.out trade buffers on each swap, so both keep capacity.
+    std::string pending; // bytes not yet delivered to on_piece
+    std::string chunk;
+    chunk.reserve(256);
+    bool delivering = (bool)on_piece;
+    bool reporting = (bool)on_progress;
+    for (;;) {
+        bool done;
+        bool progress;
+        size_t prefill_done;
+        {
+            std::unique_lock<std::mutex> lock(request.mutex);
+            request.cv.wait(lock, [&request] {
+                return request.done || request.progress || !request.out.empty();
+            });
+            chunk.clear();
+            chunk.swap(request.out);
+            done = request.done;
+            progress = request.progress;
+            prefill_done = request.prefill_done;
+            request.progress = false;
+        }
+
+        if (reporting && progress && !done) {
+            if (!on_progress((int)prefill_done, (int)request.prompt.size())) {
+                LOGD("Prefill stopped by callback");
+                request.cancelled = true;
+                reporting = false;
+            }
+        }
+
+        if (delivering && !chunk.empty()) {
+            pending.append(chunk);
+            size_t ready = utf8_complete_prefix(pending);
+            if (ready > 0) {
+                bool keep_going = on_piece(pending.substr(0, ready));
+                pending.erase(0, ready);
+                if (!keep_going) {
+                    LOGD("Generation stopped by callback");
+                    request.cancelled = true;
+                    delivering = false;
+                }
+            }
+        }
+        if (done) break;
+    }
+
+    // Flush whatever is left, even if it is an incomplete sequence
+    if (delivering && !pending.empty()) {
+        on_piece(pending);
+    }
+
+    if (!request.error.empty()) {
+        return request.error;
+    }
+
+    LOGD("Generated %d tokens: %s", request.n_generated,
+         request.result.substr(0, 50).c_str());
+    if (request.n_drafted > 0) {
+        LOGI("Session %d: accepted %d of %d drafted tokens (%.0f%%)", session.id,
+             request.n_accepted, request.n_drafted, 100.0 * request.n_accepted / request.n_drafted);
+    }
+    int64_t t_step_us = request.t_prefill_us + request.t_decode_us + request.t_sample_us;
+    if (request.n_generated > 0 && t_step_us > 0) {
+        LOGI("Session %d: %d tokens, prefill %.1f ms, decode %.1f ms, sample %.1f ms "
+             "(%.1f%% of step time)",
+             session.id, request.n_generated, request.t_prefill_us / 1000.0,
+             request.t_decode_us / 1000.0, request.t_sample_us / 1000.0,
+             100.0 * request.t_sample_us / t_step_us);
+    }
+
+    PerfStats perf;
+    perf.session_id = session.id;
+    perf.t_tokenize_ms = t_tokenize_us / 1000.0;
+    perf.n_prompt = request.prompt.size();
+    perf.n_cached = n_past;
+    perf.t_prefill_ms = request.t_prefill_us / 1000.0;
+    perf.n_decode = request.n_generated;
+    perf.t_decode_ms = request.t_decode_us / 1000.0;
+    perf.t_sample_ms = request.t_sample_us / 1000.0;
+    if (request.t_first_token_us > 0) {
+        perf.t_first_token_ms = (request.t_first_token_us - t_start_us) / 1000.0;
+    }
+    perf.t_total_ms = (llama_time_us() - t_start_us) / 1000.0;
+    perf.n_drafted = request.n_drafted;
+    perf.n_accepted = request.n_accepted;
+    {
+        std::lock_guard<std::mutex> ctx_lock(g_ctx_mutex);
+        perf.kv_used = llama_get_kv_cache_used_cells(g_ctx);
+    }
+    perf.kv_size = n_ctx;
+    get_rss_kb(perf.rss_kb, perf.rss_peak_kb);
+    {
+        std::lock_guard<std::mutex> perf_lock(session.perf_mutex);
+        session.perf = perf;
+        session.has_perf = true;
+    }
+    g_last_perf_session = session.id;
+
+    if (request.prompt.size() - n_past >= PREFIX_MIN_TOKENS && session.n_shifted == 0) {
+        store_prefix(session, request.prompt.size());
+    }
+
+    return request.result;
+}
+
+// Helper: Format generation metrics as a JSON object
+static std::string perf_stats_json(const PerfStats& p) {
+    double prefill_tps = p.t_prefill_ms > 0 ? (p.n_prompt - p.n_cached) * 1000.0 / p.t_prefill_ms : 0;
+    double decode_tps = p.t_decode_ms > 0 ? p.n_decode * 1000.0 / p.t_decode_ms : 0;
+    char json[640];
+    snprintf(json, sizeof(json),
+             "{\"sessionId\":%d,\"tokenizeMs\":%.2f,\"promptTokens\":%d,\"cachedTokens\":%d,"
+             "\"prefillMs\":%.2f,\"prefillTokensPerSec\":%.2f,\"decodeTokens\":%d,"
+             "\"decodeMs\":%.2f,\"decodeTokensPerSec\":%.2f,\"sampleMs\":%.2f,"
+             "\"firstTokenMs\":%.2f,\"totalMs\":%.2f,\"draftedTokens\":%d,"
+             "\"acceptedTokens\":%d,\"kvUsed\":%d,\"kvSize\":%d,"
+             "\"rssKb\":%zu,\"peakRssKb\":%zu}",
+             p.session_id, p.t_tokenize_ms, p.n_prompt, p.n_cached,
+             p.t_prefill_ms, prefill_tps, p.n_decode,
+             p.t_decode_ms, decode_tps, p.t_sample_ms,
+             p.t_first_token_ms, p.t_total_ms, p.n_drafted,
+             p.n_accepted, p.kv_used, p.kv_size,
+             p.rss_kb, p.rss_peak_kb);
+    return json;
+}
+
+// Pooling modes for getEmbeddings(), matching LlamaBridge.Pooling.
+// POOLING_CURRENT keeps whatever the embedding context last used.
+enum EmbeddingPooling {
+    POOLING_CURRENT = -1,
+    POOLING_MEAN = 0,
+    POOLING_CLS = 1,
+    POOLING_LAST = 2,
+};
+
+static enum llama_pooling_type to_llama_pooling(int pooling) {
+    switch (pooling) {
+        case POOLING_CLS: return LLAMA_POOLING_TYPE_CLS;
+        case POOLING_LAST: return LLAMA_POOLING_TYPE_LAST;
+        default: return LLAMA_POOLING_TYPE_MEAN;
+    }
+}
+
+// Helper: Make sure an embedding context with the requested pooling exists.
+// Without a dedicated embedding model, a second context is created on the
+// chat model; it is dropped with that model. Caller must hold g_mutex
+// (shared) and g_embed_mutex.
+static bool ensure_embedding_ctx(int pooling) {
+    llama_model* model = embedding_model();
+    if (!model) return false;
+
+    if (pooling == POOLING_CURRENT) pooling = g_embd_pooling;
+    if (g_embd_ctx && g_embd_pooling == pooling) return true;
+    if (g_embd_ctx) {
+        llama_free(g_embd_ctx);
+        g_embd_ctx = nullptr;
+    }
+
+    llama_context_params ctx_params = llama_context_default_params();
+    ctx_params.n_ctx = EMBED_CTX;
+    ctx_params.n_batch = EMBED_CTX;
+    // Non-causal encoders need each batch in a single ubatch
+    ctx_params.n_ubatch = EMBED_CTX;
+    ctx_params.n_seq_max = EMBED_SEQS;
+    ctx_params.n_threads = g_params.n_threads;
+    ctx_params.n_threads_batch = g_params.n_threads_batch;
+    ctx_params.embeddings = true;
+    ctx_params.pooling_type = to_llama_pooling(pooling);
+
+    g_embd_ctx = llama_new_context_with_model(model, ctx_params);
+    if (!g_embd_ctx) {
+        LOGE("Failed to create embedding context");
+        return false;
+    }
+    g_embd_pooling = pooling;
+    LOGI("Embedding context created (%s model, pooling %d)",
+         g_embd_model ? "dedicated" : "chat", pooling);
+    return true;
+}
+
+// Helper: Scale each of n rows of dim floats to unit length in place.
+// Zero rows are left as they are.
+static void normalize_rows(float* rows, size_t n, int dim) {
+    for (size_t t = 0; t < n; t++) {
+        float* row = rows + t * dim;
+        int d = 0;
+        float norm = 0.0f;
+#if defined(__ARM_NEON)
+        float32x4_t acc0 = vdupq_n_f32(0.0f);
+        float32x4_t acc1 = vdupq_n_f32(0.0f);
+        for (; d + 8 <= dim; d += 8) {
+            float32x4_t a = vld1q_f32(row + d);
+            float32x4_t b = vld1q_f32(row + d + 4);
+#if defined(__aarch64__)
+            acc0 = vfmaq_f32(acc0, a, a);
+            acc1 = vfmaq_f32(acc1, b, b);
+#else
+            acc0 = vmlaq_f32(acc0, a, a);
+            acc1 = vmlaq_f32(acc1, b, b);
+#endif
+        }
+        float32x4_t acc = vaddq_f32(acc0, acc1);
+#if defined(__aarch64__)
+        norm = vaddvq_f32(acc);
+#else
+        float32x2_t sum = vadd_f32(vget_low_f32(acc), vget_high_f32(acc));
+        norm = vget_lane_f32(vpadd_f32(sum, sum), 0);
+#endif
+#endif
+        for (int k = d; k < dim; k++) {
+            norm += row[k] * row[k];
+        }
+        if (norm <= 0.0f) continue;
+
+        float scale = 1.0f / sqrtf(norm);
+        d = 0;
+#if defined(__ARM_NEON)
+        float32x4_t vscale = vdupq_n_f32(scale);
+        for (; d + 4 <= dim; d += 4) {
+            vst1q_f32(row + d, vmulq_f32(vld1q_f32(row + d), vscale));
+        }
+#endif
+        for (; d < dim; d++) {
+            row[d] *= scale;
+        }
+    }
+}
+
+// Helper: Embed many texts on the embedding context, packing several into
+// each llama_decode with one sequence per text. Rows are written normalized
+// straight into out, which must hold texts.size() x n_embd floats
+// (capacity). The chat context is never touched. Caller must hold g_mutex
+// (shared).
+static bool compute_embeddings_batch(const std::vector<std::string>& texts, int pooling,
+                                     float* out, size_t capacity) {
+    std::lock_guard<std::mutex> embed_lock(g_embed_mutex);
+
+    if (!ensure_embedding_ctx(pooling)) {
+        LOGE("No model loaded for embedding");
+        return false;
+    }
+
+    llama_model* model = embedding_model();
+    int n_embd = llama_model_n_embd(model);
+    if (n_embd <= 0) {
+        LOGW("Model doesn't support embeddings");
+        return false;
+    }
+    if (capacity < texts.size() * n_embd) {
+        LOGE("Embedding output holds %zu floats, need %zu", capacity, texts.size() * n_embd);
+        return false;
+    }
+
+    // Each sequence must fit in the single ubatch
+    size_t limit = EMBED_CTX;
+    std::vector<std::vector<llama_token>> all_tokens(texts.size());
+    for (size_t i = 0; i < texts.size(); i++) {
+        all_tokens[i] = tokenize(model, texts[i], true);
+        if (all_tokens[i].empty()) {
+            LOGE("Failed to tokenize text %zu for embedding", i);
+            return false;
+        }
+        if (all_tokens[i].size() > limit) {
+            all_tokens[i].resize(limit);
+        }
+    }
+
+    llama_batch batch = llama_batch_init(limit, 0, 1);
+    bool ok = true;
+
+    size_t next = 0;
+    while (ok && next < texts.size()) {
+        // Pack as many texts as fit, one sequence each
+        size_t first = next;
+        batch.n_tokens = 0;
+        while (next < texts.size() && next - first < (size_t)EMBED_SEQS &&
+               batch.n_tokens + all_tokens[next].size() <= limit) {
+            llama_seq_id seq = next - first;
+            const std::vector<llama_token>& tokens = all_tokens[next];
+            for (size_t i = 0; i < tokens.size(); i++) {
+                batch.token[batch.n_tokens] = tokens[i];
+                batch.pos[batch.n_tokens] = i;
+                batch.n_seq_id[batch.n_tokens] = 1;
+                batch.seq_id[batch.n_tokens][0] = seq;
+                batch.logits[batch.n_tokens] = true;
+                batch.n_tokens++;
+            }
+            next++;
+        }
+
+        llama_kv_cache_clear(g_embd_ctx);
+        if (llama_decode(g_embd_ctx, batch) != 0) {
+            LOGE("Failed to decode embedding batch of %d tokens", batch.n_tokens);
+            ok = false;
+            break;
+        }
+
+        // The context pools each sequence into one vector
+        for (size_t t = first; t < next; t++) {
+            float* embd = llama_get_embeddings_seq(g_embd_ctx, t - first);
+            if (!embd) {
+                ok = false;
+                break;
+            }
+            memcpy(out + t * n_embd, embd, n_embd * sizeof(float));
+        }
+    }
+    llama_batch_free(batch);
+
+    if (!ok) {
+        LOGE("Failed to get embeddings");
+        return false;
+    }
+
+    normalize_rows(out, texts.size(), n_embd);
+    return true;
+}
+
+// Helper: Embed texts into a new Java float[] of texts.size() x n_embd
+static jfloatArray embeddings_to_jarray(JNIEnv* env, const std::vector<std::string>& texts,
+                                        int pooling) {
+    llama_model* model = embedding_model();
+    if (!model) {
+        LOGE("No model loaded for embedding");
+        return nullptr;
+    }
+    std::vector<float> embeddings(texts.size() * std::max(llama_model_n_embd(model), 0));
+    if (!compute_embeddings_batch(texts, pooling, embeddings.data(), embeddings.size())) {
+        return nullptr;
+    }
+
+    jfloatArray result = env->NewFloatArray(embeddings.size());
+    if (result == nullptr) {
+        return nullptr;
+    }
+    env->SetFloatArrayRegion(result, 0, embeddings.size(), embeddings.data());
+    return result;
+}
+
+// Helper: Call TokenCallback.onToken(byte[]) for each streamed piece
+static PieceCallback make_jni_piece_callback(JNIEnv* env, jobject callback, jmethodID on_token) {
+    return [env, callback, on_token](const std::string& piece) -> bool {
+        if (env->ExceptionCheck()) return false;
+        jbyteArray bytes = env->NewByteArray(piece.size());
+        if (bytes == nullptr) return false;
+        env->SetByteArrayRegion(bytes, 0, piece.size(),
+                                reinterpret_cast<const jbyte*>(piece.data()));
+        jboolean keep_going = env->CallBooleanMethod(callback, on_token, bytes);
+        env->DeleteLocalRef(bytes);
+        if (env->ExceptionCheck()) {
+            // Leave the exception pending; it is rethrown when we return
+            return false;
+        }
+        return keep_going == JNI_TRUE;
+    };
+}
+
+// Helper: Wrap a Kotlin TokenCallback.onPrefillProgress as a ProgressCallback
+static ProgressCallback make_jni_progress_callback(JNIEnv* env, jobject callback, jmethodID on_prefill) {
+    return [env, callback, on_prefill](int processed, int total) -> bool {
+        if (env->ExceptionCheck()) return false;
+        jboolean keep_going = env->CallBooleanMethod(callback, on_prefill, processed, total);
+        if (env->ExceptionCheck()) return false;
+        return keep_going == JNI_TRUE;
+    };
+}
+
+// Loader progress forwarded to a Kotlin LoadCallback. llama.cpp reports
+// once per tensor; only whole-percent steps are passed on.
+struct LoadProgress {
+    JNIEnv* env = nullptr;
+    jobject callback = nullptr; // null: no callback, only cancelLoad() applies
+    jmethodID on_progress = nullptr;
+    int last_percent = -1;
+    bool aborted = false;       // the callback or cancelLoad() stopped the load
+};
+
+// Helper: llama.cpp progress_callback, called on the loading thread.
+// Returning false aborts the load.
+static bool load_progress_callback(float progress, void* user_data) {
+    LoadProgress* state = static_cast<LoadProgress*>(user_data);
+    if (g_load_cancelled.load()) {
+        state->aborted = true;
+        return false;
+    }
+    if (!state->callback) return true;
+
+    int percent = (int)(progress * 100.0f);
+    if (percent == state->last_percent) return true;
+    state->last_percent = percent;
+
+    JNIEnv* env = state->env;
+    // Leave an exception pending; it is rethrown when loadModel returns
+    bool keep_going = !env->ExceptionCheck() &&
+        env->CallBooleanMethod(state->callback, state->on_progress, (jfloat)progress) == JNI_TRUE &&
+        !env->ExceptionCheck();
+    state->aborted = !keep_going;
+    return keep_going;
+}
+
+extern "C" {
+
+// ============================================================================
+// Model Management
+// ============================================================================
+
+/**
+ * Load a GGUF model and create its context without holding g_mutex, and
+ * publish it only when ready. With hotSwap and enough memory the old model
+ * keeps serving meantime and is retired once its requests drain, and stays
+ * loaded if the new one fails; otherwise it is unloaded first and other
+ * calls see no model until the load finishes.
+ * callback (LoadCallback, may be null) receives progress in [0, 1] and can
+ * abort the load, as can cancelLoad(). warmUp takes WarmUpFlags.
+ */
+JNIEXPORT jboolean JNICALL
+Java_com_nanoai_llm_LlamaBridge_loadModel(
+    JNIEnv* env,
+    jobject /* this */,
+    jstring modelPath,
+    jint nCtx,
+    jint nThreads,
+    jint nThreadsBatch,
+    jint nBatch,
+    jint nUbatch,
+    jint kvTypeK,
+    jint kvTypeV,
+    jboolean flashAttn,
+    jstring draftModelPath,
+    jint nDraft,
+    jint warmUp,
+    jboolean hotSwap,
+    jint nGpuLayers,
+    jobject callback
+) {
+    LoadProgress progress;
+    progress.env = env;
+    if (callback != nullptr) {
+        jclass callback_class = env->GetObjectClass(callback);
+        progress.on_progress = env->GetMethodID(callback_class, "onProgress", "(F)Z");
+        env->DeleteLocalRef(callback_class);
+        if (progress.on_progress == nullptr) {
+            LOGE("LoadCallback.onProgress not found");
+            return JNI_FALSE;
+        }
+        progress.callback = callback;
+    }
+
+    std::lock_guard<std::mutex> load_lock(g_load_mutex);
+    g_load_cancelled = false;
+    ensure_default_session();
+
+    std::string path = jstring_to_string(env, modelPath);
+    LOGI("Loading model from: %s", path.c_str());
+
+    // Check file exists and is readable
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0 || access(path.c_str(), R_OK) != 0) {
+        LOGE("Cannot open model file: %s (errno: %d)", path.c_str(), errno);
+        return JNI_FALSE;
+    }
+    LOGI("Model file size: %lld bytes", (long long)st.st_size);
+
+    // Context parameters. The KV cache is shared by all session sequences.
+    llama_context_params ctx_params = llama_context_default_params();
+    ctx_params.n_ctx = nCtx > 0 ? nCtx : g_params.n_ctx;
+    ctx_params.n_threads = nThreads > 0 ? nThreads : default_thread_count();
+    ctx_params.n_threads_batch = nThreadsBatch > 0 ? nThreadsBatch : ctx_params.n_threads;
+    ctx_params.n_seq_max = MAX_SESSIONS;
+    // n_batch caps each prefill chunk, n_ubatch the activations per compute pass
+    ctx_params.n_batch = nBatch > 0 ? nBatch : DEFAULT_N_BATCH;
+    ctx_params.n_ubatch = std::min<uint32_t>(nUbatch > 0 ? nUbatch : DEFAULT_N_UBATCH,
+                                             ctx_params.n_batch);
+    // Quantized KV cache; llama.cpp only quantizes V with flash attention
+    ctx_params.type_k = to_ggml_kv_type(kvTypeK);
+    ctx_params.type_v = to_ggml_kv_type(kvTypeV);
+    ctx_params.flash_attn = flashAttn == JNI_TRUE;
+    if (ctx_params.type_v != GGML_TYPE_F16 && !ctx_params.flash_attn) {
+        LOGW("Quantized V cache needs flash attention, enabling it");
+        ctx_params.flash_attn = true;
+    }
+
+    uint64_t kv_bytes = estimate_kv_bytes(path, ctx_params.n_ctx, ctx_params.type_k, ctx_params.type_v);
+    LOGI("KV cache: %u tokens, K %s, V %s, flash attention %s, ~%.1f MB",
+         ctx_params.n_ctx, ggml_type_name(ctx_params.type_k), ggml_type_name(ctx_params.type_v),
+         ctx_params.flash_attn ? "on" : "off", kv_bytes / (1024.0 * 1024.0));
+
+    // Check available memory
+    size_t available = get_available_memory();
+    LOGI("Available memory: %zu MB", available / (1024 * 1024));
+
+    // Hot swap: the old model keeps serving while the new one loads, if
+    // both fit. Otherwise free it first, so only one model is resident.
+    uint64_t needed = (uint64_t)st.st_size + kv_bytes + SWAP_HEADROOM_BYTES;
+    bool hot_swap = false;
+    {
+        std::unique_lock<std::shared_mutex> lock(g_mutex);
+        hot_swap = hotSwap == JNI_TRUE && g_model != nullptr && available >= needed;
+        if (!hot_swap) free_model_locked();
+    }
+    if (hot_swap) {
+        LOGI("Hot swap: old model serves until the new one is ready");
+    } else if (kv_bytes > available) {
+        LOGW("KV cache may not fit in available memory");
+    }
+
+    init_backend();
+
+    // Model parameters
+    llama_model_params model_params = llama_model_default_params();
+    model_params.use_mmap = true;  // Memory-mapped for efficiency
+    model_params.use_mlock = false; // Don't lock in RAM (save memory)
+    model_params.progress_callback = load_progress_callback;
+    model_params.progress_callback_user_data = &progress;
+    int gpu_layers = resolve_gpu_layers(nGpuLayers, path, st.st_size, kv_bytes);
+
+    // Load model and create its context. A GPU that fails either step gets
+    // one retry on the CPU.
+    llama_model* model = nullptr;
+    llama_context* ctx = nullptr;
+    while (true) {
+        model_params.n_gpu_layers = gpu_layers;
+        LOGI("Calling llama_load_model_from_file (%d GPU layers)...", gpu_layers);
+        int64_t t_start = llama_time_us();
+        model = llama_load_model_from_file(path.c_str(), model_params);
+        if (model) {
+            LOGI("Model mapped in %.1f ms", (llama_time_us() - t_start) / 1000.0);
+            ctx = llama_new_context_with_model(model, ctx_params);
+            if (ctx) break;
+            LOGE("Failed to create context");
+            llama_free_model(model);
+            model = nullptr;
+        } else if (progress.aborted) {
+            LOGI("Model load cancelled: %s", path.c_str());
+            return JNI_FALSE;
+        } else {
+            LOGE("Failed to load model from: %s", path.c_str());
+            LOGE("This may be due to: incompatible model format, corrupted file, or insufficient memory");
+        }
+        if (gpu_layers == 0 || g_load_cancelled) return JNI_FALSE;
+        LOGW("GPU offload failed, falling back to CPU");
+        gpu_layers = 0;
+        progress.last_percent = -1;
+    }
+
+    // Still unpublished, so the warm-up decode cannot race a generation
+    if ((warmUp & WARMUP_DECODE) && !g_load_cancelled) {
+        warm_up_decode(model, ctx);
+    }
+
+    // The exclusive lock waits for in-flight requests on the old model to
+    // drain; new ones queue behind it until the new model is published
+    int64_t t_drain = llama_time_us();
+    std::unique_lock<std::shared_mutex> lock(g_mutex);
+    if (g_load_cancelled) {
+        LOGI("Model load cancelled: %s", path.c_str());
+        llama_free(ctx);
+        llama_free_model(model);
+        return JNI_FALSE;
+    }
+    if (g_model) {
+        LOGI("Retiring previous model after %.1f ms drain", (llama_time_us() - t_drain) / 1000.0);
+        free_model_locked();
+    }
+    g_model = model;
+    g_ctx = ctx;
+    g_gpu_layers = gpu_layers;
+    g_model_bytes = (uint64_t)st.st_size + kv_bytes;
+    g_model_generation++;
+    g_model_fingerprint = model_fingerprint(path);
+
+    // A draft model is optional; without one, decoding is not speculative.
+    // It is small, so loading it under the lock keeps the swap simple.
+    std::string draft_path = jstring_to_string(env, draftModelPath);
+    if (!draft_path.empty()) {
+        load_draft_model_locked(draft_path, ctx_params, nDraft > 0 ? nDraft : DEFAULT_N_DRAFT);
+    }
+
+    // Workers for both contexts, on the performance cores
+    apply_threads_locked(ctx_params.n_threads, ctx_params.n_threads_batch);
+
+    // Kept for trimMemory: contexts can be recreated, mappings advised
+    g_ctx_params = ctx_params;
+    for (const std::string& mapped : {path, g_draft_model ? draft_path : std::string()}) {
+        char resolved[PATH_MAX];
+        if (!mapped.empty() && realpath(mapped.c_str(), resolved)) g_mapped_paths.push_back(resolved);
+    }
+
+    // Update params
+    g_params.n_ctx = ctx_params.n_ctx;
+
+    if (warmUp & WARMUP_PAGES) {
+        std::thread(warm_up_pages, g_model_generation).detach();
+    }
+
+    LOGI("Model loaded successfully. Context size: %d, Threads: %d/%d, Batch: %d/%d",
+         ctx_params.n_ctx, ctx_params.n_threads, ctx_params.n_threads_batch,
+         ctx_params.n_batch, ctx_params.n_ubatch);
+
+    return JNI_TRUE;
+}
+
+/**
+ * Abort a loadModel in progress, on any thread. The load returns false;
+ * without one running this is a no-op.
+ */
+JNIEXPORT void JNICALL
+Java_com_nanoai_llm_LlamaBridge_cancelLoad(
+    JNIEnv* env,
+    jobject /* this */
+) {
+    g_load_cancelled = true;
+}
+
+JNIEXPORT void JNICALL
+Java_com_nanoai_llm_LlamaBridge_unloadModel(
+    JNIEnv* env,
+    jobject /* this */
+) {
+    // Also aborts a load in progress, which would otherwise publish its model
+    g_load_cancelled = true;
+    std::unique_lock<std::shared_mutex> lock(g_mutex);
+
+    LOGI("Unloading model");
+    free_model_locked();
+}
+
+JNIEXPORT jboolean JNICALL
+Java_com_nanoai_llm_LlamaBridge_isModelLoaded(
+    JNIEnv* env,
+    jobject /* this */
+) {
+    std::shared_lock<std::shared_mutex> lock(g_mutex);
+    // A released context still counts; resumeContext() brings it back
+    return (g_model != nullptr && (g_ctx != nullptr || g_ctx_released)) ? JNI_TRUE : JNI_FALSE;
+}
+
+// ============================================================================
+// Memory Pressure
+// ============================================================================
+
+/**
+ * React to memory pressure with a TrimLevel. Waits for running generations
+ * before releasing the context. Returns the bytes of weights advised.
+ */
+JNIEXPORT jlong JNICALL
+Java_com_nanoai_llm_LlamaBridge_trimMemory(
+    JNIEnv* env,
+    jobject /* this */,
+    jint level
+) {
+    if (level >= TRIM_RELEASE_CONTEXT) {
+        std::unique_lock<std::shared_mutex> lock(g_mutex);
+        if (g_ctx) {
+            free_contexts_locked();
+            g_ctx_released = true;
+            LOGI("Context released under memory pressure, model stays mapped");
+        }
+    }
+
+    if (level >= TRIM_DROP_PAGES) {
+        // Push prefix snapshots out of RAM: to disk if configured, else gone
+        std::lock_guard<std::mutex> prefix_lock(g_prefix_mutex);
+        size_t budget = g_prefix_ram_budget;
+        g_prefix_ram_budget = 0;
+        enforce_prefix_budget_locked();
+        g_prefix_ram_budget = budget;
+    }
+
+    std::shared_lock<std::shared_mutex> lock(g_mutex);
+    size_t advised = advise_model_mappings(level >= TRIM_DROP_PAGES ? MADV_DONTNEED : MADV_COLD);
+    LOGI("Trim level %d: advised %.1f MB of weights", level, advised / (1024.0 * 1024.0));
+    return (jlong)advised;
+}
+
+/**
+ * Ask the kernel to read the model weights back in ahead of use, e.g. on
+ * return to the foreground. Returns the bytes advised.
+ */
+JNIEXPORT jlong JNICALL
+Java_com_nanoai_llm_LlamaBridge_prefetchModel(
+    JNIEnv* env,
+    jobject /* this */
+) {
+    std::shared_lock<std::shared_mutex> lock(g_mutex);
+    return (jlong)advise_model_mappings(MADV_WILLNEED);
+}
+
+JNIEXPORT jboolean JNICALL
+Java_com_nanoai_llm_LlamaBridge_isContextReleased(
+    JNIEnv* env,
+    jobject /* this */
+) {
+    std::shared_lock<std::shared_mutex> lock(g_mutex);
+    return g_ctx_released ? JNI_TRUE : JNI_FALSE;
+}
+
+/**
+ * Recreate contexts freed by trimMemory with the parameters they were
+ * loaded with. Sessions start with an empty KV cache. No-op if the context
+ * is present.
+ */
+JNIEXPORT jboolean JNICALL
+Java_com_nanoai_llm_LlamaBridge_resumeContext(
+    JNIEnv* env,
+    jobject /* this */
+) {
+    std::unique_lock<std::shared_mutex> lock(g_mutex);
+    if (!g_ctx_released) return g_ctx != nullptr ? JNI_TRUE : JNI_FALSE;
+
+    g_ctx = llama_new_context_with_model(g_model, g_ctx_params);
+    if (!g_ctx) {
+        LOGE("Failed to recreate context");
+        return JNI_FALSE;
+    }
+    if (g_draft_model) {
+        g_draft_ctx = llama_new_context_with_model(g_draft_model, g_ctx_params);
+        if (!g_draft_ctx) LOGW("Failed to recreate draft context, speculation disabled");
+    }
+    apply_threads_locked(g_params.n_threads, g_params.n_threads_batch);
+    g_ctx_released = false;
+    LOGI("Context recreated: %u tokens", g_ctx_params.n_ctx);
+    return JNI_TRUE;
+}
+
+// ============================================================================
+// Sessions
+// ============================================================================
+
+/**
+ * Create a session with its own KV sequence. Returns the handle, or -1 when
+ * all sequences are in use. Sessions outlive model reloads; only their
+ * cached tokens are dropped.
+ */
+JNIEXPORT jint JNICALL
+Java_com_nanoai_llm_LlamaBridge_createSession(
+    JNIEnv* env,
+    jobject /* this */
+) {
+    ensure_default_session();
+
+    std::lock_guard<std::mutex> lock(g_sessions_mutex);
+
+    // Find a free sequence id
+    std::vector<bool> used(MAX_SESSIONS, false);
+    for (auto& entry : g_sessions) {
+        used[entry.second->seq_id] = true;
+    }
+    for (int seq = 0; seq < MAX_SESSIONS; seq++) {
+        if (!used[seq]) {
+            auto session = std::make_shared<Session>();
+            session->id = g_next_session_id++;
+            session->seq_id = seq;
+            g_sessions[session->id] = session;
+            LOGI("Created session %d on sequence %d", session->id, seq);
+            return session->id;
+        }
+    }
+
+    LOGW("No free sequence for a new session (max %d)", MAX_SESSIONS);
+    return -1;
+}
+
+/**
+ * Destroy a session and release its KV sequence. Waits for a running
+ * generation on that session to finish. The default session cannot be
+ * destroyed, only cleared.
+ */
+JNIEXPORT void JNICALL
+Java_com_nanoai_llm_LlamaBridge_destroySession(
+    JNIEnv* env,
+    jobject /* this */,
+    jint sessionId
+) {
+    std::shared_ptr<Session> session = get_session(sessionId);
+    if (!session) return;
+
+    session->stop_requested = true;
+    std::lock_guard<std::mutex> session_lock(session->mutex);
+    {
+        std::shared_lock<std::shared_mutex> lock(g_mutex);
+        if (g_ctx) {
+            std::lock_guard<std::mutex> ctx_lock(g_ctx_mutex);
+            llama_kv_cache_seq_rm(g_ctx, session->seq_id, -1, -1);
+        }
+    }
+    session->kv_tokens.clear();
+    session->n_shifted = 0;
+
+    if (sessionId != DEFAULT_SESSION) {
+        std::lock_guard<std::mutex> lock(g_sessions_mutex);
+        g_sessions.erase(sessionId);
+        LOGI("Destroyed session %d", sessionId);
+    }
+}
+
+// ============================================================================
+// Text Generation
+// ============================================================================
+
+JNIEXPORT jstring JNICALL
+Java_com_nanoai_llm_LlamaBridge_generate(
+    JNIEnv* env,
+    jobject /* this */,
+    jint sessionId,
+    jstring prompt,
+    jint maxTokens,
+    jfloat temperature,
+    jfloat topP,
+    jint topK,
+    jfloat repeatPenalty,
+    jint repeatLastN,
+    jfloat minP,
+    jfloat typicalP,
+    jint mirostat,
+    jfloat mirostatTau,
+    jfloat mirostatEta,
+    jstring grammar,
+    jint nKeep,
+    jboolean contextShift,
+    jobjectArray chatRoles,
+    jobjectArray chatContents,
+    jobjectArray stopStrings,
+    jboolean stopAfterJson
+) {
+    ensure_default_session();
+    std::shared_ptr<Session> session = get_session(sessionId);
+    if (!session) {
+        return string_to_jstring(env, "[Error: Unknown session]");
+    }
+
+    std::lock_guard<std::mutex> session_lock(session->mutex);
+    std::shared_lock<std::shared_mutex> lock(g_mutex);
+
+    PromptInput input;
+    if (!make_prompt_input(env, prompt, chatRoles, chatContents, input)) {
+        return string_to_jstring(env, "[Error: Roles and contents differ in length]");
+    }
+    SamplerConfig config = make_sampler_config(env, temperature, topP, topK, repeatPenalty,
+                                               repeatLastN, minP, typicalP, mirostat,
+                                               mirostatTau, mirostatEta, grammar);
+    StopMatcher stop = make_stop_matcher(env, stopStrings, stopAfterJson);
+    std::string result = run_generation(*session, input, maxTokens, config,
+                                        nKeep, contextShift == JNI_TRUE, stop, nullptr, nullptr);
+    return string_to_jstring(env, result);
+}
+
+/**
+ * Streaming variant of generate(). Each sampled token is detokenized and
+ * handed to callback.onToken(byte[]) as soon as it forms complete UTF-8.
+ * Returning false from onToken stops generation. The callback runs on the
+ * calling thread while the session is locked, so it must not call back
+ * into LlamaBridge for the same session.
+ */
+JNIEXPORT jstring JNICALL
+Java_com_nanoai_llm_LlamaBridge_generateStreaming(
+    JNIEnv* env,
+    jobject /* this */,
+    jint sessionId,
+    jstring prompt,
+    jint maxTokens,
+    jfloat temperature,
+    jfloat topP,
+    jint topK,
+    jfloat repeatPenalty,
+    jint repeatLastN,
+    jfloat minP,
+    jfloat typicalP,
+    jint mirostat,
+    jfloat mirostatTau,
+    jfloat mirostatEta,
+    jstring grammar,
+    jint nKeep,
+    jboolean contextShift,
+    jobjectArray chatRoles,
+    jobjectArray chatContents,
+    jobjectArray stopStrings,
+    jboolean stopAfterJson,
+    jobject callback
+) {
+    jclass callback_class = env->GetObjectClass(callback);
+    jmethodID on_token = env->GetMethodID(callback_class, "onToken", "([B)Z");
+    jmethodID on_prefill = on_token ?
+        env->GetMethodID(callback_class, "onPrefillProgress", "(II)Z") : nullptr;
+    env->DeleteLocalRef(callback_class);
+    if (on_token == nullptr || on_prefill == nullptr) {
+        LOGE("TokenCallback methods not found");
+        return string_to_jstring(env, "[Error: Invalid callback]");
+    }
+
+    ensure_default_session();
+    std::shared_ptr<Session> session = get_session(sessionId);
+    if (!session) {
+        return string_to_jstring(env, "[Error: Unknown session]");
+    }
+
+    std::lock_guard<std::mutex> session_lock(session->mutex);
+    std::shared_lock<std::shared_mutex> lock(g_mutex);
+
+    PromptInput input;
+    if (!make_prompt_input(env, prompt, chatRoles, chatContents, input)) {
+        return string_to_jstring(env, "[Error: Roles and contents differ in length]");
+    }
+    SamplerConfig config = make_sampler_config(env, temperature, topP, topK, repeatPenalty,
+                                               repeatLastN, minP, typicalP, mirostat,
+                                               mirostatTau, mirostatEta, grammar);
+    StopMatcher stop = make_stop_matcher(env, stopStrings, stopAfterJson);
+    std::string result = run_generation(*session, input, maxTokens, config,
+                                        nKeep, contextShift == JNI_TRUE, stop,
+                                        make_jni_piece_callback(env, callback, on_token),
+                                        make_jni_progress_callback(env, callback, on_prefill));
+    if (env->ExceptionCheck()) {
+        return nullptr;
+    }
+    return string_to_jstring(env, result);
+}
+
+JNIEXPORT void JNICALL
+Java_com_nanoai_llm_LlamaBridge_stopGeneration(
+    JNIEnv* env,
+    jobject /* this */
+) {
+    LOGI("Stop generation requested");
+    std::lock_guard<std::mutex> lock(g_sessions_mutex);
+    for (auto& entry : g_sessions) {
+        entry.second->stop_requested = true;
+    }
+}
+
+JNIEXPORT void JNICALL
+Java_com_nanoai_llm_LlamaBridge_stopSession(
+    JNIEnv* env,
+    jobject /* this */,
+    jint sessionId
+) {
+    std::shared_ptr<Session> session = get_session(sessionId);
+    if (session) {
+        LOGI("Stop requested for session %d", sessionId);
+        session->stop_requested = true;
+    }
+}
+
+JNIEXPORT jboolean JNICALL
+Java_com_nanoai_llm_LlamaBridge_isGenerating(
+    JNIEnv* env,
+    jobject /* this */
+) {
+    return g_active_generations > 0 ? JNI_TRUE : JNI_FALSE;
+}
+
+// Returns [drafted, accepted] token counts since the last reset, or null
+// when no draft model is loaded
+JNIEXPORT jlongArray JNICALL
+Java_com_nanoai_llm_LlamaBridge_getSpeculativeStats(
+    JNIEnv* env,
+    jobject /* this */,
+    jboolean reset
+) {
+    std::shared_lock<std::shared_mutex> lock(g_mutex);
+    if (!g_draft_ctx) return nullptr;
+
+    jlong stats[2] = {
+        reset ? g_spec_drafted.exchange(0) : g_spec_drafted.load(),
+        reset ? g_spec_accepted.exchange(0) : g_spec_accepted.load(),
+    };
+    jlongArray result = env->NewLongArray(2);
+    if (result) env->SetLongArrayRegion(result, 0, 2, stats);
+    return result;
+}
+
+// Returns the metrics of a session's last finished generation as JSON, or
+// null if it has none. sessionId < 0 picks the most recent generation on
+// any session.
+JNIEXPORT jstring JNICALL
+Java_com_nanoai_llm_LlamaBridge_getPerfStats(
+    JNIEnv* env,
+    jobject /* this */,
+    jint sessionId
+) {
+    int id = sessionId >= 0 ? sessionId : g_last_perf_session.load();
+    auto session = id >= 0 ? get_session(id) : nullptr;
+    if (!session) return nullptr;
+
+    std::lock_guard<std::mutex> perf_lock(session->perf_mutex);
+    if (!session->has_perf) return nullptr;
+    return string_to_jstring(env, perf_stats_json(session->perf));
+}
+
+// ============================================================================
+// Embeddings (for RAG)
+// ============================================================================
+
+/**
+ * Load a dedicated embedding GGUF (e.g. a small sentence encoder). With an
+ * empty path, embeddings use a second context on the chat model instead.
+ * Either way the chat context and its KV cache are left alone.
+ */
+JNIEXPORT jboolean JNICALL
+Java_com_nanoai_llm_LlamaBridge_loadEmbeddingModel(
+    JNIEnv* env,
+    jobject /* this */,
+    jstring modelPath,
+    jint pooling
+) {
+    std::shared_lock<std::shared_mutex> lock(g_mutex);
+    std::lock_guard<std::mutex> embed_lock(g_embed_mutex);
+
+    free_embedding_locked();
+
+    std::string path = jstring_to_string(env, modelPath);
+    if (!path.empty()) {
+        init_backend();
+        LOGI("Loading embedding model from: %s", path.c_str());
+        llama_model_params model_params = llama_model_default_params();
+        model_params.use_mmap = true;
+        model_params.use_mlock = false;
+        model_params.n_gpu_layers = 0;
+        g_embd_model = llama_load_model_from_file(path.c_str(), model_params);
+        if (!g_embd_model) {
+            LOGE("Failed to load embedding model from: %s", path.c_str());
+            return JNI_FALSE;
+        }
+    }
+
+    return ensure_embedding_ctx(pooling) ? JNI_TRUE : JNI_FALSE;
+}
+
+JNIEXPORT void JNICALL
+Java_com_nanoai_llm_LlamaBridge_unloadEmbeddingModel(
+    JNIEnv* env,
+    jobject /* this */
+) {
+    std::shared_lock<std::shared_mutex> lock(g_mutex);
+    std::lock_guard<std::mutex> embed_lock(g_embed_mutex);
+
+    LOGI("Unloading embedding model");
+    free_embedding_locked();
+}
+
+JNIEXPORT jfloatArray JNICALL
+Java_com_nanoai_llm_LlamaBridge_getEmbedding(
+    JNIEnv* env,
+    jobject /* this */,
+    jstring text
+) {
+    std::shared_lock<std::shared_mutex> lock(g_mutex);
+
+    std::vector<std::string> text_vec{jstring_to_string(env, text)};
+    return embeddings_to_jarray(env, text_vec, POOLING_CURRENT);
+}
+
+/**
+ * Embed several texts in as few decodes as possible. Returns one
+ * contiguous array of texts.length x embeddingSize normalized floats, or
+ * null on failure. pooling selects mean/CLS/last-token pooling; changing
+ * it recreates the embedding context.
+ */
+JNIEXPORT jfloatArray JNICALL
+Java_com_nanoai_llm_LlamaBridge_getEmbeddings(
+    JNIEnv* env,
+    jobject /* this */,
+    jobjectArray texts,
+    jint pooling
+) {
+    std::shared_lock<std::shared_mutex> lock(g_mutex);
+
+    std::vector<std::string> text_vec = jstring_array_to_vector(env, texts);
+    if (text_vec.empty()) return nullptr;
+    return embeddings_to_jarray(env, text_vec, pooling);
+}
+
+/**
+ * Embed several texts straight into a direct ByteBuffer in native byte
+ * order, as texts.length x embeddingSize normalized floats from the
+ * buffer's start. No Java arrays are allocated, so a caller can reuse one
+ * buffer across batches. Returns the embedding size, or 0 on failure or if
+ * the buffer is too small.
+ */
+JNIEXPORT jint JNICALL
+Java_com_nanoai_llm_LlamaBridge_getEmbeddingsInto(
+    JNIEnv* env,
+    jobject /* this */,
+    jobjectArray texts,
+    jint pooling,
+    jobject out
+) {
+    float* data = (float*)env->GetDirectBufferAddress(out);
+    jlong bytes = env->GetDirectBufferCapacity(out);
+    if (!data || bytes <= 0) {
+        LOGE("getEmbeddingsInto needs a direct buffer");
+        return 0;
+    }
+
+    std::shared_lock<std::shared_mutex> lock(g_mutex);
+
+    std::vector<std::string> text_vec = jstring_array_to_vector(env, texts);
+    if (text_vec.empty()) return 0;
+    if (!compute_embeddings_batch(text_vec, pooling, data, bytes / sizeof(float))) {
+        return 0;
+    }
+    return llama_model_n_embd(embedding_model());
+}
+
+// ============================================================================
+// Vector Index (for RAG)
+// ============================================================================
+
+JNIEXPORT jlong JNICALL
+Java_com_nanoai_llm_LlamaBridge_vectorIndexCreate(
+    JNIEnv* env,
+    jobject /* this */,
+    jint dim
+) {
+    if (dim <= 0) return 0;
+    return reinterpret_cast<jlong>(new VectorIndex(dim));
+}
+
+/**
+ * Map a vectors.bin written by vectorIndexFlush(). Only the first maxRows
+ * rows are used, so rows without committed chunk metadata are dropped.
+ * Returns 0 if the file is missing or invalid.
+ */
+JNIEXPORT jlong JNICALL
+Java_com_nanoai_llm_LlamaBridge_vectorIndexOpen(
+    JNIEnv* env,
+    jobject /* this */,
+    jstring path,
+    jint maxRows
+) {
+    std::string path_str = jstring_to_string(env, path);
+    std::unique_ptr<VectorIndex> index = VectorIndex::open(path_str, maxRows);
+    if (!index) {
+        LOGW("Cannot open vector file: %s", path_str.c_str());
+        return 0;
+    }
+    LOGI("Mapped %zu vectors (dim %d) from %s", index->size(), index->dim(), path_str.c_str());
+    return reinterpret_cast<jlong>(index.release());
+}
+
+JNIEXPORT jboolean JNICALL
+Java_com_nanoai_llm_LlamaBridge_vectorIndexFlush(
+    JNIEnv* env,
+    jobject /* this */,
+    jlong handle,
+    jstring path
+) {
+    VectorIndex* index = reinterpret_cast<VectorIndex*>(handle);
+    if (!index) return JNI_FALSE;
+
+    std::string path_str = jstring_to_string(env, path);
+    if (!index->flush(path_str)) {
+        LOGE("Failed to write vector file: %s (errno: %d)", path_str.c_str(), errno);
+        return JNI_FALSE;
+    }
+    return JNI_TRUE;
+}
+
+/**
+ * Write the whole index to stagedPath under a new generation. The caller
+ * renames it over path to commit; appends then go to path.
+ */
+JNIEXPORT jboolean JNICALL
+Java_com_nanoai_llm_LlamaBridge_vectorIndexStage(
+    JNIEnv* env,
+    jobject /* this */,
+    jlong handle,
+    jstring stagedPath,
+    jstring path,
+    jlong generation
+) {
+    VectorIndex* index = reinterpret_cast<VectorIndex*>(handle);
+    if (!index) return JNI_FALSE;
+
+    std::string staged_str = jstring_to_string(env, stagedPath);
+    if (!index->stage(staged_str, jstring_to_string(env, path), (uint64_t)generation)) {
+        LOGE("Failed to stage vector file: %s (errno: %d)", staged_str.c_str(), errno);
+        return JNI_FALSE;
+    }
+    return JNI_TRUE;
+}
+
+JNIEXPORT jlong JNICALL
+Java_com_nanoai_llm_LlamaBridge_vectorIndexGeneration(
+    JNIEnv* env,
+    jobject /* this */,
+    jlong handle
+) {
+    VectorIndex* index = reinterpret_cast<VectorIndex*>(handle);
+    return index ? (jlong)index->generation() : 0;
+}
+
+JNIEXPORT jint JNICALL
+Java_com_nanoai_llm_LlamaBridge_vectorIndexDim(
+    JNIEnv* env,
+    jobject /* this */,
+    jlong handle
+) {
+    VectorIndex* index = reinterpret_cast<VectorIndex*>(handle);
+    return index ? index->dim() : 0;
+}
+
+JNIEXPORT jint JNICALL
+Java_com_nanoai_llm_LlamaBridge_vectorIndexSize(
+    JNIEnv* env,
+    jobject /* this */,
+    jlong handle
+) {
+    VectorIndex* index = reinterpret_cast<VectorIndex*>(handle);
+    return index ? (jint)index->size() : 0;
+}
+
+JNIEXPORT void JNICALL
+Java_com_nanoai_llm_LlamaBridge_vectorIndexFree(
+    JNIEnv* env,
+    jobject /* this */,
+    jlong handle
+) {
+    delete reinterpret_cast<VectorIndex*>(handle);
+}
+
+/**
+ * Append rows given as one flat array of count x dim floats.
+ */
+JNIEXPORT jboolean JNICALL
+Java_com_nanoai_llm_LlamaBridge_vectorIndexAdd(
+    JNIEnv* env,
+    jobject /* this */,
+    jlong handle,
+    jfloatArray rows,
+    jint count
+) {
+    VectorIndex* index = reinterpret_cast<VectorIndex*>(handle);
+    if (!index || count <= 0) return JNI_FALSE;
+    if (env->GetArrayLength(rows) < (jsize)count * index->dim()) {
+        LOGE("Vector index add: array shorter than %d rows", count);
+        return JNI_FALSE;
+    }
+
+    float* data = (float*)env->GetPrimitiveArrayCritical(rows, nullptr);
+    if (!data) return JNI_FALSE;
+    bool ok = index->add(data, count);
+    env->ReleasePrimitiveArrayCritical(rows, data, JNI_ABORT);
+
+    if (!ok) LOGE("Vector index add: out of memory for %d rows", count);
+    return ok ? JNI_TRUE : JNI_FALSE;
+}
+
+/**
+ * Append count rows from a direct ByteBuffer of native-order floats, such
+ * as one filled by getEmbeddingsInto. Rows are read in place.
+ */
+JNIEXPORT jboolean JNICALL
+Java_com_nanoai_llm_LlamaBridge_vectorIndexAddBuffer(
+    JNIEnv* env,
+    jobject /* this */,
+    jlong handle,
+    jobject rows,
+    jint count
+) {
+    VectorIndex* index = reinterpret_cast<VectorIndex*>(handle);
+    if (!index || count <= 0) return JNI_FALSE;
+
+    const float* data = (const float*)env->GetDirectBufferAddress(rows);
+    jlong bytes = env->GetDirectBufferCapacity(rows);
+    if (!data || bytes < (jlong)count * index->dim() * (jlong)sizeof(float)) {
+        LOGE("Vector index add: buffer is not direct or shorter than %d rows", count);
+        return JNI_FALSE;
+    }
+
+    bool ok = index->add(data, count);
+    if (!ok) LOGE("Vector index add: out of memory for %d rows", count);
+    return ok ? JNI_TRUE : JNI_FALSE;
+}
+
+JNIEXPORT void JNICALL
+Java_com_nanoai_llm_LlamaBridge_vectorIndexRemove(
+    JNIEnv* env,
+    jobject /* this */,
+    jlong handle,
+    jintArray rows
+) {
+    VectorIndex* index = reinterpret_cast<VectorIndex*>(handle);
+    if (!index) return;
+
+    int len = env->GetArrayLength(rows);
+    std::vector<int32_t> row_vec(len);
+    env->GetIntArrayRegion(rows, 0, len, reinterpret_cast<jint*>(row_vec.data()));
+    index->remove(row_vec);
+}
+
+JNIEXPORT void JNICALL
+Java_com_nanoai_llm_LlamaBridge_vectorIndexClear(
+    JNIEnv* env,
+    jobject /* this */,
+    jlong handle
+) {
+    VectorIndex* index = reinterpret_cast<VectorIndex*>(handle);
+    if (index) index->clear();
+}
+
+/**
+ * Build an HNSW graph over the index and keep it updated on add. m is the
+ * number of links per node, efConstruction the build beam width.
+ */
+JNIEXPORT void JNICALL
+Java_com_nanoai_llm_LlamaBridge_vectorIndexEnableAnn(
+    JNIEnv* env,
+    jobject /* this */,
+    jlong handle,
+    jint m,
+    jint efConstruction
+) {
+    VectorIndex* index = reinterpret_cast<VectorIndex*>(handle);
+    if (!index) return;
+    index->enable_ann(m, efConstruction);
+    LOGI("ANN index built over %zu rows (M=%d, ef_construction=%d)",
+         index->size(), m, efConstruction);
+}
+
+JNIEXPORT void JNICALL
+Java_com_nanoai_llm_LlamaBridge_vectorIndexDisableAnn(
+    JNIEnv* env,
+    jobject /* this */,
+    jlong handle
+) {
+    VectorIndex* index = reinterpret_cast<VectorIndex*>(handle);
+    if (index) index->disable_ann();
+}
+
+JNIEXPORT void JNICALL
+Java_com_nanoai_llm_LlamaBridge_vectorIndexSetEfSearch(
+    JNIEnv* env,
+    jobject /* this */,
+    jlong handle,
+    jint ef
+) {
+    VectorIndex* index = reinterpret_cast<VectorIndex*>(handle);
+    if (index && ef > 0) index->set_ef_search(ef);
 }
 
-JNIEXPORT jboolean JNICALL
-Java_com_nanoai_llm_LlamaBridge_isModelLoaded(
+/**
+ * Top-k search. Fills outRows/outScores best first and returns the number
+ * of results, at most outRows.length. Uses the ANN graph when enabled,
+ * unless exact is set.
+ */
+JNIEXPORT jint JNICALL
+Java_com_nanoai_llm_LlamaBridge_vectorIndexSearch(
     JNIEnv* env,
-    jobject /* this */
+    jobject /* this */,
+    jlong handle,
+    jfloatArray query,
+    jfloat minScore,
+    jintArray outRows,
+    jfloatArray outScores,
+    jboolean exact
 ) {
-    std::lock_guard<std::mutex> lock(g_mutex);
-    return (g_model != nullptr && g_ctx != nullptr) ? JNI_TRUE : JNI_FALSE;
+    VectorIndex* index = reinterpret_cast<VectorIndex*>(handle);
+    if (!index) return 0;
+    if (env->GetArrayLength(query) != index->dim()) {
+        LOGW("Vector index search: query has %d dims, index has %d",
+             env->GetArrayLength(query), index->dim());
+        return 0;
+    }
+
+    int k = std::min(env->GetArrayLength(outRows), env->GetArrayLength(outScores));
+    std::vector<float> q(index->dim());
+    env->GetFloatArrayRegion(query, 0, index->dim(), q.data());
+
+    std::vector<int32_t> result_rows(k);
+    std::vector<float> result_scores(k);
+    int n = index->search(q.data(), k, minScore, result_rows.data(), result_scores.data(),
+                          exact == JNI_TRUE);
+
+    env->SetIntArrayRegion(outRows, 0, n, reinterpret_cast<jint*>(result_rows.data()));
+    env->SetFloatArrayRegion(outScores, 0, n, result_scores.data());
+    return n;
 }
 
 // ============================================================================
-// Text Generation
+// Session State
 // ============================================================================
 
-JNIEXPORT jstring JNICALL
-Java_com_nanoai_llm_LlamaBridge_generate(
+/**
+ * Save the KV cache and token history of a session to disk.
+ * The file is bound to the loaded model's fingerprint.
+ */
+JNIEXPORT jboolean JNICALL
+Java_com_nanoai_llm_LlamaBridge_saveSession(
     JNIEnv* env,
     jobject /* this */,
-    jstring prompt,
-    jint maxTokens,
-    jfloat temperature,
-    jfloat topP,
-    jint topK,
-    jfloat repeatPenalty
+    jint sessionId,
+    jstring sessionPath
 ) {
-    std::lock_guard<std::mutex> lock(g_mutex);
+    std::shared_ptr<Session> session = get_session(sessionId);
+    if (!session) {
+        LOGE("Unknown session %d for save", sessionId);
+        return JNI_FALSE;
+    }
+
+    std::lock_guard<std::mutex> session_lock(session->mutex);
+    std::shared_lock<std::shared_mutex> lock(g_mutex);
 
     if (!g_model || !g_ctx) {
-        LOGE("Model not loaded");
-        return string_to_jstring(env, "[Error: Model not loaded]");
+        LOGE("Model not loaded for session save");
+        return JNI_FALSE;
+    }
+    if (session->kv_tokens.empty()) {
+        LOGD("Nothing to save, KV cache is empty");
+        return JNI_FALSE;
     }
 
-    g_is_generating = true;
-    g_stop_requested = false;
-
-    std::string prompt_str = jstring_to_string(env, prompt);
-    LOGD("Generating with prompt length: %zu", prompt_str.length());
+    std::string path = jstring_to_string(env, sessionPath);
+    std::string tmp_path = path + ".tmp";
 
-    // Tokenize prompt
-    std::vector<llama_token> tokens = tokenize(prompt_str, true);
-    if (tokens.empty()) {
-        g_is_generating = false;
-        return string_to_jstring(env, "[Error: Failed to tokenize]");
+    llama_seq_id seq_id = session->seq_id;
+    std::vector<uint8_t> state;
+    size_t written = 0;
+    {
+        std::lock_guard<std::mutex> ctx_lock(g_ctx_mutex);
+        state.resize(llama_state_seq_get_size(g_ctx, seq_id));
+        written = llama_state_seq_get_data(g_ctx, state.data(), state.size(), seq_id);
+    }
+    if (written == 0) {
+        LOGE("Failed to read session state");
+        return JNI_FALSE;
     }
 
-    int n_ctx = llama_n_ctx(g_ctx);
-    if ((int)tokens.size() > n_ctx - 4) {
-        g_is_generating = false;
-        LOGW("Prompt too long: %zu tokens > context %d", tokens.size(), n_ctx);
-        return string_to_jstring(env, "[Error: Prompt too long]");
+    FILE* f = fopen(tmp_path.c_str(), "wb");
+    if (!f) {
+        LOGE("Cannot open session file: %s (errno: %d)", tmp_path.c_str(), errno);
+        return JNI_FALSE;
     }
 
-    // Clear KV cache
-    llama_kv_cache_clear(g_ctx);
+    const std::vector<llama_token>& kv_tokens = session->kv_tokens;
+    uint32_t fp_len = g_model_fingerprint.size();
+    uint32_t n_tokens = kv_tokens.size();
+    uint64_t state_len = written;
+    bool ok = fwrite(&SESSION_MAGIC, sizeof(SESSION_MAGIC), 1, f) == 1 &&
+              fwrite(&SESSION_VERSION, sizeof(SESSION_VERSION), 1, f) == 1 &&
+              fwrite(&fp_len, sizeof(fp_len), 1, f) == 1 &&
+              fwrite(g_model_fingerprint.data(), 1, fp_len, f) == fp_len &&
+              fwrite(&n_tokens, sizeof(n_tokens), 1, f) == 1 &&
+              fwrite(kv_tokens.data(), sizeof(llama_token), n_tokens, f) == n_tokens &&
+              fwrite(&state_len, sizeof(state_len), 1, f) == 1 &&
+              fwrite(state.data(), 1, written, f) == written;
+    ok = (fclose(f) == 0) && ok;
 
-    // Process prompt in batch
-    llama_batch batch = llama_batch_init(tokens.size(), 0, 1);
-    llama_seq_id seq_id = 0;
-    for (size_t i = 0; i < tokens.size(); i++) {
-        batch.token[batch.n_tokens] = tokens[i];
-        batch.pos[batch.n_tokens] = i;
-        batch.n_seq_id[batch.n_tokens] = 1;
-        batch.seq_id[batch.n_tokens] = &seq_id;
-        batch.logits[batch.n_tokens] = (i == tokens.size() - 1);
-        batch.n_tokens++;
+    if (!ok || rename(tmp_path.c_str(), path.c_str()) != 0) {
+        LOGE("Failed to write session file: %s", path.c_str());
+        remove(tmp_path.c_str());
+        return JNI_FALSE;
     }
 
-    if (llama_decode(g_ctx, batch) != 0) {
-        llama_batch_free(batch);
-        g_is_generating = false;
-        LOGE("Failed to decode prompt");
-        return string_to_jstring(env, "[Error: Decode failed]");
+    LOGI("Saved session %d: %u tokens, %zu KB state", sessionId, n_tokens, written / 1024);
+    return JNI_TRUE;
+}
+
+/**
+ * Restore a session saved by saveSession(). Fails without touching the
+ * KV cache if the file was written for a different model or does not fit.
+ */
+JNIEXPORT jboolean JNICALL
+Java_com_nanoai_llm_LlamaBridge_loadSession(
+    JNIEnv* env,
+    jobject /* this */,
+    jint sessionId,
+    jstring sessionPath
+) {
+    ensure_default_session();
+    std::shared_ptr<Session> session = get_session(sessionId);
+    if (!session) {
+        LOGE("Unknown session %d for restore", sessionId);
+        return JNI_FALSE;
     }
 
-    llama_batch_free(batch);
+    std::lock_guard<std::mutex> session_lock(session->mutex);
+    std::shared_lock<std::shared_mutex> lock(g_mutex);
 
-    // Generation parameters
-    int max_gen = maxTokens > 0 ? maxTokens : g_params.max_tokens;
-    float temp = temperature >= 0 ? temperature : g_params.temperature;
-    float top_p_val = topP > 0 ? topP : g_params.top_p;
-    int top_k_val = topK > 0 ? topK : g_params.top_k;
-    float rep_pen = repeatPenalty > 0 ? repeatPenalty : g_params.repeat_penalty;
+    if (!g_model || !g_ctx) {
+        LOGE("Model not loaded for session restore");
+        return JNI_FALSE;
+    }
 
-    // Create sampler chain
-    llama_sampler_chain_params sparams = llama_sampler_chain_default_params();
-    llama_sampler* smpl = llama_sampler_chain_init(sparams);
+    std::string path = jstring_to_string(env, sessionPath);
+    FILE* f = fopen(path.c_str(), "rb");
+    if (!f) {
+        LOGD("No session file: %s", path.c_str());
+        return JNI_FALSE;
+    }
 
-    // Add samplers to chain
-    llama_sampler_chain_add(smpl, llama_sampler_init_top_k(top_k_val));
-    llama_sampler_chain_add(smpl, llama_sampler_init_top_p(top_p_val, 1));
-    llama_sampler_chain_add(smpl, llama_sampler_init_temp(temp));
-    llama_sampler_chain_add(smpl, llama_sampler_init_dist((uint32_t)time(nullptr)));
+    uint32_t magic = 0, version = 0, fp_len = 0, n_tokens = 0;
+    uint64_t state_len = 0;
+    std::string fingerprint;
+    std::vector<llama_token> tokens;
+    std::vector<uint8_t> state;
 
-    // Generate tokens
-    std::vector<llama_token> generated;
-    int n_cur = tokens.size();
-    const llama_vocab* vocab = llama_model_get_vocab(g_model);
-    int n_vocab = llama_vocab_n_tokens(vocab);
+    bool ok = fread(&magic, sizeof(magic), 1, f) == 1 && magic == SESSION_MAGIC &&
+              fread(&version, sizeof(version), 1, f) == 1 && version == SESSION_VERSION &&
+              fread(&fp_len, sizeof(fp_len), 1, f) == 1 && fp_len < 1024;
+    if (ok) {
+        fingerprint.resize(fp_len);
+        ok = fread(&fingerprint[0], 1, fp_len, f) == fp_len;
+    }
+    if (ok && fingerprint != g_model_fingerprint) {
+        LOGW("Session was saved for a different model, ignoring");
+        fclose(f);
+        return JNI_FALSE;
+    }
+    if (ok) {
+        ok = fread(&n_tokens, sizeof(n_tokens), 1, f) == 1 &&
+             n_tokens > 0 && n_tokens < llama_n_ctx(g_ctx);
+    }
+    if (ok) {
+        tokens.resize(n_tokens);
+        ok = fread(tokens.data(), sizeof(llama_token), n_tokens, f) == n_tokens &&
+             fread(&state_len, sizeof(state_len), 1, f) == 1;
+    }
+    if (ok) {
+        state.resize(state_len);
+        ok = fread(state.data(), 1, state_len, f) == state_len;
+    }
+    fclose(f);
 
-    for (int i = 0; i < max_gen && !g_stop_requested; i++) {
-        // Get logits
-        float* logits = llama_get_logits(g_ctx);
+    if (!ok) {
+        LOGE("Invalid or truncated session file: %s", path.c_str());
+        return JNI_FALSE;
+    }
 
-        // Create candidates
-        std::vector<llama_token_data> candidates;
-        candidates.reserve(n_vocab);
-        for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
-            candidates.emplace_back(llama_token_data{token_id, logits[token_id], 0.0f});
+    llama_seq_id seq_id = session->seq_id;
+    session->kv_tokens.clear();
+    {
+        std::lock_guard<std::mutex> ctx_lock(g_ctx_mutex);
+        llama_kv_cache_seq_rm(g_ctx, seq_id, -1, -1);
+        if (llama_state_seq_set_data(g_ctx, state.data(), state.size(), seq_id) == 0) {
+            LOGE("Failed to restore session state");
+            llama_kv_cache_seq_rm(g_ctx, seq_id, -1, -1);
+            return JNI_FALSE;
         }
-        llama_token_data_array candidates_p = {candidates.data(), candidates.size(), false};
-
-        // Apply sampler chain
-        llama_sampler_apply(smpl, &candidates_p);
-        llama_token new_token = candidates_p.data[0].id;
-
-        // Accept token in sampler
-        llama_sampler_accept(smpl, new_token);
+    }
 
-        // Check for EOS
-        if (llama_token_is_eog(g_model, new_token)) {
-            LOGD("EOS token reached at position %d", i);
-            break;
-        }
+    session->kv_tokens = std::move(tokens);
+    session->n_shifted = 0;
+    LOGI("Restored session %d: %zu tokens", sessionId, session->kv_tokens.size());
+    return JNI_TRUE;
+}
 
-        generated.push_back(new_token);
+/**
+ * Size the prefix KV cache: snapshots of long prompts kept in up to
+ * ramBytes of memory, then spilled to spillDir (null or empty for none)
+ * up to diskBytes. ramBytes 0 disables it. Existing snapshots are dropped,
+ * as are spill files left in spillDir by an earlier process.
+ */
+JNIEXPORT void JNICALL
+Java_com_nanoai_llm_LlamaBridge_configurePrefixCache(
+    JNIEnv* env,
+    jobject /* this */,
+    jlong ramBytes,
+    jstring spillDir,
+    jlong diskBytes
+) {
+    std::string dir = jstring_to_string(env, spillDir);
 
-        // Prepare next batch
-        llama_batch next_batch = llama_batch_init(1, 0, 1);
-        next_batch.token[0] = new_token;
-        next_batch.pos[0] = n_cur;
-        next_batch.n_seq_id[0] = 1;
-        next_batch.seq_id[0] = &seq_id;
-        next_batch.logits[0] = true;
-        next_batch.n_tokens = 1;
+    std::lock_guard<std::mutex> lock(g_prefix_mutex);
+    clear_prefix_cache_locked();
+    g_prefix_ram_budget = std::max<jlong>(ramBytes, 0);
+    g_prefix_disk_budget = dir.empty() ? 0 : std::max<jlong>(diskBytes, 0);
+    g_prefix_spill_dir = dir;
 
-        if (llama_decode(g_ctx, next_batch) != 0) {
-            llama_batch_free(next_batch);
-            LOGE("Decode failed at token %d", i);
-            break;
+    if (!dir.empty()) {
+        mkdir(dir.c_str(), 0700);
+        if (DIR* d = opendir(dir.c_str())) {
+            while (dirent* e = readdir(d)) {
+                if (strncmp(e->d_name, "prefix-", 7) == 0) {
+                    remove((dir + "/" + e->d_name).c_str());
+                }
+            }
+            closedir(d);
         }
-
-        llama_batch_free(next_batch);
-        n_cur++;
     }
-
-    // Cleanup sampler
-    llama_sampler_free(smpl);
-    g_is_generating = false;
-
-    // Convert tokens to text
-    std::string result = detokenize(generated);
-    LOGD("Generated %zu tokens: %s", generated.size(),
-         result.substr(0, 50).c_str());
-
-    return string_to_jstring(env, result);
+    LOGI("Prefix cache: %.0f MB RAM, %.0f MB disk", g_prefix_ram_budget / (1024.0 * 1024.0),
+         g_prefix_disk_budget / (1024.0 * 1024.0));
 }
 
 JNIEXPORT void JNICALL
-Java_com_nanoai_llm_LlamaBridge_stopGeneration(
+Java_com_nanoai_llm_LlamaBridge_clearPrefixCache(
     JNIEnv* env,
     jobject /* this */
 ) {
-    LOGI("Stop generation requested");
-    g_stop_requested = true;
+    std::lock_guard<std::mutex> lock(g_prefix_mutex);
+    clear_prefix_cache_locked();
 }
 
-JNIEXPORT jboolean JNICALL
-Java_com_nanoai_llm_LlamaBridge_isGenerating(
+/**
+ * Prefix cache counters and sizes as a JSON object.
+ */
+JNIEXPORT jstring JNICALL
+Java_com_nanoai_llm_LlamaBridge_getPrefixCacheStats(
     JNIEnv* env,
     jobject /* this */
 ) {
-    return g_is_generating ? JNI_TRUE : JNI_FALSE;
+    std::lock_guard<std::mutex> lock(g_prefix_mutex);
+    const PrefixCacheStats& st = g_prefix_stats;
+    size_t n_ram = 0;
+    for (const PrefixEntry& entry : g_prefix_entries) {
+        if (entry.state) n_ram++;
+    }
+    char json[512];
+    snprintf(json, sizeof(json),
+             "{\"hits\":%llu,\"diskHits\":%llu,\"misses\":%llu,\"tokensSaved\":%llu,"
+             "\"stores\":%llu,\"spills\":%llu,\"evictions\":%llu,\"entries\":%zu,"
+             "\"ramEntries\":%zu,\"ramBytes\":%zu,\"diskBytes\":%zu,"
+             "\"ramBudget\":%zu,\"diskBudget\":%zu}",
+             (unsigned long long)st.hits, (unsigned long long)st.disk_hits,
+             (unsigned long long)st.misses, (unsigned long long)st.tokens_saved,
+             (unsigned long long)st.stores, (unsigned long long)st.spills,
+             (unsigned long long)st.evictions, g_prefix_entries.size(), n_ram,
+             g_prefix_ram_bytes, g_prefix_disk_bytes, g_prefix_ram_budget, g_prefix_disk_budget);
+    return string_to_jstring(env, json);
 }
 
 // ============================================================================
-// Embeddings (for RAG)
+// Configuration
 // ============================================================================
 
-JNIEXPORT jfloatArray JNICALL
-Java_com_nanoai_llm_LlamaBridge_getEmbedding(
+/**
+ * Set decode and prefill thread counts. nThreadsBatch <= 0 uses nThreads.
+ */
+JNIEXPORT void JNICALL
+Java_com_nanoai_llm_LlamaBridge_setThreads(
     JNIEnv* env,
     jobject /* this */,
-    jstring text
+    jint nThreads,
+    jint nThreadsBatch
 ) {
-    std::lock_guard<std::mutex> lock(g_mutex);
+    std::shared_lock<std::shared_mutex> lock(g_mutex);
 
-    if (!g_model || !g_ctx) {
-        LOGE("Model not loaded for embedding");
-        return nullptr;
+    if (nThreads > 0) {
+        int n_threads_batch = nThreadsBatch > 0 ? nThreadsBatch : nThreads;
+        std::lock_guard<std::mutex> embed_lock(g_embed_mutex);
+        std::lock_guard<std::mutex> ctx_lock(g_ctx_mutex);
+        if (g_ctx) {
+            apply_threads_locked(nThreads, n_threads_batch);
+        } else {
+            g_params.n_threads = nThreads;
+            g_params.n_threads_batch = n_threads_batch;
+        }
+        LOGI("Threads set to: %d decode, %d prefill", nThreads, n_threads_batch);
     }
+}
 
-    std::string text_str = jstring_to_string(env, text);
+/**
+ * CPU layout as [core count, performance core ids...].
+ */
+JNIEXPORT jintArray JNICALL
+Java_com_nanoai_llm_LlamaBridge_getCpuTopology(
+    JNIEnv* env,
+    jobject /* this */
+) {
+    const CpuTopology& topo = cpu_topology();
+    std::vector<jint> values;
+    values.push_back(topo.n_cpus);
+    values.insert(values.end(), topo.perf_cpus.begin(), topo.perf_cpus.end());
 
-    // Tokenize
-    std::vector<llama_token> tokens = tokenize(text_str, true);
-    if (tokens.empty()) {
-        LOGE("Failed to tokenize for embedding");
-        return nullptr;
-    }
+    jintArray result = env->NewIntArray(values.size());
+    env->SetIntArrayRegion(result, 0, values.size(), values.data());
+    return result;
+}
 
-    // Clear cache and process
-    llama_kv_cache_clear(g_ctx);
+/**
+ * Measure throughput with the given thread counts on the loaded model:
+ * nPrompt tokens of prefill, then nGen single-token decodes on a spare
+ * sequence. Returns [prefill tokens/s, decode tokens/s], or null if no
+ * model is loaded or every sequence is taken. Generation on other
+ * sessions waits while this runs; the previous thread counts are restored.
+ */
+JNIEXPORT jfloatArray JNICALL
+Java_com_nanoai_llm_LlamaBridge_benchmarkThreads(
+    JNIEnv* env,
+    jobject /* this */,
+    jint nThreads,
+    jint nThreadsBatch,
+    jint nPrompt,
+    jint nGen
+) {
+    std::shared_lock<std::shared_mutex> lock(g_mutex);
+    if (!g_ctx || nThreads <= 0) return nullptr;
 
-    llama_batch batch = llama_batch_init(tokens.size(), 0, 1);
-    llama_seq_id seq_id = 0;
-    for (size_t i = 0; i < tokens.size(); i++) {
-        batch.token[batch.n_tokens] = tokens[i];
-        batch.pos[batch.n_tokens] = i;
-        batch.n_seq_id[batch.n_tokens] = 1;
-        batch.seq_id[batch.n_tokens] = &seq_id;
-        batch.logits[batch.n_tokens] = (i == tokens.size() - 1);
-        batch.n_tokens++;
-    }
-
-    if (llama_decode(g_ctx, batch) != 0) {
-        llama_batch_free(batch);
-        LOGE("Failed to decode for embedding");
+    // A sequence no session owns
+    llama_seq_id seq = -1;
+    {
+        std::lock_guard<std::mutex> sessions_lock(g_sessions_mutex);
+        std::vector<bool> used(MAX_SESSIONS, false);
+        for (auto& entry : g_sessions) {
+            used[entry.second->seq_id] = true;
+        }
+        for (int i = 0; i < MAX_SESSIONS && seq < 0; i++) {
+            if (!used[i]) seq = i;
+        }
+    }
+    if (seq < 0) {
+        LOGW("No free sequence for thread benchmark");
         return nullptr;
     }
 
-    llama_batch_free(batch);
+    std::lock_guard<std::mutex> embed_lock(g_embed_mutex);
+    std::lock_guard<std::mutex> ctx_lock(g_ctx_mutex);
+    int saved_threads = g_params.n_threads;
+    int saved_threads_batch = g_params.n_threads_batch;
+    apply_threads_locked(nThreads, nThreadsBatch > 0 ? nThreadsBatch : nThreads);
 
-    // Get embedding dimension
-    int n_embd = llama_model_n_embd(g_model);
-    if (n_embd <= 0) {
-        LOGW("Model doesn't support embeddings, using logits mean");
-        return nullptr;
-    }
+    const llama_vocab* vocab = llama_model_get_vocab(g_model);
+    int n_vocab = llama_vocab_n_tokens(vocab);
+    int n_ctx = llama_n_ctx(g_ctx);
+    int n_prompt = std::clamp<int>(nPrompt, 1, std::min<int>(llama_n_batch(g_ctx), n_ctx / 2));
+    int n_gen = std::clamp<int>(nGen, 1, n_ctx / 2);
 
-    // Get embeddings from last token
-    float* embd = llama_get_embeddings(g_ctx);
-    if (!embd) {
-        LOGE("Failed to get embeddings");
-        return nullptr;
-    }
+    // Token ids are arbitrary; only the shapes matter
+    llama_batch batch = llama_batch_init(n_prompt, 0, 1);
+    auto decode_range = [&](int pos, int count) {
+        batch.n_tokens = 0;
+        for (int i = 0; i < count; i++) {
+            batch_add(batch, (llama_token)((pos + i) * 31 % n_vocab), pos + i, seq, i == count - 1);
+        }
+        return llama_decode(g_ctx, batch) == 0;
+    };
 
-    // Normalize embedding
-    float norm = 0.0f;
-    for (int i = 0; i < n_embd; i++) {
-        norm += embd[i] * embd[i];
-    }
-    norm = sqrtf(norm);
+    // Untimed warm-up so page-ins of the mapped weights do not count
+    bool ok = decode_range(0, 1);
+    llama_kv_cache_seq_rm(g_ctx, seq, -1, -1);
 
-    // Create Java float array
-    jfloatArray result = env->NewFloatArray(n_embd);
-    if (result == nullptr) {
-        return nullptr;
-    }
+    int64_t t_start = llama_time_us();
+    ok = ok && decode_range(0, n_prompt);
+    int64_t t_prompt_us = llama_time_us() - t_start;
 
-    // Copy normalized embedding
-    std::vector<float> normalized(n_embd);
-    for (int i = 0; i < n_embd; i++) {
-        normalized[i] = embd[i] / norm;
+    t_start = llama_time_us();
+    for (int i = 0; ok && i < n_gen; i++) {
+        ok = decode_range(n_prompt + i, 1);
     }
-    env->SetFloatArrayRegion(result, 0, n_embd, normalized.data());
+    int64_t t_gen_us = llama_time_us() - t_start;
 
-    return result;
-}
+    llama_kv_cache_seq_rm(g_ctx, seq, -1, -1);
+    llama_batch_free(batch);
+    apply_threads_locked(saved_threads, saved_threads_batch);
 
-// ============================================================================
-// Configuration
-// ============================================================================
+    if (!ok) {
+        LOGE("Thread benchmark decode failed");
+        return nullptr;
+    }
 
-JNIEXPORT void JNICALL
-Java_com_nanoai_llm_LlamaBridge_setThreads(
-    JNIEnv* env,
-    jobject /* this */,
-    jint nThreads
-) {
-    std::lock_guard<std::mutex> lock(g_mutex);
+    float rates[2] = {
+        n_prompt * 1e6f / std::max<int64_t>(t_prompt_us, 1),
+        n_gen * 1e6f / std::max<int64_t>(t_gen_us, 1),
+    };
+    LOGI("Thread benchmark %d/%d: prefill %.1f t/s, decode %.1f t/s",
+         nThreads, nThreadsBatch > 0 ? nThreadsBatch : nThreads, rates[0], rates[1]);
 
-    if (nThreads > 0) {
-        g_params.n_threads = nThreads;
-        if (g_ctx) {
-            llama_set_n_threads(g_ctx, nThreads, nThreads);
-        }
-        LOGI("Threads set to: %d", nThreads);
-    }
+    jfloatArray result = env->NewFloatArray(2);
+    env->SetFloatArrayRegion(result, 0, 2, rates);
+    return result;
 }
 
 JNIEXPORT void JNICALL
@@ -529,7 +4355,7 @@ Java_com_nanoai_llm_LlamaBridge_setDefaultParams(
     jint topK,
     jfloat repeatPenalty
 ) {
-    std::lock_guard<std::mutex> lock(g_mutex);
+    std::unique_lock<std::shared_mutex> lock(g_mutex);
 
     if (maxTokens > 0) g_params.max_tokens = maxTokens;
     if (temperature >= 0) g_params.temperature = temperature;
@@ -551,7 +4377,8 @@ Java_com_nanoai_llm_LlamaBridge_getContextSize(
     JNIEnv* env,
     jobject /* this */
 ) {
-    std::lock_guard<std::mutex> lock(g_mutex);
+    std::shared_lock<std::shared_mutex> lock(g_mutex);
+    if (g_ctx_released) return g_ctx_params.n_ctx;
     return g_ctx ? llama_n_ctx(g_ctx) : 0;
 }
 
@@ -560,7 +4387,7 @@ Java_com_nanoai_llm_LlamaBridge_getVocabSize(
     JNIEnv* env,
     jobject /* this */
 ) {
-    std::lock_guard<std::mutex> lock(g_mutex);
+    std::shared_lock<std::shared_mutex> lock(g_mutex);
     if (!g_model) return 0;
     const llama_vocab* vocab = llama_model_get_vocab(g_model);
     return llama_vocab_n_tokens(vocab);
@@ -571,8 +4398,9 @@ Java_com_nanoai_llm_LlamaBridge_getEmbeddingSize(
     JNIEnv* env,
     jobject /* this */
 ) {
-    std::lock_guard<std::mutex> lock(g_mutex);
-    return g_model ? llama_model_n_embd(g_model) : 0;
+    std::shared_lock<std::shared_mutex> lock(g_mutex);
+    llama_model* model = embedding_model();
+    return model ? llama_model_n_embd(model) : 0;
 }
 
 JNIEXPORT jstring JNICALL
@@ -580,7 +4408,7 @@ Java_com_nanoai_llm_LlamaBridge_getModelDescription(
     JNIEnv* env,
     jobject /* this */
 ) {
-    std::lock_guard<std::mutex> lock(g_mutex);
+    std::shared_lock<std::shared_mutex> lock(g_mutex);
 
     if (!g_model) {
         return string_to_jstring(env, "No model loaded");
@@ -603,24 +4431,126 @@ Java_com_nanoai_llm_LlamaBridge_getAvailableMemory(
     return (jlong)get_available_memory();
 }
 
+/**
+ * Memory the loaded model holds (weights and estimated KV cache), or 0
+ * with no model. A load that cannot hot-swap frees this first.
+ */
+JNIEXPORT jlong JNICALL
+Java_com_nanoai_llm_LlamaBridge_getModelMemory(
+    JNIEnv* env,
+    jobject /* this */
+) {
+    std::shared_lock<std::shared_mutex> lock(g_mutex);
+    return (jlong)g_model_bytes;
+}
+
+/**
+ * CPU features and the kernels in use as a JSON object: hwcaps from
+ * getauxval, the features the selected CPU backend was compiled with, and
+ * whether it was selected at runtime from variants.
+ */
+JNIEXPORT jstring JNICALL
+Java_com_nanoai_llm_LlamaBridge_getCpuInfo(
+    JNIEnv* env,
+    jobject /* this */
+) {
+    init_backend();
+    auto json_array = [](const std::vector<std::string>& items) {
+        std::string out = "[";
+        for (size_t i = 0; i < items.size(); i++) {
+            out += (i > 0 ? ",\"" : "\"") + items[i] + "\"";
+        }
+        return out + "]";
+    };
+#ifdef NANOAI_BACKEND_DL
+    const bool dynamic = true;
+#else
+    const bool dynamic = false;
+#endif
+    std::string json = "{\"hwcaps\":" + json_array(cpu_hwcaps()) +
+                       ",\"kernels\":" + json_array(cpu_backend_features()) +
+                       ",\"dynamic\":" + (dynamic ? "true" : "false") + "}";
+    return string_to_jstring(env, json);
+}
+
+/**
+ * The GPU device offload would use and the layers of the loaded model on
+ * it, as a JSON object. Null in CPU-only builds or without a usable device.
+ */
+JNIEXPORT jstring JNICALL
+Java_com_nanoai_llm_LlamaBridge_getGpuInfo(
+    JNIEnv* env,
+    jobject /* this */
+) {
+    init_backend();
+    ggml_backend_dev_t dev = gpu_device();
+    if (!dev) return nullptr;
+
+    size_t free_bytes = 0, total_bytes = 0;
+    ggml_backend_dev_memory(dev, &free_bytes, &total_bytes);
+    // Driver strings go into JSON as-is, minus anything needing escapes
+    std::string name = ggml_backend_dev_name(dev);
+    std::string description = ggml_backend_dev_description(dev);
+    for (std::string* text : {&name, &description}) {
+        if (text->size() > 160) text->resize(160);
+        std::replace_if(text->begin(), text->end(),
+                        [](char c) { return c == '"' || c == '\\' || (unsigned char)c < 0x20; }, ' ');
+    }
+
+    std::shared_lock<std::shared_mutex> lock(g_mutex);
+    char json[512];
+    snprintf(json, sizeof(json),
+             "{\"name\":\"%s\",\"description\":\"%s\",\"freeBytes\":%zu,\"totalBytes\":%zu,"
+             "\"offloadedLayers\":%d}",
+             name.c_str(), description.c_str(), free_bytes, total_bytes, g_gpu_layers);
+    return string_to_jstring(env, json);
+}
+
+/**
+ * Estimate the KV cache a context of nCtx tokens would allocate for a model
+ * file, from its GGUF metadata without loading it. Returns 0 if unknown.
+ */
+JNIEXPORT jlong JNICALL
+Java_com_nanoai_llm_LlamaBridge_estimateKvCacheBytes(
+    JNIEnv* env,
+    jobject /* this */,
+    jstring modelPath,
+    jint nCtx,
+    jint kvTypeK,
+    jint kvTypeV
+) {
+    std::string path = jstring_to_string(env, modelPath);
+    return (jlong)estimate_kv_bytes(path, nCtx, to_ggml_kv_type(kvTypeK), to_ggml_kv_type(kvTypeV));
+}
+
+/**
+ * Validate a GGUF file without loading it. Returns null if it is a complete
+ * model file, else what is wrong with it.
+ */
+JNIEXPORT jstring JNICALL
+Java_com_nanoai_llm_LlamaBridge_validateGguf(
+    JNIEnv* env,
+    jobject /* this */,
+    jstring modelPath
+) {
+    std::string path = jstring_to_string(env, modelPath);
+    std::string error;
+    if (validate_gguf(path, error)) return nullptr;
+    LOGW("Invalid GGUF %s: %s", path.c_str(), error.c_str());
+    return string_to_jstring(env, error);
+}
+
 JNIEXPORT void JNICALL
 Java_com_nanoai_llm_LlamaBridge_freeBackend(
     JNIEnv* env,
     jobject /* this */
 ) {
-    std::lock_guard<std::mutex> lock(g_mutex);
+    std::unique_lock<std::shared_mutex> lock(g_mutex);
 
-    if (g_sampler) {
-        llama_sampler_free(g_sampler);
-        g_sampler = nullptr;
-    }
-    if (g_ctx) {
-        llama_free(g_ctx);
-        g_ctx = nullptr;
-    }
-    if (g_model) {
-        llama_free_model(g_model);
-        g_model = nullptr;
+    free_model_locked();
+    {
+        std::lock_guard<std::mutex> embed_lock(g_embed_mutex);
+        free_embedding_locked();
     }
 
     llama_backend_free();
@@ -639,7 +4569,7 @@ Java_com_nanoai_llm_LlamaBridge_tokenize(
     jintArray outputTokens,
     jboolean addBos
 ) {
-    std::lock_guard<std::mutex> lock(g_mutex);
+    std::shared_lock<std::shared_mutex> lock(g_mutex);
 
     if (!g_model) {
         return -1;
@@ -657,13 +4587,84 @@ Java_com_nanoai_llm_LlamaBridge_tokenize(
     return (jint)tokens.size();
 }
 
+/**
+ * Format messages with the loaded model's chat template, as generation
+ * does for chat prompts. Returns null without a model or if formatting
+ * fails.
+ */
+JNIEXPORT jstring JNICALL
+Java_com_nanoai_llm_LlamaBridge_applyChatTemplate(
+    JNIEnv* env,
+    jobject /* this */,
+    jobjectArray roles,
+    jobjectArray contents,
+    jboolean addAssistant
+) {
+    std::shared_lock<std::shared_mutex> lock(g_mutex);
+    if (!g_model) return nullptr;
+
+    std::vector<std::string> role_vec = jstring_array_to_vector(env, roles);
+    std::vector<std::string> content_vec = jstring_array_to_vector(env, contents);
+    if (role_vec.empty() || role_vec.size() != content_vec.size()) return nullptr;
+
+    const char* tmpl = llama_model_chat_template(g_model, nullptr);
+    std::string out;
+    bool add = addAssistant == JNI_TRUE;
+    if ((!tmpl || !format_chat(tmpl, role_vec, content_vec, role_vec.size(), add, out)) &&
+        !format_chat("chatml", role_vec, content_vec, role_vec.size(), add, out)) {
+        return nullptr;
+    }
+    return string_to_jstring(env, out);
+}
+
+/**
+ * Count the tokens of UTF-8 text, or -1 without a model.
+ */
+JNIEXPORT jint JNICALL
+Java_com_nanoai_llm_LlamaBridge_countTokens(
+    JNIEnv* env,
+    jobject /* this */,
+    jbyteArray utf8,
+    jboolean addBos
+) {
+    std::shared_lock<std::shared_mutex> lock(g_mutex);
+    if (!g_model) return -1;
+
+    std::string text = jbytes_to_string(env, utf8);
+    return count_tokens(text.data(), text.size(), addBos == JNI_TRUE);
+}
+
+/**
+ * Split UTF-8 text into chunks of at most maxTokens tokens overlapping by
+ * overlap tokens. Returns [start, end) byte offsets into utf8 as flat
+ * pairs, or null without a model.
+ */
+JNIEXPORT jintArray JNICALL
+Java_com_nanoai_llm_LlamaBridge_chunkByTokens(
+    JNIEnv* env,
+    jobject /* this */,
+    jbyteArray utf8,
+    jint maxTokens,
+    jint overlap
+) {
+    std::shared_lock<std::shared_mutex> lock(g_mutex);
+    if (!g_model) return nullptr;
+
+    std::string text = jbytes_to_string(env, utf8);
+    std::vector<int> ranges = chunk_by_tokens(text.data(), text.size(), maxTokens, overlap);
+
+    jintArray result = env->NewIntArray(ranges.size());
+    if (result) env->SetIntArrayRegion(result, 0, ranges.size(), ranges.data());
+    return result;
+}
+
 JNIEXPORT jstring JNICALL
 Java_com_nanoai_llm_LlamaBridge_detokenize(
     JNIEnv* env,
     jobject /* this */,
     jintArray tokens
 ) {
-    std::lock_guard<std::mutex> lock(g_mutex);
+    std::shared_lock<std::shared_mutex> lock(g_mutex);
 
     if (!g_model) {
         return string_to_jstring(env, "");
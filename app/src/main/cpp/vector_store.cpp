@@ -0,0 +1,432 @@
+/**
+ * NanoAi - Native vector index for RAG retrieval
+ */
+
+#include "vector_store.h"
+#include "hnsw_index.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <queue>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+// Rows are padded to this many floats: one 64-byte cache line, and a whole
+// number of iterations of the 4x4-lane NEON loop
+static const size_t ROW_ALIGN = 16;
+static const size_t ALIGN_BYTES = 64;
+
+// Tombstones are compacted once they reach this share of rows
+static const size_t COMPACT_DIVISOR = 4;
+
+// vectors.bin header; rows start at ALIGN_BYTES so a page-aligned mapping
+// keeps every row cache-line aligned
+struct VectorFileHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t dim;
+    uint32_t stride;
+    uint64_t n_rows;    // committed rows; bytes past them are ignored
+    uint64_t generation; // bumped by each full rewrite; 0 in older files
+    uint8_t reserved[32];
+};
+static_assert(sizeof(VectorFileHeader) == ALIGN_BYTES, "header must be one cache line");
+
+static const uint32_t VECTOR_FILE_MAGIC = 0x5356414E; // "NAVS"
+static const uint32_t VECTOR_FILE_VERSION = 1;
+
+// Inner product of two padded rows; n is a multiple of ROW_ALIGN
+static float dot_padded(const float* a, const float* b, size_t n) {
+#if defined(__ARM_NEON)
+    float32x4_t acc0 = vdupq_n_f32(0.0f);
+    float32x4_t acc1 = vdupq_n_f32(0.0f);
+    float32x4_t acc2 = vdupq_n_f32(0.0f);
+    float32x4_t acc3 = vdupq_n_f32(0.0f);
+    for (size_t i = 0; i < n; i += 16) {
+#if defined(__aarch64__)
+        acc0 = vfmaq_f32(acc0, vld1q_f32(a + i), vld1q_f32(b + i));
+        acc1 = vfmaq_f32(acc1, vld1q_f32(a + i + 4), vld1q_f32(b + i + 4));
+        acc2 = vfmaq_f32(acc2, vld1q_f32(a + i + 8), vld1q_f32(b + i + 8));
+        acc3 = vfmaq_f32(acc3, vld1q_f32(a + i + 12), vld1q_f32(b + i + 12));
+#else
+        acc0 = vmlaq_f32(acc0, vld1q_f32(a + i), vld1q_f32(b + i));
+        acc1 = vmlaq_f32(acc1, vld1q_f32(a + i + 4), vld1q_f32(b + i + 4));
+        acc2 = vmlaq_f32(acc2, vld1q_f32(a + i + 8), vld1q_f32(b + i + 8));
+        acc3 = vmlaq_f32(acc3, vld1q_f32(a + i + 12), vld1q_f32(b + i + 12));
+#endif
+    }
+    float32x4_t acc = vaddq_f32(vaddq_f32(acc0, acc1), vaddq_f32(acc2, acc3));
+#if defined(__aarch64__)
+    return vaddvq_f32(acc);
+#else
+    float32x2_t sum = vadd_f32(vget_low_f32(acc), vget_high_f32(acc));
+    return vget_lane_f32(vpadd_f32(sum, sum), 0);
+#endif
+#else
+    float sum = 0.0f;
+    for (size_t i = 0; i < n; i++) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+#endif
+}
+
+VectorIndex::VectorIndex(int dim)
+    : dim_(dim),
+      stride_((dim + ROW_ALIGN - 1) / ROW_ALIGN * ROW_ALIGN),
+      query_buf_(stride_, 0.0f) {}
+
+VectorIndex::~VectorIndex() {
+    free(data_);
+    unmap();
+}
+
+std::unique_ptr<VectorIndex> VectorIndex::open(const std::string& path, size_t max_rows) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) return nullptr;
+
+    struct stat st;
+    VectorFileHeader header;
+    if (fstat(fd, &st) != 0 ||
+        pread(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header) ||
+        header.magic != VECTOR_FILE_MAGIC || header.version != VECTOR_FILE_VERSION ||
+        header.dim == 0) {
+        close(fd);
+        return nullptr;
+    }
+
+    std::unique_ptr<VectorIndex> index(new VectorIndex(header.dim));
+    if (index->stride_ != header.stride) {
+        close(fd);
+        return nullptr;
+    }
+
+    size_t row_bytes = index->stride_ * sizeof(float);
+    size_t n_rows = std::min<size_t>(header.n_rows, max_rows);
+    n_rows = std::min(n_rows, ((size_t)st.st_size - sizeof(header)) / row_bytes);
+
+    if (n_rows > 0) {
+        size_t bytes = sizeof(header) + n_rows * row_bytes;
+        void* map = mmap(nullptr, bytes, PROT_READ, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) {
+            close(fd);
+            return nullptr;
+        }
+        // Pages fault in as searches touch them
+        madvise(map, bytes, MADV_RANDOM);
+
+        index->map_ = map;
+        index->map_bytes_ = bytes;
+        index->mapped_rows_ = reinterpret_cast<const float*>(
+            static_cast<const uint8_t*>(map) + sizeof(header));
+        index->n_mapped_ = n_rows;
+        index->n_rows_ = n_rows;
+    }
+    close(fd);
+
+    index->deleted_.assign(n_rows, false);
+    index->rebuild_live_map();
+    index->persisted_path_ = path;
+    index->n_persisted_ = n_rows;
+    index->layout_dirty_ = false;
+    index->generation_ = header.generation;
+    return index;
+}
+
+void VectorIndex::unmap() {
+    if (map_) {
+        munmap(map_, map_bytes_);
+        map_ = nullptr;
+        map_bytes_ = 0;
+    }
+    mapped_rows_ = nullptr;
+    n_mapped_ = 0;
+}
+
+bool VectorIndex::materialize() {
+    if (n_mapped_ == 0) return true;
+
+    size_t heap_rows = n_rows_ - n_mapped_;
+    size_t new_capacity = std::max(n_rows_, capacity_);
+    void* mem = nullptr;
+    if (posix_memalign(&mem, ALIGN_BYTES, new_capacity * stride_ * sizeof(float)) != 0) {
+        return false;
+    }
+    float* new_data = static_cast<float*>(mem);
+    memcpy(new_data, mapped_rows_, n_mapped_ * stride_ * sizeof(float));
+    if (data_) {
+        memcpy(new_data + n_mapped_ * stride_, data_, heap_rows * stride_ * sizeof(float));
+        free(data_);
+    }
+    data_ = new_data;
+    capacity_ = new_capacity;
+    unmap();
+    return true;
+}
+
+float VectorIndex::score(const float* query, size_t r) const {
+    return dot_padded(query, row(r), stride_);
+}
+
+float VectorIndex::score_rows(size_t a, size_t b) const {
+    return dot_padded(row(a), row(b), stride_);
+}
+
+bool VectorIndex::reserve(size_t rows) {
+    size_t heap_rows = rows - n_mapped_;
+    if (heap_rows <= capacity_) return true;
+
+    size_t new_capacity = std::max(heap_rows, capacity_ * 2);
+    void* mem = nullptr;
+    if (posix_memalign(&mem, ALIGN_BYTES, new_capacity * stride_ * sizeof(float)) != 0) {
+        return false;
+    }
+    float* new_data = static_cast<float*>(mem);
+    if (data_) {
+        memcpy(new_data, data_, (n_rows_ - n_mapped_) * stride_ * sizeof(float));
+        free(data_);
+    }
+    data_ = new_data;
+    capacity_ = new_capacity;
+    return true;
+}
+
+bool VectorIndex::add(const float* rows, size_t n) {
+    if (!reserve(n_rows_ + n)) return false;
+    for (size_t i = 0; i < n; i++) {
+        size_t r = n_rows_ + i;
+        float* dst = row(r);
+        memcpy(dst, rows + i * dim_, dim_ * sizeof(float));
+        std::fill(dst + dim_, dst + stride_, 0.0f);
+
+        deleted_.push_back(false);
+        live_rank_.push_back(live_rows_.size());
+        live_rows_.push_back(r);
+    }
+    n_rows_ += n;
+
+    // Grow the graph incrementally
+    if (ann_) {
+        for (size_t r = n_rows_ - n; r < n_rows_; r++) {
+            ann_->add(r);
+        }
+    }
+    return true;
+}
+
+void VectorIndex::rebuild_live_map() {
+    live_rows_.clear();
+    live_rank_.assign(n_rows_, -1);
+    for (size_t i = 0; i < n_rows_; i++) {
+        if (deleted_[i]) continue;
+        live_rank_[i] = live_rows_.size();
+        live_rows_.push_back(i);
+    }
+}
+
+void VectorIndex::remove(const std::vector<int32_t>& rows) {
+    for (int32_t r : rows) {
+        if (r < 0 || (size_t)r >= live_rows_.size()) continue;
+        size_t physical = live_rows_[r];
+        if (!deleted_[physical]) {
+            deleted_[physical] = true;
+            n_deleted_++;
+        }
+    }
+
+    // Live positions shifted, so the file must be rewritten
+    layout_dirty_ = true;
+
+    // Tombstones cost a skipped row per search; compacting copies mapped
+    // rows to the heap, so only do it once enough have piled up
+    if (n_deleted_ * COMPACT_DIVISOR >= n_rows_) {
+        compact();
+    } else {
+        rebuild_live_map();
+    }
+}
+
+void VectorIndex::compact() {
+    // Mapped rows are read-only; move everything to the heap first
+    if (!materialize()) {
+        rebuild_live_map();
+        return;
+    }
+
+    std::vector<int32_t> remap(n_rows_, -1);
+    size_t out = 0;
+    for (size_t i = 0; i < n_rows_; i++) {
+        if (deleted_[i]) continue;
+        if (out != i) {
+            memcpy(row(out), row(i), stride_ * sizeof(float));
+        }
+        remap[i] = out++;
+    }
+    n_rows_ = out;
+    n_deleted_ = 0;
+    deleted_.assign(n_rows_, false);
+    rebuild_live_map();
+
+    if (ann_) {
+        ann_->compact(remap);
+    }
+}
+
+void VectorIndex::clear() {
+    unmap();
+    layout_dirty_ = true;
+    n_rows_ = 0;
+    n_deleted_ = 0;
+    deleted_.clear();
+    live_rows_.clear();
+    live_rank_.clear();
+    if (ann_) {
+        ann_.reset(new HnswIndex(*this, ann_m_, ann_ef_construction_));
+    }
+}
+
+void VectorIndex::enable_ann(int m, int ef_construction) {
+    if (n_deleted_ > 0) compact();
+
+    ann_m_ = m;
+    ann_ef_construction_ = ef_construction;
+    ann_.reset(new HnswIndex(*this, m, ef_construction));
+    for (size_t r = 0; r < n_rows_; r++) {
+        ann_->add(r);
+    }
+}
+
+void VectorIndex::disable_ann() {
+    ann_.reset();
+}
+
+int VectorIndex::search(const float* query, int k, float min_score,
+                        int32_t* out_rows, float* out_scores, bool exact) const {
+    if (k <= 0 || size() == 0) return 0;
+
+    // Pad the query like the rows so the kernel needs no tail handling
+    memcpy(query_buf_.data(), query, dim_ * sizeof(float));
+    const float* q = query_buf_.data();
+
+    int n = 0;
+    if (ann_ && !exact) {
+        n = ann_->search(q, k, ef_search_, min_score, deleted_, out_rows, out_scores);
+    } else {
+        // Min-heap of the best k so far; the root is the score to beat
+        using Entry = std::pair<float, int32_t>;
+        std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>> heap;
+        for (size_t i = 0; i < n_rows_; i++) {
+            if (deleted_[i]) continue;
+            float s = dot_padded(q, row(i), stride_);
+            if (s < min_score) continue;
+            if ((int)heap.size() < k) {
+                heap.emplace(s, (int32_t)i);
+            } else if (s > heap.top().first) {
+                heap.pop();
+                heap.emplace(s, (int32_t)i);
+            }
+        }
+
+        // Heap pops worst first; fill from the back
+        n = heap.size();
+        for (int i = n - 1; i >= 0; i--) {
+            out_scores[i] = heap.top().first;
+            out_rows[i] = heap.top().second;
+            heap.pop();
+        }
+    }
+
+    // Report live positions, which is how callers address rows
+    for (int i = 0; i < n; i++) {
+        out_rows[i] = live_rank_[out_rows[i]];
+    }
+    return n;
+}
+
+bool VectorIndex::write_header(int fd, size_t n_rows) {
+    VectorFileHeader header{};
+    header.magic = VECTOR_FILE_MAGIC;
+    header.version = VECTOR_FILE_VERSION;
+    header.dim = dim_;
+    header.stride = stride_;
+    header.n_rows = n_rows;
+    header.generation = generation_;
+    return pwrite(fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header);
+}
+
+bool VectorIndex::write_rows(int fd, size_t first_live, size_t file_row) {
+    size_t row_bytes = stride_ * sizeof(float);
+    for (size_t i = first_live; i < live_rows_.size(); i++, file_row++) {
+        off_t offset = sizeof(VectorFileHeader) + (off_t)file_row * row_bytes;
+        if (pwrite(fd, row_data(live_rows_[i]), row_bytes, offset) != (ssize_t)row_bytes) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool VectorIndex::write_file(const std::string& path) {
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) return false;
+
+    bool ok = write_header(fd, size()) && write_rows(fd, 0, 0) && fdatasync(fd) == 0;
+    ok = (close(fd) == 0) && ok;
+    if (!ok) unlink(path.c_str());
+    return ok;
+}
+
+bool VectorIndex::save(const std::string& path) {
+    std::string tmp_path = path + ".tmp";
+    if (!write_file(tmp_path)) return false;
+    if (rename(tmp_path.c_str(), path.c_str()) != 0) {
+        unlink(tmp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool VectorIndex::stage(const std::string& staged_path, const std::string& path,
+                        uint64_t generation) {
+    uint64_t previous = generation_;
+    generation_ = generation;
+    if (!write_file(staged_path)) {
+        generation_ = previous;
+        return false;
+    }
+
+    persisted_path_ = path;
+    n_persisted_ = size();
+    layout_dirty_ = false;
+    return true;
+}
+
+bool VectorIndex::flush(const std::string& path) {
+    if (layout_dirty_ || path != persisted_path_ || n_persisted_ > size()) {
+        if (!save(path)) return false;
+    } else if (n_persisted_ < size()) {
+        // Write-ahead append: rows past the committed count are ignored
+        // until the header is updated, so a crash leaves the old store
+        int fd = ::open(path.c_str(), O_WRONLY);
+        if (fd < 0) return false;
+        bool ok = write_rows(fd, n_persisted_, n_persisted_) && fdatasync(fd) == 0 &&
+                  write_header(fd, size()) && fdatasync(fd) == 0;
+        ok = (close(fd) == 0) && ok;
+        if (!ok) return false;
+    }
+
+    persisted_path_ = path;
+    n_persisted_ = size();
+    layout_dirty_ = false;
+    return true;
+}
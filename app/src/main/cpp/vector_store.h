@@ -0,0 +1,131 @@
+/**
+ * NanoAi - Native vector index for RAG retrieval
+ *
+ * Holds embeddings in one contiguous, 64-byte aligned row-major float
+ * matrix and answers top-k inner-product queries with a NEON kernel.
+ * Rows are expected to be normalized, so the score is cosine similarity.
+ *
+ * Callers address rows by live position (insertion order with removed
+ * rows skipped). Removed rows are tombstoned and compacted away later, so
+ * an optional HNSW graph can keep its node ids between compactions.
+ *
+ * Persisted as vectors.bin: a 64-byte header followed by the padded row
+ * matrix, so open() can mmap it and use rows in place. Appends go to the
+ * end of the file and are committed by rewriting the header row count.
+ * The header also carries a generation that the caller bumps on every
+ * full rewrite, so it can tell which vectors belong with its metadata.
+ *
+ * Not thread-safe: callers serialize access (VectorStore holds a mutex).
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+class HnswIndex;
+
+class VectorIndex {
+public:
+    explicit VectorIndex(int dim);
+    ~VectorIndex();
+
+    // Map a file written by flush(). At most max_rows rows are used (the
+    // caller's committed count); nullptr if the file is missing or invalid.
+    static std::unique_ptr<VectorIndex> open(const std::string& path, size_t max_rows);
+
+    VectorIndex(const VectorIndex&) = delete;
+    VectorIndex& operator=(const VectorIndex&) = delete;
+
+    int dim() const { return dim_; }
+    size_t size() const { return n_rows_ - n_deleted_; }
+
+    // Append n rows of dim floats each. Returns false if out of memory.
+    bool add(const float* rows, size_t n);
+
+    // Remove rows by live position (any order); later rows shift down.
+    void remove(const std::vector<int32_t>& rows);
+
+    void clear();
+
+    // Persist to path: appends rows added since the last flush, or rewrites
+    // the file if rows were removed or it belongs to another index.
+    bool flush(const std::string& path);
+
+    // Write every live row to staged_path under a new generation, leaving
+    // the committed file alone. Once the caller renames it over path,
+    // later flushes append there.
+    bool stage(const std::string& staged_path, const std::string& path, uint64_t generation);
+
+    // Generation of the file this index was opened from or last staged to
+    uint64_t generation() const { return generation_; }
+
+    // Build an HNSW graph over the current rows and keep it updated on add.
+    // Searches then go through the graph unless exact is requested.
+    void enable_ann(int m, int ef_construction);
+    void disable_ann();
+    bool ann_enabled() const { return ann_ != nullptr; }
+    void set_ef_search(int ef) { ef_search_ = ef; }
+
+    // Find up to k rows with score >= min_score, best first.
+    // Returns the number of results written to out_rows/out_scores.
+    int search(const float* query, int k, float min_score,
+               int32_t* out_rows, float* out_scores, bool exact = false) const;
+
+    // Kernels used by HnswIndex; rows are physical, query is padded
+    float score(const float* query, size_t row) const;
+    float score_rows(size_t a, size_t b) const;
+    const float* row_data(size_t i) const { return row(i); }
+
+private:
+    bool reserve(size_t rows);
+    void compact();
+    void rebuild_live_map();
+    bool materialize();
+    void unmap();
+    bool write_rows(int fd, size_t first_live, size_t file_row);
+    bool write_header(int fd, size_t n_rows);
+    bool write_file(const std::string& path);
+    bool save(const std::string& path);
+
+    // Rows [0, n_mapped_) live in the read-only file mapping, the rest in
+    // the heap buffer
+    float* row(size_t i) { return data_ + (i - n_mapped_) * stride_; }
+    const float* row(size_t i) const {
+        return i < n_mapped_ ? mapped_rows_ + i * stride_ : data_ + (i - n_mapped_) * stride_;
+    }
+
+    int dim_;
+    size_t stride_;     // floats per row, padded to a multiple of 16
+    float* data_ = nullptr;
+    size_t n_rows_ = 0; // physical rows, including tombstones
+    size_t capacity_ = 0;   // heap rows
+    mutable std::vector<float> query_buf_;
+
+    // File mapping from open()
+    void* map_ = nullptr;
+    size_t map_bytes_ = 0;
+    const float* mapped_rows_ = nullptr;
+    size_t n_mapped_ = 0;
+
+    // Persistence state: live rows [0, n_persisted_) are in persisted_path_
+    // in live order, unless a removal has reordered them since
+    std::string persisted_path_;
+    size_t n_persisted_ = 0;
+    bool layout_dirty_ = true;
+    uint64_t generation_ = 0;
+
+    // Tombstones and physical <-> live position maps
+    std::vector<bool> deleted_;
+    size_t n_deleted_ = 0;
+    std::vector<int32_t> live_rows_; // live position -> physical row
+    std::vector<int32_t> live_rank_; // physical row -> live position
+
+    std::unique_ptr<HnswIndex> ann_;
+    int ann_m_ = 16;
+    int ann_ef_construction_ = 100;
+    int ef_search_ = 64;
+};
@@ -3,10 +3,15 @@ package com.nanoai.llm
 import android.util.Log
 import com.nanoai.llm.util.AppLogger
 import kotlinx.coroutines.*
+import kotlinx.coroutines.channels.Channel
 import kotlinx.coroutines.flow.Flow
-import kotlinx.coroutines.flow.flow
+import kotlinx.coroutines.flow.buffer
+import kotlinx.coroutines.flow.callbackFlow
 import kotlinx.coroutines.flow.flowOn
+import org.json.JSONObject
 import java.io.File
+import java.nio.ByteBuffer
+import java.nio.ByteOrder
 
 /**
  * NanoAi LlamaBridge - Kotlin wrapper for llama.cpp JNI interface
@@ -17,6 +22,16 @@ import java.io.File
 object LlamaBridge {
     private const val TAG = "LlamaBridge"
 
+    // Tokens prefilled and generated per thread count during calibration
+    private const val CALIBRATION_PROMPT = 128
+    private const val CALIBRATION_GEN = 16
+
+    /** Session used when no handle is given; always exists. */
+    const val DEFAULT_SESSION = 0
+
+    /** [loadModelAsync] gpuLayers value that offloads as many layers as fit. */
+    const val GPU_LAYERS_AUTO = -1
+
     // Load native library
     init {
         try {
@@ -30,33 +45,184 @@ object LlamaBridge {
         }
     }
 
+    /**
+     * Receives generated text from the native decode loop.
+     *
+     * Called on the generating thread with complete UTF-8 bytes. Return false
+     * to stop generation. Must not call back into [LlamaBridge].
+     */
+    interface TokenCallback {
+        fun onToken(piece: ByteArray): Boolean
+
+        /**
+         * Called after each prompt chunk is decoded. Return false to stop
+         * before the prompt is fully processed.
+         */
+        fun onPrefillProgress(processed: Int, total: Int): Boolean = true
+    }
+
+    /**
+     * Receives model loading progress on the loading thread. Return false
+     * to cancel the load. Must not call back into [LlamaBridge].
+     */
+    interface LoadCallback {
+        fun onProgress(progress: Float): Boolean
+    }
+
+    /**
+     * Work done after loading so the first prompt does not wait for weight
+     * pages to fault in from the file.
+     */
+    enum class WarmUp(val nativeId: Int) {
+        /** None; weights page in as prompts first touch them. */
+        NONE(0),
+        /** Fault the weights in on a background thread once loaded. */
+        PAGES(1),
+        /** Also decode one token before the load returns. */
+        DECODE(3)
+    }
+
+    /**
+     * How per-token outputs are combined into one embedding.
+     */
+    enum class Pooling(val nativeId: Int) {
+        MEAN(0),
+        CLS(1),
+        LAST(2)
+    }
+
+    /**
+     * Responses to memory pressure, each including the ones before it.
+     */
+    enum class TrimLevel(val nativeId: Int) {
+        /** Mark weight pages as the first to reclaim; nothing is lost. */
+        COLD(1),
+        /** Drop resident weight pages; they fault back in from the file. */
+        DROP_PAGES(2),
+        /** Also free the context and KV cache, keeping the model mapped. */
+        RELEASE_CONTEXT(3)
+    }
+
+    /**
+     * KV cache element type. Q8_0 halves and Q4_0 roughly quarters the
+     * cache of F16; a quantized V cache requires flash attention.
+     */
+    enum class KvCacheType(val nativeId: Int) {
+        F16(0),
+        Q8_0(1),
+        Q4_0(2)
+    }
+
     // ========================================================================
     // Native method declarations
     // ========================================================================
 
     // Model management
-    private external fun loadModel(modelPath: String, nCtx: Int, nThreads: Int): Boolean
+    private external fun loadModel(
+        modelPath: String,
+        nCtx: Int,
+        nThreads: Int,
+        nThreadsBatch: Int,
+        nBatch: Int,
+        nUbatch: Int,
+        kvTypeK: Int,
+        kvTypeV: Int,
+        flashAttn: Boolean,
+        draftModelPath: String?,
+        nDraft: Int,
+        warmUp: Int,
+        hotSwap: Boolean,
+        nGpuLayers: Int,
+        callback: LoadCallback?
+    ): Boolean
     private external fun unloadModel()
     external fun isModelLoaded(): Boolean
 
+    /** Abort a load in progress on another thread; it then fails. */
+    external fun cancelLoad()
+
+    // Memory pressure
+    private external fun trimMemory(level: Int): Long
+    private external fun prefetchModel(): Long
+    private external fun resumeContext(): Boolean
+    external fun isContextReleased(): Boolean
+
+    // Sessions
+    private external fun createSession(): Int
+    private external fun destroySession(sessionId: Int)
+
     // Generation
     private external fun generate(
+        sessionId: Int,
         prompt: String,
         maxTokens: Int,
         temperature: Float,
         topP: Float,
         topK: Int,
-        repeatPenalty: Float
+        repeatPenalty: Float,
+        repeatLastN: Int,
+        minP: Float,
+        typicalP: Float,
+        mirostat: Int,
+        mirostatTau: Float,
+        mirostatEta: Float,
+        grammar: String?,
+        nKeep: Int,
+        contextShift: Boolean,
+        chatRoles: Array<String>?,
+        chatContents: Array<String>?,
+        stopStrings: Array<String>?,
+        stopAfterJson: Boolean
+    ): String
+
+    private external fun generateStreaming(
+        sessionId: Int,
+        prompt: String,
+        maxTokens: Int,
+        temperature: Float,
+        topP: Float,
+        topK: Int,
+        repeatPenalty: Float,
+        repeatLastN: Int,
+        minP: Float,
+        typicalP: Float,
+        mirostat: Int,
+        mirostatTau: Float,
+        mirostatEta: Float,
+        grammar: String?,
+        nKeep: Int,
+        contextShift: Boolean,
+        chatRoles: Array<String>?,
+        chatContents: Array<String>?,
+        stopStrings: Array<String>?,
+        stopAfterJson: Boolean,
+        callback: TokenCallback
     ): String
 
     external fun stopGeneration()
+    external fun stopSession(sessionId: Int)
     external fun isGenerating(): Boolean
+    private external fun getSpeculativeStats(reset: Boolean): LongArray?
+    private external fun getPerfStats(sessionId: Int): String?
+    private external fun configurePrefixCache(ramBytes: Long, spillDir: String?, diskBytes: Long)
+    external fun clearPrefixCache()
+    private external fun getPrefixCacheStats(): String?
 
     // Embeddings
+    private external fun loadEmbeddingModel(modelPath: String, pooling: Int): Boolean
+    private external fun unloadEmbeddingModel()
     private external fun getEmbedding(text: String): FloatArray?
+    private external fun getEmbeddings(texts: Array<String>, pooling: Int): FloatArray?
+    private external fun getEmbeddingsInto(texts: Array<String>, pooling: Int, out: ByteBuffer): Int
+
+    // Session state
+    private external fun saveSession(sessionId: Int, sessionPath: String): Boolean
+    private external fun loadSession(sessionId: Int, sessionPath: String): Boolean
 
     // Configuration
-    private external fun setThreads(nThreads: Int)
+    private external fun setThreads(nThreads: Int, nThreadsBatch: Int)
+    private external fun getCpuTopology(): IntArray
+    private external fun benchmarkThreads(nThreads: Int, nThreadsBatch: Int, nPrompt: Int, nGen: Int): FloatArray?
     private external fun setDefaultParams(
         maxTokens: Int,
         temperature: Float,
@@ -73,11 +239,48 @@ object LlamaBridge {
 
     // Memory
     external fun getAvailableMemory(): Long
+    external fun getModelMemory(): Long
+    private external fun getGpuInfo(): String?
+    private external fun getCpuInfo(): String
+    private external fun estimateKvCacheBytes(modelPath: String, nCtx: Int, kvTypeK: Int, kvTypeV: Int): Long
+    private external fun validateGguf(modelPath: String): String?
     private external fun freeBackend()
 
     // Tokenization
     private external fun tokenize(text: String, outputTokens: IntArray, addBos: Boolean): Int
     private external fun detokenize(tokens: IntArray): String
+    private external fun countTokens(utf8: ByteArray, addBos: Boolean): Int
+    private external fun applyChatTemplate(
+        roles: Array<String>,
+        contents: Array<String>,
+        addAssistant: Boolean
+    ): String?
+    private external fun chunkByTokens(utf8: ByteArray, maxTokens: Int, overlap: Int): IntArray?
+
+    // Vector index (wrapped by vector.NativeVectorIndex)
+    internal external fun vectorIndexCreate(dim: Int): Long
+    internal external fun vectorIndexOpen(path: String, maxRows: Int): Long
+    internal external fun vectorIndexFlush(handle: Long, path: String): Boolean
+    internal external fun vectorIndexStage(handle: Long, stagedPath: String, path: String, generation: Long): Boolean
+    internal external fun vectorIndexGeneration(handle: Long): Long
+    internal external fun vectorIndexDim(handle: Long): Int
+    internal external fun vectorIndexSize(handle: Long): Int
+    internal external fun vectorIndexFree(handle: Long)
+    internal external fun vectorIndexAdd(handle: Long, rows: FloatArray, count: Int): Boolean
+    internal external fun vectorIndexAddBuffer(handle: Long, rows: ByteBuffer, count: Int): Boolean
+    internal external fun vectorIndexRemove(handle: Long, rows: IntArray)
+    internal external fun vectorIndexClear(handle: Long)
+    internal external fun vectorIndexEnableAnn(handle: Long, m: Int, efConstruction: Int)
+    internal external fun vectorIndexDisableAnn(handle: Long)
+    internal external fun vectorIndexSetEfSearch(handle: Long, ef: Int)
+    internal external fun vectorIndexSearch(
+        handle: Long,
+        query: FloatArray,
+        minScore: Float,
+        outRows: IntArray,
+        outScores: FloatArray,
+        exact: Boolean
+    ): Int
 
     // ========================================================================
     // Kotlin wrapper methods
@@ -88,13 +291,45 @@ object LlamaBridge {
      *
      * @param modelPath Absolute path to the GGUF model file
      * @param contextSize Context size (default 2048)
-     * @param threads Number of CPU threads (default: auto-detect)
+     * @param threads Decode threads (default: one per performance core)
+     * @param batchThreads Prefill threads (0 = same as [threads])
+     * @param batchSize Max prompt tokens decoded per chunk (0 = native default)
+     * @param ubatchSize Tokens per compute pass within a chunk; bounds
+     *   activation memory (0 = native default)
+     * @param kvCacheTypeK Element type of cached keys
+     * @param kvCacheTypeV Element type of cached values; quantized types
+     *   turn on flash attention
+     * @param flashAttention Use flash attention
+     * @param draftModelPath Optional small GGUF from the same family for
+     *   speculative decoding; must share the target's vocabulary
+     * @param draftTokens Tokens drafted per step (0 = native default)
+     * @param warmUp Warm-up after loading
+     * @param hotSwap Keep a loaded model serving until this one is ready,
+     *   and keep it if this load fails, when memory allows both. Otherwise
+     *   the old model is unloaded first.
+     * @param gpuLayers Layers offloaded to the GPU in builds with a GPU
+     *   backend: 0 runs on the CPU, [GPU_LAYERS_AUTO] offloads as many as
+     *   free memory allows. Falls back to the CPU if the GPU fails.
+     * @param onProgress Load progress in [0, 1], on the loading thread.
+     *   Cancelling the calling coroutine aborts the load.
      * @return Result indicating success or failure with error message
      */
     suspend fun loadModelAsync(
         modelPath: String,
         contextSize: Int = 2048,
-        threads: Int = getOptimalThreadCount()
+        threads: Int = getOptimalThreadCount(),
+        batchThreads: Int = 0,
+        batchSize: Int = 0,
+        ubatchSize: Int = 0,
+        kvCacheTypeK: KvCacheType = KvCacheType.F16,
+        kvCacheTypeV: KvCacheType = KvCacheType.F16,
+        flashAttention: Boolean = false,
+        draftModelPath: String? = null,
+        draftTokens: Int = 0,
+        warmUp: WarmUp = WarmUp.PAGES,
+        hotSwap: Boolean = true,
+        gpuLayers: Int = 0,
+        onProgress: ((Float) -> Unit)? = null
     ): Result<Unit> = withContext(Dispatchers.IO) {
         try {
             val file = File(modelPath)
@@ -114,7 +349,24 @@ object LlamaBridge {
                 Log.w(TAG, "Warning: Model may be too large for available memory")
             }
 
-            val success = loadModel(modelPath, contextSize, threads)
+            if (draftModelPath != null && !File(draftModelPath).exists()) {
+                Log.w(TAG, "Draft model not found, loading without speculation: $draftModelPath")
+            }
+            val draftPath = draftModelPath?.takeIf { File(it).exists() }
+
+            val callback = object : LoadCallback {
+                override fun onProgress(progress: Float): Boolean {
+                    onProgress?.invoke(progress)
+                    return isActive
+                }
+            }
+
+            val success = loadModel(
+                modelPath, contextSize, threads, batchThreads, batchSize, ubatchSize,
+                kvCacheTypeK.nativeId, kvCacheTypeV.nativeId, flashAttention,
+                draftPath, draftTokens, warmUp.nativeId, hotSwap, gpuLayers, callback
+            )
+            ensureActive()
             if (success) {
                 Log.i(TAG, "Model loaded: ${getModelDescription()}")
                 AppLogger.i(TAG, "Model loaded: ${getModelDescription()}")
@@ -123,6 +375,10 @@ object LlamaBridge {
                 AppLogger.e(TAG, "Failed to load model")
                 Result.failure(RuntimeException("Failed to load model"))
             }
+        } catch (e: CancellationException) {
+            Log.i(TAG, "Model load cancelled")
+            AppLogger.i(TAG, "Model load cancelled")
+            throw e
         } catch (e: Exception) {
             Log.e(TAG, "Error loading model", e)
             AppLogger.e(TAG, "Error loading model: ${e.message}", e)
@@ -130,6 +386,28 @@ object LlamaBridge {
         }
     }
 
+    /**
+     * Bytes the KV cache of a [contextSize]-token context would take for a
+     * model file, read from its GGUF metadata without loading it. Returns
+     * 0 if the file's metadata cannot be read.
+     */
+    fun estimateKvCacheBytes(
+        modelPath: String,
+        contextSize: Int,
+        kvCacheTypeK: KvCacheType = KvCacheType.F16,
+        kvCacheTypeV: KvCacheType = KvCacheType.F16
+    ): Long = estimateKvCacheBytes(modelPath, contextSize, kvCacheTypeK.nativeId, kvCacheTypeV.nativeId)
+
+    /**
+     * Check that a file is a complete GGUF model from its header and tensor
+     * table, without loading it. Fails with what is wrong, e.g. a truncated
+     * download.
+     */
+    suspend fun validateModelFile(modelPath: String): Result<Unit> = withContext(Dispatchers.IO) {
+        val error = validateGguf(modelPath)
+        if (error == null) Result.success(Unit) else Result.failure(IllegalArgumentException(error))
+    }
+
     /**
      * Unload the currently loaded model and free resources.
      */
@@ -142,16 +420,110 @@ object LlamaBridge {
         }
     }
 
+    /**
+     * Shed memory held by the loaded model. [TrimLevel.RELEASE_CONTEXT]
+     * waits for running generations and discards every session's KV cache;
+     * save sessions first to restore them after [resumeContextAsync].
+     *
+     * @return Bytes of weights advised
+     */
+    suspend fun trimMemoryAsync(level: TrimLevel): Long = withContext(Dispatchers.IO) {
+        trimMemory(level.nativeId)
+    }
+
+    /**
+     * Start reading the model weights back in, so the next prompt does not
+     * stall on page faults. Returns immediately.
+     */
+    fun prefetchModelWeights(): Long = prefetchModel()
+
+    /**
+     * Recreate a context released by [trimMemoryAsync]. Generation calls
+     * this on demand, so it is only needed to restore sessions early.
+     */
+    suspend fun resumeContextAsync(): Result<Unit> = withContext(Dispatchers.IO) {
+        if (resumeContext()) {
+            Result.success(Unit)
+        } else {
+            Result.failure(RuntimeException("Failed to recreate context"))
+        }
+    }
+
+    /**
+     * Open a session with its own KV sequence on the loaded model.
+     *
+     * Sessions run concurrently (e.g. chat and background RAG indexing) and
+     * keep separate prefix caches. Release with [closeSession].
+     *
+     * @return Session handle, or failure when all sequences are in use
+     */
+    fun openSession(): Result<Int> {
+        val id = createSession()
+        return if (id >= 0) {
+            AppLogger.d(TAG, "Opened session $id")
+            Result.success(id)
+        } else {
+            Result.failure(IllegalStateException("No free session slot"))
+        }
+    }
+
+    /**
+     * Close a session opened with [openSession]. Waits for a running
+     * generation on it to stop. Closing [DEFAULT_SESSION] only clears it.
+     */
+    suspend fun closeSession(sessionId: Int) = withContext(Dispatchers.IO) {
+        destroySession(sessionId)
+    }
+
     /**
      * Generate text from a prompt.
      *
      * @param prompt The input prompt
      * @param params Generation parameters
+     * @param session Session handle from [openSession]
      * @return Generated text or error
      */
     suspend fun generateAsync(
         prompt: String,
-        params: GenerationParams = GenerationParams()
+        params: GenerationParams = GenerationParams(),
+        session: Int = DEFAULT_SESSION
+    ): Result<String> = runGeneration(prompt, null, params, session)
+
+    /**
+     * Generate a reply to chat messages, formatted natively with the
+     * model's own chat template (ChatML if it has none). Each formatted
+     * message is tokenized separately and cached, so a repeated system
+     * prompt costs no tokenization. With the default
+     * [GenerationParams.keepTokens], a leading system message is pinned
+     * when the context overflows.
+     *
+     * @param messages Conversation so far, oldest first
+     * @return The assistant's reply or error
+     */
+    suspend fun generateChatAsync(
+        messages: List<ChatMessage>,
+        params: GenerationParams = GenerationParams(),
+        session: Int = DEFAULT_SESSION
+    ): Result<String> = runGeneration("", messages, params, session)
+
+    /**
+     * Format [messages] with the loaded model's chat template, exactly as
+     * [generateChatAsync] does. Null without a model.
+     */
+    fun formatChat(messages: List<ChatMessage>, addAssistant: Boolean = true): String? {
+        if (messages.isEmpty()) return null
+        return applyChatTemplate(
+            messages.map { it.role }.toTypedArray(),
+            messages.map { it.content }.toTypedArray(),
+            addAssistant
+        )
+    }
+
+    private suspend fun runGeneration(
+        prompt: String,
+        messages: List<ChatMessage>?,
+        params: GenerationParams,
+        session: Int
     ): Result<String> = withContext(Dispatchers.Default) {
         try {
             if (!isModelLoaded()) {
@@ -160,21 +532,41 @@ object LlamaBridge {
                 )
             }
 
-            Log.d(TAG, "Generating with prompt length: ${prompt.length}")
-            AppLogger.d(TAG, "Generating with prompt length: ${prompt.length}")
+            if (isContextReleased() && !resumeContext()) {
+                return@withContext Result.failure(RuntimeException("Failed to recreate context"))
+            }
+
+            val length = messages?.let { "${it.size} messages" } ?: "${prompt.length}"
+            Log.d(TAG, "Generating with prompt length: $length")
+            AppLogger.d(TAG, "Generating with prompt length: $length")
 
             val result = generate(
+                sessionId = session,
                 prompt = prompt,
                 maxTokens = params.maxTokens,
                 temperature = params.temperature,
                 topP = params.topP,
                 topK = params.topK,
-                repeatPenalty = params.repeatPenalty
+                repeatPenalty = params.repeatPenalty,
+                repeatLastN = params.repeatLastN,
+                minP = params.minP,
+                typicalP = params.typicalP,
+                mirostat = params.mirostat,
+                mirostatTau = params.mirostatTau,
+                mirostatEta = params.mirostatEta,
+                grammar = params.grammar,
+                nKeep = params.keepTokens,
+                contextShift = params.contextShift,
+                chatRoles = messages?.map { it.role }?.toTypedArray(),
+                chatContents = messages?.map { it.content }?.toTypedArray(),
+                stopStrings = params.stop.takeIf { it.isNotEmpty() }?.toTypedArray(),
+                stopAfterJson = params.stopAfterJson
             )
 
             if (result.startsWith("[Error:")) {
                 Result.failure(RuntimeException(result))
             } else {
+                logPerfStats(session)
                 Result.success(result)
             }
         } catch (e: Exception) {
@@ -186,29 +578,142 @@ object LlamaBridge {
     /**
      * Generate text with streaming output.
      *
-     * Note: Current implementation returns full result after completion.
-     * For true streaming, would need JNI callback mechanism.
+     * Pieces are emitted as soon as the native decode loop samples them.
+     * Cancelling the collector stops generation at the next token, or
+     * between prompt chunks while the prompt is still being processed.
+     *
+     * @param onPrefillProgress Called from a background thread with the
+     *   prompt tokens processed so far and in total
      */
     fun generateStream(
         prompt: String,
-        params: GenerationParams = GenerationParams()
-    ): Flow<String> = flow {
-        val result = generateAsync(prompt, params)
-        result.onSuccess { text ->
-            // Simulate streaming by emitting chunks
-            val words = text.split(" ")
-            for (word in words) {
-                emit("$word ")
-                delay(10) // Small delay for UI responsiveness
+        params: GenerationParams = GenerationParams(),
+        session: Int = DEFAULT_SESSION,
+        onPrefillProgress: ((processed: Int, total: Int) -> Unit)? = null
+    ): Flow<String> = streamGeneration(prompt, null, params, session, onPrefillProgress)
+
+    /**
+     * Streaming variant of [generateChatAsync].
+     */
+    fun generateChatStream(
+        messages: List<ChatMessage>,
+        params: GenerationParams = GenerationParams(),
+        session: Int = DEFAULT_SESSION,
+        onPrefillProgress: ((processed: Int, total: Int) -> Unit)? = null
+    ): Flow<String> = streamGeneration("", messages, params, session, onPrefillProgress)
+
+    private fun streamGeneration(
+        prompt: String,
+        messages: List<ChatMessage>?,
+        params: GenerationParams,
+        session: Int,
+        onPrefillProgress: ((processed: Int, total: Int) -> Unit)?
+    ): Flow<String> = callbackFlow {
+        if (!isModelLoaded()) {
+            close(IllegalStateException("No model loaded"))
+            return@callbackFlow
+        }
+
+        if (isContextReleased() && !resumeContext()) {
+            close(RuntimeException("Failed to recreate context"))
+            return@callbackFlow
+        }
+
+        val length = messages?.let { "${it.size} messages" } ?: "${prompt.length}"
+        Log.d(TAG, "Streaming with prompt length: $length")
+        AppLogger.d(TAG, "Streaming with prompt length: $length")
+
+        val callback = object : TokenCallback {
+            override fun onToken(piece: ByteArray): Boolean {
+                // Fails only once the collector is gone, which stops native decoding
+                return trySend(String(piece, Charsets.UTF_8)).isSuccess
+            }
+
+            override fun onPrefillProgress(processed: Int, total: Int): Boolean {
+                onPrefillProgress?.invoke(processed, total)
+                return isActive
             }
-        }.onFailure { error ->
-            throw error
         }
-    }.flowOn(Dispatchers.Default)
+
+        val result = generateStreaming(
+            sessionId = session,
+            prompt = prompt,
+            maxTokens = params.maxTokens,
+            temperature = params.temperature,
+            topP = params.topP,
+            topK = params.topK,
+            repeatPenalty = params.repeatPenalty,
+            repeatLastN = params.repeatLastN,
+            minP = params.minP,
+            typicalP = params.typicalP,
+            mirostat = params.mirostat,
+            mirostatTau = params.mirostatTau,
+            mirostatEta = params.mirostatEta,
+            grammar = params.grammar,
+            nKeep = params.keepTokens,
+            contextShift = params.contextShift,
+            chatRoles = messages?.map { it.role }?.toTypedArray(),
+            chatContents = messages?.map { it.content }?.toTypedArray(),
+            stopStrings = params.stop.takeIf { it.isNotEmpty() }?.toTypedArray(),
+            stopAfterJson = params.stopAfterJson,
+            callback = callback
+        )
+
+        if (result.startsWith("[Error:")) {
+            close(RuntimeException(result))
+        } else {
+            logPerfStats(session)
+            close()
+        }
+        awaitClose()
+    }.buffer(Channel.UNLIMITED).flowOn(Dispatchers.Default)
+
+    /**
+     * Set up the embedding context used by [getEmbeddingAsync] and
+     * [getEmbeddingsAsync].
+     *
+     * Embeddings never run on the chat context. With a [modelPath], a
+     * dedicated embedding GGUF is loaded; without one, a second context is
+     * created on the chat model. If this is never called, the latter
+     * happens on first use with [Pooling.MEAN].
+     *
+     * @param modelPath Path to an embedding GGUF, or null to share the chat model
+     * @param pooling Pooling configured on the embedding context
+     */
+    suspend fun loadEmbeddingModelAsync(
+        modelPath: String? = null,
+        pooling: Pooling = Pooling.MEAN
+    ): Result<Unit> = withContext(Dispatchers.IO) {
+        try {
+            if (modelPath != null && !File(modelPath).exists()) {
+                return@withContext Result.failure(
+                    IllegalArgumentException("Model file not found: $modelPath")
+                )
+            }
+            if (loadEmbeddingModel(modelPath ?: "", pooling.nativeId)) {
+                AppLogger.i(TAG, "Embedding model ready: ${modelPath?.let { File(it).name } ?: "chat model"}")
+                Result.success(Unit)
+            } else {
+                Result.failure(RuntimeException("Failed to load embedding model"))
+            }
+        } catch (e: Exception) {
+            Log.e(TAG, "Error loading embedding model", e)
+            Result.failure(e)
+        }
+    }
+
+    /**
+     * Release the dedicated embedding model and context.
+     */
+    suspend fun unloadEmbeddingModelAsync() = withContext(Dispatchers.IO) {
+        unloadEmbeddingModel()
+    }
 
     /**
      * Get embedding vector for text (used for RAG).
      *
+     * Uses the embedding context, so the chat KV cache is left intact.
+     *
      * @param text Text to embed
      * @return Float array embedding or null if not supported
      */
@@ -235,6 +740,145 @@ object LlamaBridge {
             }
         }
 
+    /**
+     * Get embeddings for many texts at once (used for RAG indexing).
+     *
+     * Texts are packed into shared batches on the embedding context, so
+     * this is much faster than calling [getEmbeddingAsync] per chunk.
+     * Texts longer than the embedding context are truncated.
+     *
+     * @param texts Texts to embed
+     * @param pooling Pooling applied to per-token outputs
+     * @return One normalized vector per text, in order
+     */
+    suspend fun getEmbeddingsAsync(
+        texts: List<String>,
+        pooling: Pooling = Pooling.MEAN
+    ): Result<List<FloatArray>> = withContext(Dispatchers.Default) {
+        try {
+            if (!isModelLoaded()) {
+                return@withContext Result.failure(
+                    IllegalStateException("No model loaded")
+                )
+            }
+            if (texts.isEmpty()) {
+                return@withContext Result.success(emptyList())
+            }
+
+            val flat = getEmbeddings(texts.toTypedArray(), pooling.nativeId)
+                ?: return@withContext Result.failure(
+                    UnsupportedOperationException("Model doesn't support embeddings")
+                )
+            val dim = flat.size / texts.size
+            Result.success(List(texts.size) { i -> flat.copyOfRange(i * dim, (i + 1) * dim) })
+        } catch (e: Exception) {
+            Log.e(TAG, "Batch embedding error", e)
+            Result.failure(e)
+        }
+    }
+
+    /**
+     * Allocate a direct buffer for [rows] embeddings of the current
+     * embedding model, for use with [getEmbeddingsInto]. Null without a model.
+     */
+    fun allocateEmbeddingBuffer(rows: Int): ByteBuffer? {
+        val dim = getEmbeddingSize()
+        if (dim <= 0 || rows <= 0) return null
+        return ByteBuffer.allocateDirect(rows * dim * Float.SIZE_BYTES).order(ByteOrder.nativeOrder())
+    }
+
+    /**
+     * Embed [texts] straight into [out], a direct buffer in native byte
+     * order (see [allocateEmbeddingBuffer]). Rows are written normalized,
+     * texts.size x dimension floats from the start of the buffer. Unlike
+     * [getEmbeddingsAsync], nothing is allocated per call, so indexing
+     * thousands of chunks through one reused buffer creates no garbage.
+     *
+     * @return The embedding dimension
+     */
+    suspend fun getEmbeddingsInto(
+        texts: List<String>,
+        out: ByteBuffer,
+        pooling: Pooling = Pooling.MEAN
+    ): Result<Int> = withContext(Dispatchers.Default) {
+        try {
+            if (!isModelLoaded()) {
+                return@withContext Result.failure(IllegalStateException("No model loaded"))
+            }
+            require(out.isDirect) { "Embedding buffer must be direct" }
+            if (texts.isEmpty()) {
+                return@withContext Result.success(getEmbeddingSize())
+            }
+
+            val dim = getEmbeddingsInto(texts.toTypedArray(), pooling.nativeId, out)
+            if (dim > 0) {
+                Result.success(dim)
+            } else {
+                Result.failure(
+                    UnsupportedOperationException("Embedding failed or buffer too small")
+                )
+            }
+        } catch (e: Exception) {
+            Log.e(TAG, "Buffer embedding error", e)
+            Result.failure(e)
+        }
+    }
+
+    /**
+     * Save the current conversation state (KV cache and tokens) to a file.
+     * The snapshot is only valid for the model that is loaded now.
+     */
+    suspend fun saveSessionAsync(
+        file: File,
+        session: Int = DEFAULT_SESSION
+    ): Result<Unit> = withContext(Dispatchers.IO) {
+        try {
+            if (!isModelLoaded()) {
+                return@withContext Result.failure(IllegalStateException("No model loaded"))
+            }
+            file.parentFile?.mkdirs()
+            if (saveSession(session, file.absolutePath)) {
+                AppLogger.i(TAG, "Session saved: ${file.name}")
+                Result.success(Unit)
+            } else {
+                Result.failure(RuntimeException("Failed to save session"))
+            }
+        } catch (e: Exception) {
+            Log.e(TAG, "Session save error", e)
+            Result.failure(e)
+        }
+    }
+
+    /**
+     * Restore a conversation state saved by [saveSessionAsync], so the next
+     * generation only prefills what changed. Fails if the file belongs to a
+     * different model.
+     */
+    suspend fun restoreSessionAsync(
+        file: File,
+        session: Int = DEFAULT_SESSION
+    ): Result<Unit> = withContext(Dispatchers.IO) {
+        try {
+            if (!isModelLoaded()) {
+                return@withContext Result.failure(IllegalStateException("No model loaded"))
+            }
+            if (!file.exists()) {
+                return@withContext Result.failure(
+                    IllegalArgumentException("Session not found: ${file.name}")
+                )
+            }
+            if (loadSession(session, file.absolutePath)) {
+                AppLogger.i(TAG, "Session restored: ${file.name}")
+                Result.success(Unit)
+            } else {
+                Result.failure(RuntimeException("Session does not match loaded model"))
+            }
+        } catch (e: Exception) {
+            Log.e(TAG, "Session restore error", e)
+            Result.failure(e)
+        }
+    }
+
     /**
      * Tokenize text to token IDs.
      */
@@ -247,9 +891,13 @@ object LlamaBridge {
                     )
                 }
 
-                // Allocate buffer for tokens
-                val buffer = IntArray(text.length + 1)
-                val count = tokenize(text, buffer, addBos)
+                // Usually enough; retry once at the exact size if not
+                var buffer = IntArray(text.length + 1)
+                var count = tokenize(text, buffer, addBos)
+                if (count > buffer.size) {
+                    buffer = IntArray(count)
+                    count = tokenize(text, buffer, addBos)
+                }
 
                 if (count < 0) {
                     Result.failure(RuntimeException("Tokenization failed"))
@@ -261,6 +909,30 @@ object LlamaBridge {
             }
         }
 
+    /**
+     * Exact token count of [text] for the loaded model, or -1 without one.
+     * Cheaper than [tokenizeAsync]: no token array crosses JNI.
+     */
+    fun countTokens(text: String, addBos: Boolean = false): Int =
+        countTokens(text.toByteArray(Charsets.UTF_8), addBos)
+
+    /**
+     * Split [text] into chunks of at most [maxTokens] tokens of the loaded
+     * model, each starting [overlapTokens] before the previous one ended.
+     * Chunks end at a sentence or line break when one falls in their second
+     * half. The text is tokenized once natively and only byte offsets come
+     * back. Returns null without a model.
+     */
+    fun chunkByTokens(text: String, maxTokens: Int, overlapTokens: Int = 0): List<String>? {
+        val bytes = text.toByteArray(Charsets.UTF_8)
+        val ranges = chunkByTokens(bytes, maxTokens, overlapTokens) ?: return null
+        return (ranges.indices step 2).mapNotNull { i ->
+            String(bytes, ranges[i], ranges[i + 1] - ranges[i], Charsets.UTF_8)
+                .trim()
+                .takeIf { it.isNotEmpty() }
+        }
+    }
+
     /**
      * Convert token IDs back to text.
      */
@@ -293,9 +965,50 @@ object LlamaBridge {
 
     /**
      * Set the number of threads for inference.
+     *
+     * @param threads Decode threads
+     * @param batchThreads Prefill threads
+     */
+    fun setThreadCount(threads: Int, batchThreads: Int = threads) {
+        setThreads(threads, batchThreads)
+    }
+
+    /**
+     * Measure prefill and decode speed for a few thread counts on the
+     * loaded model, apply the fastest of each and return them. Takes a few
+     * seconds; generation on other sessions waits meanwhile, so run it
+     * once and cache the result.
      */
-    fun setThreadCount(threads: Int) {
-        setThreads(threads)
+    suspend fun calibrateThreads(): Result<ThreadConfig> = withContext(Dispatchers.IO) {
+        if (!isModelLoaded()) {
+            return@withContext Result.failure(IllegalStateException("No model loaded"))
+        }
+
+        // Every count up to the performance cores, plus all cores for comparison
+        val perfCores = getPerformanceCoreCount()
+        val allCores = Runtime.getRuntime().availableProcessors()
+        val candidates = ((minOf(2, perfCores)..perfCores) + allCores)
+            .filter { it in 1..8 }
+            .distinct()
+
+        var bestDecode = 0 to 0f
+        var bestPrefill = 0 to 0f
+        for (threads in candidates) {
+            ensureActive()
+            val rates = benchmarkThreads(threads, threads, CALIBRATION_PROMPT, CALIBRATION_GEN)
+                ?: continue
+            if (rates[0] > bestPrefill.second) bestPrefill = threads to rates[0]
+            if (rates[1] > bestDecode.second) bestDecode = threads to rates[1]
+        }
+        if (bestDecode.first == 0 || bestPrefill.first == 0) {
+            return@withContext Result.failure(RuntimeException("Thread benchmark failed"))
+        }
+
+        val config = ThreadConfig(decodeThreads = bestDecode.first, prefillThreads = bestPrefill.first)
+        setThreads(config.decodeThreads, config.prefillThreads)
+        AppLogger.i(TAG, "Calibrated threads: $config " +
+            "(decode %.1f t/s, prefill %.1f t/s)".format(bestDecode.second, bestPrefill.second))
+        Result.success(config)
     }
 
     /**
@@ -306,18 +1019,106 @@ object LlamaBridge {
     }
 
     /**
-     * Get optimal thread count based on device.
+     * Get optimal thread count based on device: one per performance core,
+     * since workers on little cores hold back every other thread.
      */
     fun getOptimalThreadCount(): Int {
-        val cores = Runtime.getRuntime().availableProcessors()
-        // Use N-1 cores, minimum 2, maximum 8
-        return (cores - 1).coerceIn(2, 8)
+        return getPerformanceCoreCount().coerceIn(1, 8)
+    }
+
+    /**
+     * Number of big and prime cores, from their sysfs capacity or maximum
+     * frequency. Equals the core count on SoCs with uniform cores.
+     */
+    fun getPerformanceCoreCount(): Int {
+        return (getCpuTopology().size - 1).coerceAtLeast(1)
+    }
+
+    /**
+     * Draft acceptance since the last reset, or null without a draft model.
+     *
+     * @param reset Start counting afresh after reading
+     */
+    fun speculativeStats(reset: Boolean = false): SpeculativeStats? {
+        val stats = getSpeculativeStats(reset) ?: return null
+        return SpeculativeStats(drafted = stats[0], accepted = stats[1])
+    }
+
+    /**
+     * Metrics of the last finished generation on [session], or on any
+     * session when negative. Null before the first generation.
+     */
+    fun perfStats(session: Int = -1): PerfStats? {
+        val json = getPerfStats(session) ?: return null
+        return try {
+            PerfStats.fromJson(JSONObject(json))
+        } catch (e: Exception) {
+            Log.e(TAG, "Invalid perf stats: $json", e)
+            null
+        }
+    }
+
+    /**
+     * Keep KV snapshots of long prompts, so a later prompt that starts the
+     * same way (the same system prompt and retrieved context) restores them
+     * instead of prefilling again. Up to [ramBytes] stay in memory; the
+     * least recently used then spill to [spillDir] up to [diskBytes].
+     * [ramBytes] 0 disables the cache. Snapshots are dropped with the model.
+     */
+    fun setPrefixCache(ramBytes: Long, spillDir: File? = null, diskBytes: Long = 0) {
+        configurePrefixCache(ramBytes, spillDir?.absolutePath, diskBytes)
+    }
+
+    /**
+     * The GPU offload would use, or null when this build has no GPU backend
+     * or the device has no usable GPU.
+     */
+    fun gpuInfo(): GpuInfo? {
+        val json = getGpuInfo() ?: return null
+        return try {
+            GpuInfo.fromJson(JSONObject(json))
+        } catch (e: Exception) {
+            Log.e(TAG, "Invalid GPU info: $json", e)
+            null
+        }
+    }
+
+    /** Prefix cache counters, or null if they cannot be read. */
+    fun prefixCacheStats(): PrefixCacheStats? {
+        val json = getPrefixCacheStats() ?: return null
+        return try {
+            PrefixCacheStats.fromJson(JSONObject(json))
+        } catch (e: Exception) {
+            Log.e(TAG, "Invalid prefix cache stats: $json", e)
+            null
+        }
+    }
+
+    private fun logPerfStats(session: Int) {
+        perfStats(session)?.let { AppLogger.i(TAG, it.summary()) }
+    }
+
+    /**
+     * CPU features and the ggml kernels selected for them, or null if they
+     * cannot be read.
+     */
+    fun cpuInfo(): CpuInfo? {
+        val json = getCpuInfo()
+        return try {
+            CpuInfo.fromJson(JSONObject(json))
+        } catch (e: Exception) {
+            Log.e(TAG, "Invalid CPU info: $json", e)
+            null
+        }
     }
 
     /**
      * Get model info as a map.
      */
     fun getModelInfo(): Map<String, Any> {
+        val cpu = cpuInfo()?.let {
+            mapOf("cpuFeatures" to it.hwcaps, "cpuKernels" to it.kernels)
+        }.orEmpty()
         return if (isModelLoaded()) {
             mapOf(
                 "loaded" to true,
@@ -325,22 +1126,235 @@ object LlamaBridge {
                 "contextSize" to getContextSize(),
                 "vocabSize" to getVocabSize(),
                 "embeddingSize" to getEmbeddingSize()
-            )
+            ) + cpu
         } else {
-            mapOf("loaded" to false)
+            mapOf("loaded" to false) + cpu
         }
     }
 }
 
+/**
+ * Thread counts picked by [LlamaBridge.calibrateThreads].
+ */
+data class ThreadConfig(
+    val decodeThreads: Int,
+    val prefillThreads: Int
+)
+
+/**
+ * Native metrics of one generation. Times are in milliseconds; prefill
+ * covers the prompt tokens not reused from the KV cache.
+ */
+data class PerfStats(
+    val sessionId: Int,
+    val tokenizeMs: Double,
+    val promptTokens: Int,
+    val cachedTokens: Int,
+    val prefillMs: Double,
+    val prefillTokensPerSec: Double,
+    val decodeTokens: Int,
+    val decodeMs: Double,
+    val decodeTokensPerSec: Double,
+    val sampleMs: Double,
+    val firstTokenMs: Double,
+    val totalMs: Double,
+    val draftedTokens: Int,
+    val acceptedTokens: Int,
+    val kvUsed: Int,
+    val kvSize: Int,
+    val rssKb: Long,
+    val peakRssKb: Long
+) {
+    companion object {
+        fun fromJson(json: JSONObject) = PerfStats(
+            sessionId = json.getInt("sessionId"),
+            tokenizeMs = json.getDouble("tokenizeMs"),
+            promptTokens = json.getInt("promptTokens"),
+            cachedTokens = json.getInt("cachedTokens"),
+            prefillMs = json.getDouble("prefillMs"),
+            prefillTokensPerSec = json.getDouble("prefillTokensPerSec"),
+            decodeTokens = json.getInt("decodeTokens"),
+            decodeMs = json.getDouble("decodeMs"),
+            decodeTokensPerSec = json.getDouble("decodeTokensPerSec"),
+            sampleMs = json.getDouble("sampleMs"),
+            firstTokenMs = json.getDouble("firstTokenMs"),
+            totalMs = json.getDouble("totalMs"),
+            draftedTokens = json.getInt("draftedTokens"),
+            acceptedTokens = json.getInt("acceptedTokens"),
+            kvUsed = json.getInt("kvUsed"),
+            kvSize = json.getInt("kvSize"),
+            rssKb = json.getLong("rssKb"),
+            peakRssKb = json.getLong("peakRssKb")
+        )
+    }
+
+    /** One-line summary for the log. */
+    fun summary(): String =
+        "prompt %d (%d cached) in %.0f ms, %.1f t/s; %d tokens in %.0f ms, %.1f t/s; "
+            .format(promptTokens, cachedTokens, prefillMs, prefillTokensPerSec,
+                decodeTokens, decodeMs, decodeTokensPerSec) +
+            "TTFT %.0f ms; KV %d/%d; peak RSS %d MB".format(
+                firstTokenMs, kvUsed, kvSize, peakRssKb / 1024)
+}
+
+/**
+ * CPU report from [LlamaBridge.cpuInfo].
+ *
+ * @property hwcaps Features the kernel reports, e.g. dotprod, i8mm, sve
+ * @property kernels Features the CPU backend in use was built with, e.g.
+ *   DOTPROD, MATMUL_INT8
+ * @property dynamic Whether that backend was picked at runtime from variants
+ */
+data class CpuInfo(
+    val hwcaps: List<String>,
+    val kernels: List<String>,
+    val dynamic: Boolean
+) {
+    companion object {
+        fun fromJson(json: JSONObject): CpuInfo {
+            fun strings(key: String): List<String> {
+                val array = json.getJSONArray(key)
+                return List(array.length()) { array.getString(it) }
+            }
+            return CpuInfo(strings("hwcaps"), strings("kernels"), json.getBoolean("dynamic"))
+        }
+    }
+}
+
+/**
+ * GPU device from [LlamaBridge.gpuInfo].
+ *
+ * @property offloadedLayers Layers of the loaded model on this GPU
+ */
+data class GpuInfo(
+    val name: String,
+    val description: String,
+    val freeBytes: Long,
+    val totalBytes: Long,
+    val offloadedLayers: Int
+) {
+    companion object {
+        fun fromJson(json: JSONObject) = GpuInfo(
+            name = json.getString("name"),
+            description = json.getString("description"),
+            freeBytes = json.getLong("freeBytes"),
+            totalBytes = json.getLong("totalBytes"),
+            offloadedLayers = json.getInt("offloadedLayers")
+        )
+    }
+}
+
+/**
+ * Prefix KV cache counters from [LlamaBridge.prefixCacheStats].
+ *
+ * @property diskHits Hits that read a snapshot spilled to disk
+ * @property tokensSaved Prompt tokens restored instead of decoded
+ * @property evictions Snapshots dropped to stay within budget
+ */
+data class PrefixCacheStats(
+    val hits: Long,
+    val diskHits: Long,
+    val misses: Long,
+    val tokensSaved: Long,
+    val stores: Long,
+    val spills: Long,
+    val evictions: Long,
+    val entries: Int,
+    val ramEntries: Int,
+    val ramBytes: Long,
+    val diskBytes: Long,
+    val ramBudget: Long,
+    val diskBudget: Long
+) {
+    companion object {
+        fun fromJson(json: JSONObject) = PrefixCacheStats(
+            hits = json.getLong("hits"),
+            diskHits = json.getLong("diskHits"),
+            misses = json.getLong("misses"),
+            tokensSaved = json.getLong("tokensSaved"),
+            stores = json.getLong("stores"),
+            spills = json.getLong("spills"),
+            evictions = json.getLong("evictions"),
+            entries = json.getInt("entries"),
+            ramEntries = json.getInt("ramEntries"),
+            ramBytes = json.getLong("ramBytes"),
+            diskBytes = json.getLong("diskBytes"),
+            ramBudget = json.getLong("ramBudget"),
+            diskBudget = json.getLong("diskBudget")
+        )
+    }
+
+    /** Fraction of lookups served from the cache. */
+    val hitRate: Float
+        get() = if (hits + misses > 0) hits.toFloat() / (hits + misses) else 0f
+}
+
+/**
+ * Speculative decoding counters.
+ */
+data class SpeculativeStats(
+    val drafted: Long,
+    val accepted: Long
+) {
+    /** Fraction of drafted tokens the target model kept. */
+    val acceptanceRate: Float
+        get() = if (drafted > 0) accepted.toFloat() / drafted else 0f
+}
+
+/**
+ * One chat turn for [LlamaBridge.generateChatAsync].
+ *
+ * @property role "system", "user" or "assistant"
+ */
+data class ChatMessage(
+    val role: String,
+    val content: String
+) {
+    companion object {
+        fun system(content: String) = ChatMessage("system", content)
+        fun user(content: String) = ChatMessage("user", content)
+        fun assistant(content: String) = ChatMessage("assistant", content)
+    }
+}
+
 /**
  * Parameters for text generation.
+ *
+ * Each session keeps its native sampler chain while these stay the same,
+ * so reusing one instance across turns avoids rebuilding it.
+ *
+ * @property repeatLastN Tokens the repeat penalty looks back over (0 disables)
+ * @property minP Drop tokens below this fraction of the top probability (0 disables)
+ * @property typicalP Locally typical sampling mass (1 disables)
+ * @property mirostat 0 = off, 1 = Mirostat, 2 = Mirostat 2.0; replaces top-k/top-p/min-p
+ * @property grammar GBNF grammar the output must match, or null
+ * @property keepTokens Prompt tokens pinned when the context overflows,
+ *   typically the system prompt (-1 = BOS only, or the leading system
+ *   message of a chat prompt)
+ * @property contextShift Evict the oldest unpinned tokens instead of failing
+ *   when the prompt or reply outgrows the context
+ * @property stop Strings that end generation, matched natively as text is
+ *   produced; the match itself is not returned
+ * @property stopAfterJson End generation once a complete top-level JSON
+ *   object has been produced, keeping it in the output
  */
 data class GenerationParams(
     val maxTokens: Int = 512,
     val temperature: Float = 0.7f,
     val topP: Float = 0.9f,
     val topK: Int = 40,
-    val repeatPenalty: Float = 1.1f
+    val repeatPenalty: Float = 1.1f,
+    val repeatLastN: Int = 64,
+    val minP: Float = 0.05f,
+    val typicalP: Float = 1.0f,
+    val mirostat: Int = 0,
+    val mirostatTau: Float = 5.0f,
+    val mirostatEta: Float = 0.1f,
+    val grammar: String? = null,
+    val keepTokens: Int = -1,
+    val contextShift: Boolean = true,
+    val stop: List<String> = emptyList(),
+    val stopAfterJson: Boolean = false
 ) {
     companion object {
         /** Creative settings for storytelling */
@@ -47,6 +47,7 @@ class LogActivity : AppCompatActivity() {
             adapter = logAdapter
         }
 
+        binding.btnPerf.setOnClickListener { showPerfStats() }
         binding.btnShare.setOnClickListener { shareLogs() }
         binding.btnClear.setOnClickListener { confirmClear() }
     }
@@ -83,6 +84,50 @@ class LogActivity : AppCompatActivity() {
         startActivity(Intent.createChooser(shareIntent, "Share logs"))
     }
 
+    private fun showPerfStats() {
+        val stats = LlamaBridge.perfStats()
+        val generation = if (stats == null) {
+            "No generation has finished yet."
+        } else {
+            buildString {
+                appendLine("Session: ${stats.sessionId}")
+                appendLine("Tokenize: %.1f ms".format(stats.tokenizeMs))
+                appendLine("Prompt: ${stats.promptTokens} tokens (${stats.cachedTokens} cached)")
+                appendLine("Prefill: %.0f ms, %.1f tokens/s".format(stats.prefillMs, stats.prefillTokensPerSec))
+                appendLine("Decode: ${stats.decodeTokens} tokens, %.0f ms, %.1f tokens/s"
+                    .format(stats.decodeMs, stats.decodeTokensPerSec))
+                appendLine("Sampling: %.1f ms".format(stats.sampleMs))
+                appendLine("Time to first token: %.0f ms".format(stats.firstTokenMs))
+                appendLine("Total: %.0f ms".format(stats.totalMs))
+                if (stats.draftedTokens > 0) {
+                    appendLine("Draft accepted: ${stats.acceptedTokens}/${stats.draftedTokens}")
+                }
+                appendLine("KV cache: ${stats.kvUsed}/${stats.kvSize} cells")
+                append("RSS: ${stats.rssKb / 1024} MB (peak ${stats.peakRssKb / 1024} MB)")
+            }
+        }
+        val cache = LlamaBridge.prefixCacheStats()?.let {
+            "\n\nPrefix cache: ${it.hits} hits (${it.diskHits} from disk), " +
+                "${it.misses} misses, ${it.tokensSaved} tokens saved; " +
+                "${it.entries} snapshots, ${it.ramBytes / (1024 * 1024)} MB RAM, " +
+                "${it.diskBytes / (1024 * 1024)} MB disk"
+        }
+        val gpu = LlamaBridge.gpuInfo()?.let {
+            "\n\nGPU: ${it.description}, ${it.offloadedLayers} layers offloaded"
+        }
+        val cpu = LlamaBridge.cpuInfo()?.let {
+            "\n\nCPU kernels: ${it.kernels.joinToString(" ").ifEmpty { "baseline" }}" +
+                if (it.dynamic) " (selected at runtime)" else ""
+        }
+        val message = generation + cache.orEmpty() + cpu.orEmpty() + gpu.orEmpty()
+
+        MaterialAlertDialogBuilder(this)
+            .setTitle("Last Generation")
+            .setMessage(message)
+            .setPositiveButton("OK", null)
+            .show()
+    }
+
     private fun confirmClear() {
         MaterialAlertDialogBuilder(this)
             .setTitle("Clear Logs")
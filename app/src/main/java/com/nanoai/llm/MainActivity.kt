@@ -259,9 +259,30 @@ class MainActivity : AppCompatActivity() {
 
                     // Default: Standard generation
                     else -> {
-                        val prompt = ragManager.buildPrompt(userQuery = userMessage)
-                        LlamaBridge.generateAsync(prompt, GenerationParams.BALANCED)
-                            .map { com.nanoai.llm.rag.RagResponse(it, emptyList(), 0) }
+                        val messages = ragManager.buildMessages(userQuery = userMessage)
+                        val streamed = StringBuilder()
+                        runCatching {
+                            LlamaBridge.generateChatStream(
+                                messages,
+                                GenerationParams.BALANCED,
+                                onPrefillProgress = { processed, total ->
+                                    // Only long prompts take more than one chunk
+                                    if (processed < total) runOnUiThread {
+                                        if (streamed.isEmpty()) chatAdapter.updateLastAiMessage(
+                                            text = "Reading prompt... ${processed * 100 / total}%",
+                                            isComplete = false
+                                        )
+                                    }
+                                }
+                            ).collect { piece ->
+                                streamed.append(piece)
+                                chatAdapter.updateLastAiMessage(
+                                    text = streamed.toString(),
+                                    isComplete = false
+                                )
+                            }
+                            com.nanoai.llm.rag.RagResponse(streamed.toString(), emptyList(), 0)
+                        }
                     }
                 }
 
@@ -329,6 +350,7 @@ class MainActivity : AppCompatActivity() {
                 }
                 R.id.menu_clear -> {
                     chatAdapter.clearMessages()
+                    modelManager.deleteSession()
                     binding.layoutEmpty.visibility =
                         if (LlamaBridge.isModelLoaded()) View.GONE else View.VISIBLE
                     true
@@ -349,6 +371,16 @@ class MainActivity : AppCompatActivity() {
         popup.show()
     }
 
+    override fun onStop() {
+        super.onStop()
+        // Snapshot the conversation so the next launch skips prefill
+        if (LlamaBridge.isModelLoaded() && !isGenerating) {
+            nanoAiApp.applicationScope.launch {
+                modelManager.saveSession()
+            }
+        }
+    }
+
     override fun onResume() {
         super.onResume()
         // Refresh states
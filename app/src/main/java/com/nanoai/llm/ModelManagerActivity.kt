@@ -25,6 +25,7 @@ import com.nanoai.llm.model.DownloadProgress
 import com.nanoai.llm.model.LoadingState
 import com.nanoai.llm.model.ModelCatalog
 import com.nanoai.llm.model.ModelInfo
+import kotlinx.coroutines.async
 import kotlinx.coroutines.flow.collectLatest
 import kotlinx.coroutines.launch
 
@@ -123,7 +124,11 @@ class ModelManagerActivity : AppCompatActivity() {
                     is LoadingState.Loading -> {
                         binding.layoutDownloading.visibility = View.VISIBLE
                         binding.tvDownloadStatus.text = "Loading: ${state.modelName}"
-                        binding.progressDownload.isIndeterminate = true
+                        val progress = state.progress
+                        binding.progressDownload.isIndeterminate = progress == null
+                        if (progress != null) {
+                            binding.progressDownload.progress = (progress * 100).toInt()
+                        }
                     }
                     is LoadingState.Error -> {
                         binding.layoutDownloading.visibility = View.GONE
@@ -211,7 +216,7 @@ class ModelManagerActivity : AppCompatActivity() {
             .setMessage("Size: ${model.sizeMB} MB\nRAM required: ${model.ramRequired}\n\nThis will download the model from HuggingFace.")
             .setPositiveButton("Download") { _, _ ->
                 Toast.makeText(this, "Starting download...", Toast.LENGTH_SHORT).show()
-                modelManager.downloadModel(model.downloadUrl, model.fileName)
+                modelManager.downloadModel(model.downloadUrl, model.fileName, sha256 = model.sha256)
             }
             .setNegativeButton("Cancel", null)
             .show()
@@ -251,8 +256,10 @@ class ModelManagerActivity : AppCompatActivity() {
     }
 
     private fun activateModel(model: ModelInfo) {
+        // Loads are cancellable; leaving this screen should not abort one
+        val activation = nanoAiApp.applicationScope.async { modelManager.activateModel(model) }
         lifecycleScope.launch {
-            val result = modelManager.activateModel(model)
+            val result = activation.await()
             result.onSuccess {
                 Toast.makeText(this@ModelManagerActivity,
                     "Model activated: ${model.name}", Toast.LENGTH_SHORT).show()
@@ -1,10 +1,12 @@
 package com.nanoai.llm
 
+import android.app.Activity
 import android.app.Application
 import android.app.NotificationChannel
 import android.app.NotificationManager
 import android.content.Context
 import android.os.Build
+import android.os.Bundle
 import android.util.Log
 import com.nanoai.llm.model.ModelManager
 import com.nanoai.llm.rag.RagManager
@@ -21,6 +23,10 @@ class NanoAiApplication : Application() {
     companion object {
         private const val TAG = "NanoAiApp"
 
+        // Prefix KV snapshots: RAM first, then the cache directory
+        private const val PREFIX_CACHE_RAM = 64L * 1024 * 1024
+        private const val PREFIX_CACHE_DISK = 256L * 1024 * 1024
+
         const val CHANNEL_INFERENCE = "inference_channel"
         const val CHANNEL_DOWNLOAD = "download_channel"
 
@@ -38,6 +44,7 @@ class NanoAiApplication : Application() {
     // Directory paths
     val modelsDir: File by lazy { File(filesDir, "models").apply { mkdirs() } }
     val ragDataDir: File by lazy { File(filesDir, "rag_data").apply { mkdirs() } }
+    val sessionsDir: File by lazy { File(filesDir, "sessions").apply { mkdirs() } }
     val tempDir: File by lazy { File(cacheDir, "temp").apply { mkdirs() } }
 
     override fun onCreate() {
@@ -52,6 +59,12 @@ class NanoAiApplication : Application() {
         // Initialize directories
         initializeDirectories()
 
+        // Reuse prefills of repeated RAG context across queries
+        LlamaBridge.setPrefixCache(PREFIX_CACHE_RAM, File(cacheDir, "kv_prefix"), PREFIX_CACHE_DISK)
+
+        // Recover from memory trims when the app comes back
+        registerActivityLifecycleCallbacks(ForegroundTracker())
+
         // Auto-load last active model (optional)
         applicationScope.launch {
             try {
@@ -97,6 +110,7 @@ class NanoAiApplication : Application() {
         // Ensure all required directories exist
         modelsDir.mkdirs()
         ragDataDir.mkdirs()
+        sessionsDir.mkdirs()
         tempDir.mkdirs()
 
         // Create .nomedia file to prevent models appearing in gallery
@@ -147,6 +161,35 @@ class NanoAiApplication : Application() {
             // Clear non-essential caches
             tempDir.listFiles()?.forEach { it.delete() }
         }
+        applicationScope.launch {
+            modelManager.onTrimMemory(level)
+        }
+    }
+
+    /**
+     * Counts started activities and tells [ModelManager] when the first one
+     * starts again, i.e. the app returns to the foreground.
+     */
+    private inner class ForegroundTracker : ActivityLifecycleCallbacks {
+        private var started = 0
+
+        override fun onActivityStarted(activity: Activity) {
+            if (started++ == 0) {
+                applicationScope.launch {
+                    modelManager.onForeground()
+                }
+            }
+        }
+
+        override fun onActivityStopped(activity: Activity) {
+            started--
+        }
+
+        override fun onActivityCreated(activity: Activity, savedInstanceState: Bundle?) {}
+        override fun onActivityResumed(activity: Activity) {}
+        override fun onActivityPaused(activity: Activity) {}
+        override fun onActivitySaveInstanceState(activity: Activity, outState: Bundle) {}
+        override fun onActivityDestroyed(activity: Activity) {}
     }
 }
 
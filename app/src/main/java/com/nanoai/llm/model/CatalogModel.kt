@@ -2,6 +2,10 @@ package com.nanoai.llm.model
 
 /**
  * CatalogModel - Represents a model available for download from the catalog.
+ *
+ * @property sha256 SHA-256 of the file in hex, as listed for the file on its
+ *   hosting page; downloads are checked against it. Null skips the check,
+ *   leaving only GGUF validation.
  */
 data class CatalogModel(
     val id: String,
@@ -11,7 +15,8 @@ data class CatalogModel(
     val ramRequired: String,
     val quantization: String,
     val downloadUrl: String,
-    val fileName: String
+    val fileName: String,
+    val sha256: String? = null
 )
 
 /**
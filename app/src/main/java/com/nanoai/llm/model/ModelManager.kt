@@ -1,5 +1,6 @@
 package com.nanoai.llm.model
 
+import android.content.ComponentCallbacks2
 import android.content.ComponentName
 import android.content.Context
 import android.content.Intent
@@ -10,12 +11,15 @@ import android.util.Log
 import com.google.gson.Gson
 import com.google.gson.reflect.TypeToken
 import com.nanoai.llm.LlamaBridge
+import com.nanoai.llm.ThreadConfig
 import com.nanoai.llm.nanoAiApp
 import com.nanoai.llm.service.DownloadState
 import com.nanoai.llm.service.ModelDownloadService
 import com.nanoai.llm.util.NotificationHelper
 import kotlinx.coroutines.*
 import kotlinx.coroutines.flow.*
+import kotlinx.coroutines.sync.Mutex
+import kotlinx.coroutines.sync.withLock
 import java.io.File
 import java.io.FileOutputStream
 import java.net.HttpURLConnection
@@ -32,12 +36,19 @@ class ModelManager(private val context: Context) {
         private const val KEY_ACTIVE_MODEL = "active_model"
         private const val KEY_LAST_CONTEXT_SIZE = "last_context_size"
         private const val KEY_LAST_THREADS = "last_threads"
+        private const val KEY_LAST_GPU_LAYERS = "last_gpu_layers"
+        private const val KEY_THREAD_CONFIG_PREFIX = "thread_config_"
+        private const val MIN_CONTEXT_SIZE = 512
+        // RAM left free beside weights and KV cache, for compute buffers and the app
+        private const val MEMORY_HEADROOM = 384L * 1024 * 1024
+        const val CHAT_SESSION = "chat"
     }
 
     private val prefs: SharedPreferences =
         context.getSharedPreferences(PREFS_NAME, Context.MODE_PRIVATE)
     private val gson = Gson()
     private val modelsDir: File = context.nanoAiApp.modelsDir
+    private val sessionsDir: File = context.nanoAiApp.sessionsDir
 
     // State flows
     private val _installedModels = MutableStateFlow<List<ModelInfo>>(emptyList())
@@ -52,6 +63,12 @@ class ModelManager(private val context: Context) {
     private val _downloadProgress = MutableStateFlow<DownloadProgress?>(null)
     val downloadProgress: StateFlow<DownloadProgress?> = _downloadProgress.asStateFlow()
 
+    // Memory pressure: serializes trims with foreground recovery. evictedModel
+    // is set when a trim unloaded the model, so the next foreground reloads it.
+    private val residencyMutex = Mutex()
+    @Volatile
+    private var evictedModel: ModelInfo? = null
+
     init {
         loadModelsFromStorage()
     }
@@ -187,11 +204,14 @@ class ModelManager(private val context: Context) {
 
     /**
      * Download a model from URL using the download service with notifications.
+     *
+     * @param sha256 Expected SHA-256 of the file in hex, if known
      */
     fun downloadModel(
         url: String,
         fileName: String,
-        @Suppress("UNUSED_PARAMETER") name: String? = null
+        @Suppress("UNUSED_PARAMETER") name: String? = null,
+        sha256: String? = null
     ) {
         val finalFileName = if (!fileName.endsWith(".gguf", true)) {
             "$fileName.gguf"
@@ -209,7 +229,7 @@ class ModelManager(private val context: Context) {
         Log.i(TAG, "Starting download: $url -> $finalFileName")
 
         // Start the download service with notifications
-        ModelDownloadService.start(context, url, finalFileName)
+        ModelDownloadService.start(context, url, finalFileName, sha256)
 
         // Bind to service to observe progress
         var serviceConnection: ServiceConnection? = null
@@ -278,43 +298,79 @@ class ModelManager(private val context: Context) {
 
     /**
      * Activate (load) a model for inference.
+     *
+     * @param contextSize Requested context; reduced if its KV cache would
+     *   not fit in available memory
+     * @param threads Decode and prefill threads, or 0 to use the calibrated
+     *   counts for this model. The first automatic load of a model runs the
+     *   calibration once and caches its result.
+     * @param kvCacheType KV cache element type for keys and values
+     * @param gpuLayers Layers to offload to the GPU, or
+     *   [LlamaBridge.GPU_LAYERS_AUTO]; 0 keeps the model on the CPU
      */
     suspend fun activateModel(
         modelInfo: ModelInfo,
         contextSize: Int = 2048,
-        threads: Int = LlamaBridge.getOptimalThreadCount()
+        threads: Int = 0,
+        kvCacheType: LlamaBridge.KvCacheType = LlamaBridge.KvCacheType.Q8_0,
+        gpuLayers: Int = 0
     ): Result<Unit> = withContext(Dispatchers.IO) {
         try {
             _loadingState.value = LoadingState.Loading(modelInfo.name)
 
-            // Unload current model if any
-            if (LlamaBridge.isModelLoaded()) {
-                LlamaBridge.unloadModelAsync()
+            // A truncated or corrupt file fails here rather than deep in the load
+            LlamaBridge.validateModelFile(modelInfo.filePath).onFailure { e ->
+                _loadingState.value = LoadingState.Error("Invalid model file: ${e.message}")
+                return@withContext Result.failure(e)
             }
 
-            // Load new model
+            // Load new model; the current one serves until it is swapped in
+            val calibrated = if (threads > 0) null else loadThreadConfig(modelInfo)
             val result = LlamaBridge.loadModelAsync(
                 modelPath = modelInfo.filePath,
-                contextSize = contextSize,
-                threads = threads
+                contextSize = fitContextSize(modelInfo, contextSize, kvCacheType),
+                threads = calibrated?.decodeThreads
+                    ?: threads.takeIf { it > 0 }
+                    ?: LlamaBridge.getOptimalThreadCount(),
+                batchThreads = calibrated?.prefillThreads ?: 0,
+                kvCacheTypeK = kvCacheType,
+                kvCacheTypeV = kvCacheType,
+                flashAttention = kvCacheType != LlamaBridge.KvCacheType.F16,
+                gpuLayers = gpuLayers,
+                onProgress = { progress ->
+                    _loadingState.value = LoadingState.Loading(modelInfo.name, progress)
+                }
             )
 
             result.onSuccess {
+                if (threads <= 0 && calibrated == null) {
+                    LlamaBridge.calibrateThreads()
+                        .onSuccess { saveThreadConfig(modelInfo, it) }
+                        .onFailure { e -> Log.w(TAG, "Thread calibration failed: ${e.message}") }
+                }
+
                 _activeModel.value = modelInfo
                 prefs.edit()
                     .putString(KEY_ACTIVE_MODEL, modelInfo.id)
                     .putInt(KEY_LAST_CONTEXT_SIZE, contextSize)
                     .putInt(KEY_LAST_THREADS, threads)
+                    .putInt(KEY_LAST_GPU_LAYERS, gpuLayers)
                     .apply()
 
                 _loadingState.value = LoadingState.Loaded(modelInfo.name)
                 Log.i(TAG, "Activated model: ${modelInfo.name}")
             }.onFailure { e ->
+                // Without room for a hot swap the old model was unloaded first
+                if (!LlamaBridge.isModelLoaded()) _activeModel.value = null
                 _loadingState.value = LoadingState.Error(e.message ?: "Load failed")
             }
 
             result
 
+        } catch (e: CancellationException) {
+            if (!LlamaBridge.isModelLoaded()) _activeModel.value = null
+            _loadingState.value = LoadingState.Idle
+            throw e
         } catch (e: Exception) {
             _loadingState.value = LoadingState.Error(e.message ?: "Activation failed")
             Log.e(TAG, "Activation failed", e)
@@ -348,6 +404,11 @@ class ModelManager(private val context: Context) {
                     deactivateModel()
                 }
 
+                // Drop saved sessions, they are useless without the model
+                sessionsDir.listFiles { f -> f.name.startsWith("${modelInfo.id}_") }
+                    ?.forEach { it.delete() }
+                prefs.edit().remove(KEY_THREAD_CONFIG_PREFIX + modelInfo.id).apply()
+
                 // Delete file
                 val file = File(modelInfo.filePath)
                 if (file.exists()) {
@@ -407,9 +468,148 @@ class ModelManager(private val context: Context) {
             ?: return Result.success(Unit)
 
         val contextSize = prefs.getInt(KEY_LAST_CONTEXT_SIZE, 2048)
-        val threads = prefs.getInt(KEY_LAST_THREADS, LlamaBridge.getOptimalThreadCount())
+        val threads = prefs.getInt(KEY_LAST_THREADS, 0)
+        val gpuLayers = prefs.getInt(KEY_LAST_GPU_LAYERS, 0)
+
+        return activateModel(model, contextSize, threads, gpuLayers = gpuLayers).onSuccess {
+            // Resume the previous conversation without re-running prefill
+            restoreSession(CHAT_SESSION)
+        }
+    }
+
+    /**
+     * Shed model memory for a [ComponentCallbacks2] trim level. Whatever
+     * loses the KV cache saves the conversation first, so [onForeground]
+     * can bring it back. A running generation limits the response to
+     * advising weight pages as cold.
+     */
+    suspend fun onTrimMemory(level: Int) = withContext(Dispatchers.IO) {
+        residencyMutex.withLock {
+            val model = _activeModel.value ?: return@withLock
+            if (!LlamaBridge.isModelLoaded()) return@withLock
+            val generating = LlamaBridge.isGenerating()
+
+            @Suppress("DEPRECATION")
+            when {
+                level < ComponentCallbacks2.TRIM_MEMORY_RUNNING_LOW -> Unit
+                generating || level < ComponentCallbacks2.TRIM_MEMORY_BACKGROUND ->
+                    LlamaBridge.trimMemoryAsync(LlamaBridge.TrimLevel.COLD)
+                level < ComponentCallbacks2.TRIM_MEMORY_MODERATE ->
+                    LlamaBridge.trimMemoryAsync(LlamaBridge.TrimLevel.DROP_PAGES)
+                level < ComponentCallbacks2.TRIM_MEMORY_COMPLETE -> {
+                    if (!LlamaBridge.isContextReleased()) saveSession(CHAT_SESSION)
+                    LlamaBridge.trimMemoryAsync(LlamaBridge.TrimLevel.RELEASE_CONTEXT)
+                }
+                else -> {
+                    // Next in line to be killed: give everything back
+                    if (!LlamaBridge.isContextReleased()) saveSession(CHAT_SESSION)
+                    LlamaBridge.unloadModelAsync()
+                    evictedModel = model
+                    _loadingState.value = LoadingState.Idle
+                    Log.i(TAG, "Model ${model.name} unloaded under memory pressure")
+                }
+            }
+        }
+    }
+
+    /**
+     * Undo [onTrimMemory] when the app is visible again: reload an evicted
+     * model, or recreate a released context, restoring the conversation;
+     * then prefetch the weights so the first token is not slowed by faults.
+     */
+    suspend fun onForeground() = withContext(Dispatchers.IO) {
+        residencyMutex.withLock {
+            if (evictedModel != null) {
+                evictedModel = null
+                loadLastActiveModel()
+                return@withLock
+            }
+            if (!LlamaBridge.isModelLoaded()) return@withLock
+
+            LlamaBridge.prefetchModelWeights()
+            if (LlamaBridge.isContextReleased()) {
+                LlamaBridge.resumeContextAsync().onSuccess { restoreSession(CHAT_SESSION) }
+            }
+        }
+    }
+
+    /**
+     * Save the active model's conversation state under a session name.
+     */
+    suspend fun saveSession(name: String = CHAT_SESSION): Result<Unit> {
+        val model = _activeModel.value
+            ?: return Result.failure(IllegalStateException("No active model"))
+        return LlamaBridge.saveSessionAsync(sessionFile(model, name))
+    }
+
+    /**
+     * Restore a named session for the active model, if one was saved.
+     */
+    suspend fun restoreSession(name: String = CHAT_SESSION): Result<Unit> {
+        val model = _activeModel.value
+            ?: return Result.failure(IllegalStateException("No active model"))
+        val file = sessionFile(model, name)
+        return LlamaBridge.restoreSessionAsync(file).onFailure {
+            Log.d(TAG, "Session $name not restored: ${it.message}")
+        }
+    }
+
+    /**
+     * Delete a named session for the active model.
+     */
+    fun deleteSession(name: String = CHAT_SESSION) {
+        _activeModel.value?.let { sessionFile(it, name).delete() }
+    }
+
+    private fun sessionFile(model: ModelInfo, name: String): File =
+        File(sessionsDir, "${model.id}_$name.session")
+
+    /**
+     * Largest context up to [requested] whose KV cache fits in available
+     * memory beside the weights, halving down to [MIN_CONTEXT_SIZE]. A
+     * loaded model's memory counts as available: the load only hot-swaps
+     * when both fit and otherwise frees it first, so a switch gets the
+     * same context as a cold load.
+     */
+    private fun fitContextSize(
+        model: ModelInfo,
+        requested: Int,
+        kvCacheType: LlamaBridge.KvCacheType
+    ): Int {
+        val free = LlamaBridge.getAvailableMemory()
+        if (free <= 0) return requested
+        val available = free + LlamaBridge.getModelMemory()
+        val budget = available - File(model.filePath).length() - MEMORY_HEADROOM
+
+        var contextSize = requested
+        while (contextSize > MIN_CONTEXT_SIZE) {
+            val kvBytes = LlamaBridge.estimateKvCacheBytes(
+                model.filePath, contextSize, kvCacheType, kvCacheType
+            )
+            // Unknown metadata: trust the request
+            if (kvBytes == 0L || kvBytes <= budget) break
+            contextSize /= 2
+        }
+        contextSize = contextSize.coerceAtLeast(minOf(requested, MIN_CONTEXT_SIZE))
+        if (contextSize != requested) {
+            Log.w(TAG, "Context reduced from $requested to $contextSize tokens to fit " +
+                "${available / (1024 * 1024)}MB available RAM")
+        }
+        return contextSize
+    }
+
+    // Calibrated thread counts per model, stored as "decode,prefill"
+    private fun loadThreadConfig(model: ModelInfo): ThreadConfig? {
+        val value = prefs.getString(KEY_THREAD_CONFIG_PREFIX + model.id, null) ?: return null
+        val parts = value.split(",").mapNotNull { it.toIntOrNull() }
+        if (parts.size != 2 || parts.any { it <= 0 }) return null
+        return ThreadConfig(decodeThreads = parts[0], prefillThreads = parts[1])
+    }
 
-        return activateModel(model, contextSize, threads)
+    private fun saveThreadConfig(model: ModelInfo, config: ThreadConfig) {
+        prefs.edit()
+            .putString(KEY_THREAD_CONFIG_PREFIX + model.id, "${config.decodeThreads},${config.prefillThreads}")
+            .apply()
     }
 
     /**
@@ -504,7 +704,8 @@ enum class ModelSource {
  */
 sealed class LoadingState {
     object Idle : LoadingState()
-    data class Loading(val modelName: String) : LoadingState()
+    /** [progress] is in [0, 1], or null before the loader reports any. */
+    data class Loading(val modelName: String, val progress: Float? = null) : LoadingState()
     data class Loaded(val modelName: String) : LoadingState()
     object Importing : LoadingState()
     object Downloading : LoadingState()
@@ -3,6 +3,8 @@ package com.nanoai.llm.rag
 import android.content.Context
 import android.content.SharedPreferences
 import android.util.Log
+import com.nanoai.llm.BuildConfig
+import com.nanoai.llm.ChatMessage
 import com.nanoai.llm.LlamaBridge
 import com.nanoai.llm.GenerationParams
 import com.nanoai.llm.vector.ChunkMetadata
@@ -30,14 +32,23 @@ class RagManager(private val context: Context) {
         private const val KEY_TOP_K = "top_k"
         private const val KEY_CHUNK_SIZE = "chunk_size"
         private const val KEY_MIN_SIMILARITY = "min_similarity"
+        private const val KEY_ANN_EF = "ann_ef"
+        // Chunks per native embedding call; keeps progress updates flowing
+        private const val EMBED_BATCH_SIZE = 32
+        // Indexing and queries must use the same pooling
+        private val EMBEDDING_POOLING = LlamaBridge.Pooling.MEAN
         const val DEFAULT_SYSTEM_PROMPT = """You are a helpful offline AI assistant. Answer questions accurately and concisely based on the provided context. If the context doesn't contain relevant information, say so and provide your best general knowledge answer."""
     }
 
     private val prefs: SharedPreferences =
         context.getSharedPreferences(PREFS_NAME, Context.MODE_PRIVATE)
 
+    // ANN query beam width, applied once the store is large
+    private val _annEf = MutableStateFlow(prefs.getInt(KEY_ANN_EF, VectorStore.DEFAULT_ANN_EF_SEARCH))
+    val annEf: StateFlow<Int> = _annEf.asStateFlow()
+
     // Vector store for embeddings
-    val vectorStore: VectorStore = VectorStore(context, "main")
+    val vectorStore: VectorStore = VectorStore(context, "main", _annEf.value)
 
     // Settings
     private val _isEnabled = MutableStateFlow(prefs.getBoolean(KEY_RAG_ENABLED, true))
@@ -95,6 +106,16 @@ class RagManager(private val context: Context) {
         prefs.edit().putFloat(KEY_MIN_SIMILARITY, _minSimilarity.value).apply()
     }
 
+    /**
+     * Set the ANN search beam width, used once the corpus exceeds
+     * [VectorStore.ANN_THRESHOLD] chunks.
+     */
+    suspend fun setAnnEf(ef: Int) {
+        _annEf.value = ef.coerceIn(16, 512)
+        prefs.edit().putInt(KEY_ANN_EF, _annEf.value).apply()
+        vectorStore.setAnnEfSearch(_annEf.value)
+    }
+
     /**
      * Index a web page.
      */
@@ -136,25 +157,11 @@ class RagManager(private val context: Context) {
                 return@withContext Result.failure(IllegalStateException("Model not loaded"))
             }
 
-            val chunkEmbeddings = mutableListOf<Pair<String, FloatArray>>()
-            for ((index, chunk) in chunks.withIndex()) {
-                _indexingState.value = IndexingState.Embedding(chunks.size, index + 1)
-
-                val embeddingResult = LlamaBridge.getEmbeddingAsync(chunk)
-                embeddingResult.onSuccess { embedding ->
-                    chunkEmbeddings.add(chunk to embedding)
-                }.onFailure { e ->
-                    Log.w(TAG, "Failed to embed chunk $index: ${e.message}")
-                    // Use simple hash-based fallback embedding
-                    val fallback = createFallbackEmbedding(chunk)
-                    chunkEmbeddings.add(chunk to fallback)
-                }
-            }
+            val source = url.hashCode().toString()
+            val stored = embedAndStore(chunks, source)
 
-            // Store in vector store
+            // Persist the vector store
             _indexingState.value = IndexingState.Storing
-            val source = url.hashCode().toString()
-            vectorStore.addChunks(chunkEmbeddings, source)
             vectorStore.saveToDisk()
 
             // Create source record
@@ -162,14 +169,14 @@ class RagManager(private val context: Context) {
                 id = source,
                 url = url,
                 title = content.title,
-                chunksCount = chunkEmbeddings.size,
+                chunksCount = stored,
                 wordCount = content.wordCount,
                 addedTimestamp = System.currentTimeMillis()
             )
 
             refreshSources()
             _indexingState.value = IndexingState.Complete(ragSource)
-            Log.i(TAG, "Indexed $url with ${chunkEmbeddings.size} chunks")
+            Log.i(TAG, "Indexed $url with $stored chunks")
 
             Result.success(ragSource)
 
@@ -205,29 +212,17 @@ class RagManager(private val context: Context) {
             // Generate embeddings
             _indexingState.value = IndexingState.Embedding(chunks.size)
 
-            val chunkEmbeddings = mutableListOf<Pair<String, FloatArray>>()
-            for ((index, chunk) in chunks.withIndex()) {
-                _indexingState.value = IndexingState.Embedding(chunks.size, index + 1)
-
-                val embeddingResult = LlamaBridge.getEmbeddingAsync(chunk)
-                embeddingResult.onSuccess { embedding ->
-                    chunkEmbeddings.add(chunk to embedding)
-                }.onFailure {
-                    val fallback = createFallbackEmbedding(chunk)
-                    chunkEmbeddings.add(chunk to fallback)
-                }
-            }
+            val stored = embedAndStore(chunks, sourceId)
 
-            // Store
+            // Persist
             _indexingState.value = IndexingState.Storing
-            vectorStore.addChunks(chunkEmbeddings, sourceId)
             vectorStore.saveToDisk()
 
             val ragSource = RagSource(
                 id = sourceId,
                 url = null,
                 title = title ?: "Text: ${text.take(30)}...",
-                chunksCount = chunkEmbeddings.size,
+                chunksCount = stored,
                 wordCount = text.split(Regex("\\s+")).size,
                 addedTimestamp = System.currentTimeMillis()
             )
@@ -252,8 +247,12 @@ class RagManager(private val context: Context) {
         if (!LlamaBridge.isModelLoaded()) return emptyList()
 
         return try {
-            val embeddingResult = LlamaBridge.getEmbeddingAsync(query)
-            embeddingResult.getOrNull()?.let { embedding ->
+            val embeddingResult = LlamaBridge.getEmbeddingsAsync(listOf(query), EMBEDDING_POOLING)
+            embeddingResult.getOrNull()?.firstOrNull()?.let { embedding ->
+                if (BuildConfig.DEBUG && vectorStore.isApproximate) {
+                    val recall = vectorStore.measureRecall(embedding, _topK.value)
+                    Log.d(TAG, "ANN recall@${_topK.value}: $recall")
+                }
                 vectorStore.search(
                     queryEmbedding = embedding,
                     topK = _topK.value,
@@ -273,23 +272,40 @@ class RagManager(private val context: Context) {
         userQuery: String,
         systemPrompt: String? = null
     ): String {
-        val results = retrieve(userQuery)
-
-        val contextText = if (results.isNotEmpty()) {
-            results.joinToString("\n\n") { result ->
-                "[Source: ${result.chunk.metadata.source}]\n${result.chunk.text}"
-            }
-        } else {
-            ""
-        }
-
         return buildPrompt(
             userQuery = userQuery,
-            context = contextText,
+            context = formatContext(retrieve(userQuery)),
             systemPrompt = systemPrompt
         )
     }
 
+    private fun formatContext(results: List<SearchResult>): String =
+        results.joinToString("\n\n") { result ->
+            "[Source: ${result.chunk.metadata.source}]\n${result.chunk.text}"
+        }
+
+    /**
+     * Build chat messages for [LlamaBridge.generateChatAsync], which formats
+     * them with the model's own chat template. The system prompt is a
+     * message of its own, so its tokens are cached natively and pinned
+     * when the context overflows.
+     */
+    fun buildMessages(
+        userQuery: String,
+        context: String = "",
+        systemPrompt: String? = null
+    ): List<ChatMessage> {
+        val user = if (context.isNotBlank()) {
+            "Context:\n$context\n\nQuestion: $userQuery"
+        } else {
+            userQuery
+        }
+        return listOf(
+            ChatMessage.system(systemPrompt ?: DEFAULT_SYSTEM_PROMPT),
+            ChatMessage.user(user)
+        )
+    }
+
     /**
      * Build prompt with given context.
      */
@@ -335,9 +351,9 @@ ASSISTANT:
         systemPrompt: String? = null
     ): Result<RagResponse> {
         val results = retrieve(userQuery)
-        val prompt = buildRagPrompt(userQuery, systemPrompt)
+        val messages = buildMessages(userQuery, formatContext(results), systemPrompt)
 
-        val generationResult = LlamaBridge.generateAsync(prompt, params)
+        val generationResult = LlamaBridge.generateChatAsync(messages, params)
 
         return generationResult.map { response ->
             RagResponse(
@@ -393,6 +409,39 @@ ASSISTANT:
         }
     }
 
+    /**
+     * Embed chunks in native batches and add them to the vector store,
+     * updating indexing progress per batch. All batches are embedded into
+     * one reused direct buffer that the native index reads in place, so no
+     * per-chunk arrays are created. A failed batch falls back to hash
+     * embeddings for its chunks. Returns the number of chunks stored.
+     */
+    private suspend fun embedAndStore(chunks: List<String>, source: String): Int {
+        val buffer = LlamaBridge.allocateEmbeddingBuffer(EMBED_BATCH_SIZE)
+        var stored = 0
+        for (group in chunks.chunked(EMBED_BATCH_SIZE)) {
+            val embedded = buffer?.let {
+                LlamaBridge.getEmbeddingsInto(group, it, EMBEDDING_POOLING)
+                    .onSuccess { dim ->
+                        vectorStore.addEmbeddedChunks(group, it, dim, source, stored, chunks.size)
+                    }
+            }
+            if (embedded == null || embedded.isFailure) {
+                Log.w(TAG, "Failed to embed ${group.size} chunks: ${embedded?.exceptionOrNull()?.message}")
+                // Use simple hash-based fallback embedding
+                vectorStore.addChunks(
+                    group.map { it to createFallbackEmbedding(it) },
+                    source,
+                    firstIndex = stored,
+                    sourceChunks = chunks.size
+                )
+            }
+            stored += group.size
+            _indexingState.value = IndexingState.Embedding(chunks.size, stored)
+        }
+        return stored
+    }
+
     /**
      * Create a fallback embedding when model embedding fails.
      * Uses simple TF-IDF-like hashing.
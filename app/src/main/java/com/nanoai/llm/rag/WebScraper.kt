@@ -1,6 +1,7 @@
 package com.nanoai.llm.rag
 
 import android.util.Log
+import com.nanoai.llm.LlamaBridge
 import kotlinx.coroutines.Dispatchers
 import kotlinx.coroutines.withContext
 import org.jsoup.Jsoup
@@ -198,14 +199,18 @@ object WebScraper {
     }
 
     /**
-     * Chunk by approximate token count.
-     * Assumes ~4 characters per token (rough estimate for English).
+     * Chunk by token count. Exact with a model loaded, using its tokenizer;
+     * otherwise assumes ~4 characters per token (rough estimate for English).
      */
     fun chunkByTokens(
         text: String,
         maxTokens: Int = 300,
         overlapTokens: Int = 50
     ): List<String> {
+        if (LlamaBridge.isModelLoaded()) {
+            LlamaBridge.chunkByTokens(text, maxTokens, overlapTokens)?.let { return it }
+        }
+
         val charsPerToken = 4
         return chunkText(
             text = text,
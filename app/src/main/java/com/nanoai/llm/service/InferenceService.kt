@@ -49,6 +49,10 @@ class InferenceService : Service() {
     private var wakeLock: PowerManager.WakeLock? = null
     private var currentJob: Job? = null
 
+    // Own native session, so background inference is batched alongside
+    // chat instead of sharing (and invalidating) its KV cache
+    private var session = LlamaBridge.DEFAULT_SESSION
+
     // State
     private val _isProcessing = MutableStateFlow(false)
     val isProcessing: StateFlow<Boolean> = _isProcessing.asStateFlow()
@@ -66,6 +70,10 @@ class InferenceService : Service() {
         super.onCreate()
         Log.i(TAG, "InferenceService created")
         acquireWakeLock()
+        session = LlamaBridge.openSession().getOrElse {
+            Log.w(TAG, "Using default session: ${it.message}")
+            LlamaBridge.DEFAULT_SESSION
+        }
     }
 
     override fun onStartCommand(intent: Intent?, flags: Int, startId: Int): Int {
@@ -79,6 +87,13 @@ class InferenceService : Service() {
         serviceScope.cancel()
         releaseWakeLock()
         currentJob?.cancel()
+        if (session != LlamaBridge.DEFAULT_SESSION) {
+            val id = session
+            // Closing waits for the native request to retire
+            NanoAiApplication.instance.applicationScope.launch {
+                LlamaBridge.closeSession(id)
+            }
+        }
     }
 
     /**
@@ -100,7 +115,7 @@ class InferenceService : Service() {
 
         currentJob = serviceScope.launch {
             try {
-                val result = LlamaBridge.generateAsync(prompt, params)
+                val result = LlamaBridge.generateAsync(prompt, params, session)
                 withContext(Dispatchers.Main) {
                     onResult(result)
                 }
@@ -122,7 +137,7 @@ class InferenceService : Service() {
      */
     fun stopInference() {
         if (_isProcessing.value) {
-            LlamaBridge.stopGeneration()
+            LlamaBridge.stopSession(session)
             currentJob?.cancel()
             _isProcessing.value = false
             _currentPrompt.value = null
@@ -8,35 +8,64 @@ import android.content.Context
 import android.content.Intent
 import android.os.Binder
 import android.os.IBinder
+import android.util.Base64
 import android.util.Log
 import androidx.core.app.NotificationCompat
+import com.nanoai.llm.LlamaBridge
 import com.nanoai.llm.ModelManagerActivity
 import com.nanoai.llm.NanoAiApplication
 import com.nanoai.llm.R
 import kotlinx.coroutines.*
+import kotlinx.coroutines.channels.Channel
 import kotlinx.coroutines.flow.MutableStateFlow
 import kotlinx.coroutines.flow.StateFlow
 import kotlinx.coroutines.flow.asStateFlow
+import kotlinx.coroutines.sync.Mutex
+import kotlinx.coroutines.sync.withLock
+import org.json.JSONObject
 import java.io.File
 import java.io.FileOutputStream
+import java.io.IOException
+import java.io.RandomAccessFile
 import java.net.HttpURLConnection
 import java.net.URL
+import java.nio.ByteBuffer
+import java.nio.channels.FileChannel
+import java.security.MessageDigest
+import java.util.BitSet
+import java.util.concurrent.atomic.AtomicInteger
+import java.util.concurrent.atomic.AtomicLong
 
 /**
  * ModelDownloadService - Background service for downloading GGUF models.
  *
- * Handles large file downloads with progress tracking and resume support.
+ * Downloads over several connections in fixed-size segments when the server
+ * supports ranges, recording finished segments in a map next to the partial
+ * file so an interrupted download resumes; otherwise as a single stream. The
+ * file is hashed while it downloads, checked against the expected SHA-256
+ * and validated as GGUF before it replaces the partial file.
  */
 class ModelDownloadService : Service() {
     companion object {
         private const val TAG = "ModelDownloadService"
         private const val NOTIFICATION_ID = 1002
-        private const val BUFFER_SIZE = 8192
-
-        fun start(context: Context, url: String, filename: String) {
+        private const val BUFFER_SIZE = 64 * 1024
+
+        // Segmented downloads: bytes per segment, parallel connections, and
+        // attempts per segment before the download fails
+        private const val SEGMENT_SIZE = 8L * 1024 * 1024
+        private const val CONNECTIONS = 4
+        private const val SEGMENT_ATTEMPTS = 3
+
+        /**
+         * @param sha256 Expected SHA-256 of the file in hex, or null to only
+         *   validate it as GGUF
+         */
+        fun start(context: Context, url: String, filename: String, sha256: String? = null) {
             val intent = Intent(context, ModelDownloadService::class.java).apply {
                 putExtra("url", url)
                 putExtra("filename", filename)
+                putExtra("sha256", sha256)
             }
             context.startForegroundService(intent)
         }
@@ -50,6 +79,7 @@ class ModelDownloadService : Service() {
     private val binder = LocalBinder()
     private val serviceScope = CoroutineScope(SupervisorJob() + Dispatchers.IO)
     private var currentJob: Job? = null
+    private val lastProgressPercent = AtomicInteger(-1)
 
     // State
     private val _downloadState = MutableStateFlow<DownloadState>(DownloadState.Idle)
@@ -73,7 +103,7 @@ class ModelDownloadService : Service() {
         val filename = intent?.getStringExtra("filename")
 
         if (url != null && filename != null) {
-            startDownload(url, filename)
+            startDownload(url, filename, intent.getStringExtra("sha256"))
         }
 
         return START_STICKY
@@ -88,8 +118,10 @@ class ModelDownloadService : Service() {
 
     /**
      * Start downloading a model.
+     *
+     * @param sha256 Expected SHA-256 in hex; a mismatch fails the download
      */
-    fun startDownload(url: String, filename: String) {
+    fun startDownload(url: String, filename: String, sha256: String? = null) {
         if (_downloadState.value is DownloadState.Downloading) {
             Log.w(TAG, "Download already in progress")
             return
@@ -97,24 +129,39 @@ class ModelDownloadService : Service() {
 
         val modelsDir = (applicationContext as NanoAiApplication).modelsDir
         val outputFile = File(modelsDir, filename)
+        val partFile = File(modelsDir, "$filename.part")
+        val mapFile = File(modelsDir, "$filename.part.map")
 
         currentJob = serviceScope.launch {
             try {
                 _downloadState.value = DownloadState.Downloading(url, filename, 0, 0)
-                download(url, outputFile)
+                lastProgressPercent.set(-1)
+                val digest = download(url, filename, partFile, mapFile)
+                updateNotification("Verifying $filename", 100)
+                verify(partFile, digest, sha256)
+                if (!partFile.renameTo(outputFile)) {
+                    throw IOException("Cannot move download to ${outputFile.absolutePath}")
+                }
+                mapFile.delete()
+                Log.i(TAG, "Download complete: ${outputFile.absolutePath}")
                 _downloadState.value = DownloadState.Completed(outputFile.absolutePath)
                 updateNotification("Download complete", 100)
                 delay(2000)
                 stopSelf()
             } catch (e: CancellationException) {
                 _downloadState.value = DownloadState.Cancelled
-                outputFile.delete()
+                partFile.delete()
+                mapFile.delete()
                 stopSelf()
             } catch (e: Exception) {
                 Log.e(TAG, "Download failed", e)
                 _downloadState.value = DownloadState.Error(e.message ?: "Download failed")
                 updateNotification("Download failed", 0)
-                outputFile.delete()
+                // Keep a partial download so a retry resumes it, unless its bytes are bad
+                if (e is CorruptDownloadException) {
+                    partFile.delete()
+                    mapFile.delete()
+                }
             }
         }
     }
@@ -127,66 +174,223 @@ class ModelDownloadService : Service() {
         _downloadState.value = DownloadState.Cancelled
     }
 
-    private suspend fun download(urlString: String, outputFile: File) {
-        var connection: HttpURLConnection? = null
-        var output: FileOutputStream? = null
+    /**
+     * Download into [partFile], segmented if the server supports ranges.
+     * Returns the SHA-256 of the file.
+     */
+    private suspend fun download(
+        urlString: String,
+        filename: String,
+        partFile: File,
+        mapFile: File
+    ): ByteArray {
+        val probe = probe(urlString)
+        val onProgress = { current: Long, total: Long -> reportProgress(urlString, filename, current, total) }
+        return if (probe.rangeSupported) {
+            downloadSegmented(urlString, probe, partFile, mapFile, onProgress)
+        } else {
+            Log.i(TAG, "Server does not support ranges, downloading as one stream")
+            mapFile.delete()
+            downloadStream(urlString, partFile, onProgress)
+        }
+    }
+
+    /** Size and range support of a download, from a one-byte range request. */
+    private class Probe(val totalBytes: Long, val rangeSupported: Boolean, val etag: String?)
 
+    private fun probe(urlString: String): Probe {
+        val connection = openConnection(urlString)
+        connection.setRequestProperty("Range", "bytes=0-0")
         try {
-            val url = URL(urlString)
-            connection = url.openConnection() as HttpURLConnection
-            connection.connectTimeout = 30000
-            connection.readTimeout = 30000
-            connection.requestMethod = "GET"
-
-            // Support resume
-            var downloadedBytes = 0L
-            if (outputFile.exists()) {
-                downloadedBytes = outputFile.length()
-                connection.setRequestProperty("Range", "bytes=$downloadedBytes-")
+            return when (val responseCode = connection.responseCode) {
+                206 -> {
+                    val total = connection.getHeaderField("Content-Range")
+                        ?.substringAfterLast('/')?.toLongOrNull() ?: -1L
+                    Probe(total, total > 0, connection.getHeaderField("ETag"))
+                }
+                200 -> Probe(connection.contentLengthLong, false, null)
+                else -> throw IOException("HTTP error: $responseCode")
             }
+        } finally {
+            connection.disconnect()
+        }
+    }
 
-            connection.connect()
+    private suspend fun downloadSegmented(
+        urlString: String,
+        probe: Probe,
+        partFile: File,
+        mapFile: File,
+        onProgress: (Long, Long) -> Unit
+    ): ByteArray = coroutineScope {
+        // A map for another file or server version cannot be resumed
+        val saved = SegmentMap.load(mapFile)?.takeIf {
+            it.url == urlString && it.totalBytes == probe.totalBytes &&
+                it.etag == probe.etag && partFile.exists()
+        }
+        val map = saved ?: SegmentMap(urlString, probe.totalBytes, probe.etag, SEGMENT_SIZE)
+        if (saved != null) {
+            Log.i(TAG, "Resuming with ${map.done.cardinality()} of ${map.segmentCount} segments")
+        } else {
+            partFile.delete()
+        }
 
-            val responseCode = connection.responseCode
-            if (responseCode !in listOf(200, 206)) {
-                throw Exception("HTTP error: $responseCode")
+        RandomAccessFile(partFile, "rw").use { file ->
+            file.setLength(map.totalBytes)
+            val channel = file.channel
+            val hasher = OrderedHasher(channel, map)
+            val downloaded = AtomicLong(map.downloadedBytes())
+            val mapLock = Mutex()
+            // Segments already on disk are hashed again, since a digest cannot be saved
+            mapLock.withLock { hasher.advance() }
+
+            val pending = Channel<Int>(Channel.UNLIMITED)
+            for (index in 0 until map.segmentCount) {
+                if (!map.done[index]) pending.trySend(index)
             }
+            pending.close()
+
+            List(CONNECTIONS) {
+                launch {
+                    for (index in pending) {
+                        fetchSegment(urlString, map, index, channel) { bytes ->
+                            onProgress(downloaded.addAndGet(bytes), map.totalBytes)
+                        }
+                        mapLock.withLock {
+                            map.done.set(index)
+                            map.save(mapFile)
+                            hasher.advance()
+                        }
+                    }
+                }
+            }.joinAll()
+
+            channel.force(false)
+            hasher.finish()
+        }
+    }
 
-            val totalBytes = connection.contentLength.toLong() + downloadedBytes
-            val inputStream = connection.inputStream
-            output = FileOutputStream(outputFile, downloadedBytes > 0)
-
-            val buffer = ByteArray(BUFFER_SIZE)
-            var bytesRead: Int
-            var currentBytes = downloadedBytes
-
-            while (inputStream.read(buffer).also { bytesRead = it } != -1) {
-                if (!currentCoroutineContext().isActive) throw CancellationException()
-
-                output.write(buffer, 0, bytesRead)
-                currentBytes += bytesRead
-
-                val progress = if (totalBytes > 0) {
-                    ((currentBytes * 100) / totalBytes).toInt()
-                } else 0
+    /**
+     * Fetch one segment into its place in the file, retrying failed
+     * connections. [onBytes] receives the bytes written, negative when
+     * a failed attempt's bytes are discarded.
+     */
+    private suspend fun fetchSegment(
+        urlString: String,
+        map: SegmentMap,
+        index: Int,
+        channel: FileChannel,
+        onBytes: (Long) -> Unit
+    ) {
+        val start = map.start(index)
+        val length = map.length(index)
+        var attempt = 1
+        while (true) {
+            var written = 0L
+            try {
+                val connection = openConnection(urlString)
+                connection.setRequestProperty("Range", "bytes=$start-${start + length - 1}")
+                try {
+                    if (connection.responseCode != 206) {
+                        throw IOException("HTTP error: ${connection.responseCode}")
+                    }
+                    connection.inputStream.use { input ->
+                        val buffer = ByteArray(BUFFER_SIZE)
+                        while (written < length) {
+                            currentCoroutineContext().ensureActive()
+                            val bytesRead = input.read(buffer, 0, minOf(BUFFER_SIZE.toLong(), length - written).toInt())
+                            if (bytesRead == -1) throw IOException("Segment $index ended early")
+                            val data = ByteBuffer.wrap(buffer, 0, bytesRead)
+                            while (data.hasRemaining()) {
+                                channel.write(data, start + written + data.position())
+                            }
+                            written += bytesRead
+                            onBytes(bytesRead.toLong())
+                        }
+                    }
+                } finally {
+                    connection.disconnect()
+                }
+                return
+            } catch (e: IOException) {
+                onBytes(-written)
+                if (attempt >= SEGMENT_ATTEMPTS) throw e
+                Log.w(TAG, "Segment $index failed (${e.message}), retrying")
+                delay(1000L * attempt)
+                attempt++
+            }
+        }
+    }
 
-                _downloadState.value = DownloadState.Downloading(
-                    urlString,
-                    outputFile.name,
-                    currentBytes,
-                    totalBytes
-                )
+    /** Download in one request, hashing as it streams. Cannot resume. */
+    private suspend fun downloadStream(
+        urlString: String,
+        partFile: File,
+        onProgress: (Long, Long) -> Unit
+    ): ByteArray {
+        val digest = MessageDigest.getInstance("SHA-256")
+        val connection = openConnection(urlString)
+        try {
+            val responseCode = connection.responseCode
+            if (responseCode != 200) {
+                throw IOException("HTTP error: $responseCode")
+            }
 
-                updateNotification("Downloading ${outputFile.name}", progress)
+            val totalBytes = connection.contentLengthLong
+            var currentBytes = 0L
+            connection.inputStream.use { input ->
+                FileOutputStream(partFile).use { output ->
+                    val buffer = ByteArray(BUFFER_SIZE)
+                    var bytesRead: Int
+                    while (input.read(buffer).also { bytesRead = it } != -1) {
+                        currentCoroutineContext().ensureActive()
+                        output.write(buffer, 0, bytesRead)
+                        digest.update(buffer, 0, bytesRead)
+                        currentBytes += bytesRead
+                        onProgress(currentBytes, totalBytes)
+                    }
+                    output.flush()
+                }
+            }
+            if (totalBytes > 0 && currentBytes != totalBytes) {
+                throw IOException("Download ended at $currentBytes of $totalBytes bytes")
             }
+            return digest.digest()
+        } finally {
+            connection.disconnect()
+        }
+    }
 
-            output.flush()
-            Log.i(TAG, "Download complete: ${outputFile.absolutePath}")
+    /**
+     * Check a finished download against its expected SHA-256 and as a GGUF
+     * file. Throws [CorruptDownloadException] if either fails.
+     */
+    private suspend fun verify(partFile: File, digest: ByteArray, expectedSha256: String?) {
+        val actual = digest.joinToString("") { "%02x".format(it) }
+        Log.i(TAG, "SHA-256 of ${partFile.name}: $actual")
+        if (expectedSha256 != null && !actual.equals(expectedSha256, ignoreCase = true)) {
+            throw CorruptDownloadException("Checksum mismatch: expected $expectedSha256, got $actual")
+        }
+        LlamaBridge.validateModelFile(partFile.absolutePath).onFailure { e ->
+            throw CorruptDownloadException("Invalid GGUF file: ${e.message}")
+        }
+    }
 
-        } finally {
-            output?.close()
-            connection?.disconnect()
+    private fun openConnection(urlString: String): HttpURLConnection =
+        (URL(urlString).openConnection() as HttpURLConnection).apply {
+            connectTimeout = 30000
+            readTimeout = 30000
+            requestMethod = "GET"
         }
+
+    // Publish progress once per percent; segments report from several threads
+    private fun reportProgress(urlString: String, filename: String, currentBytes: Long, totalBytes: Long) {
+        val progress = if (totalBytes > 0) ((currentBytes * 100) / totalBytes).toInt() else 0
+        val last = lastProgressPercent.get()
+        if (progress == last || !lastProgressPercent.compareAndSet(last, progress)) return
+
+        _downloadState.value = DownloadState.Downloading(urlString, filename, currentBytes, totalBytes)
+        updateNotification("Downloading $filename", progress)
     }
 
     private fun createNotification(status: String, progress: Int): Notification {
@@ -219,6 +423,106 @@ class ModelDownloadService : Service() {
     }
 }
 
+/** A finished download whose bytes are wrong; it is not worth resuming. */
+private class CorruptDownloadException(message: String) : IOException(message)
+
+/**
+ * Which fixed-size segments of a partial download are on disk. Saved next
+ * to the partial file so an interrupted download resumes; [url], [totalBytes]
+ * and [etag] tell whether it still describes the file on the server.
+ */
+private class SegmentMap(
+    val url: String,
+    val totalBytes: Long,
+    val etag: String?,
+    val segmentSize: Long
+) {
+    val segmentCount = ((totalBytes + segmentSize - 1) / segmentSize).toInt()
+    var done = BitSet(segmentCount)
+        private set
+
+    fun start(index: Int): Long = index * segmentSize
+
+    fun length(index: Int): Long = minOf(segmentSize, totalBytes - start(index))
+
+    fun downloadedBytes(): Long {
+        var bytes = 0L
+        var index = done.nextSetBit(0)
+        while (index >= 0) {
+            bytes += length(index)
+            index = done.nextSetBit(index + 1)
+        }
+        return bytes
+    }
+
+    // Written to a temporary file and renamed, so a crash leaves the old map
+    fun save(file: File) {
+        val json = JSONObject()
+            .put("url", url)
+            .put("totalBytes", totalBytes)
+            .put("etag", etag ?: JSONObject.NULL)
+            .put("segmentSize", segmentSize)
+            .put("done", Base64.encodeToString(done.toByteArray(), Base64.NO_WRAP))
+        val temp = File(file.path + ".tmp")
+        temp.writeText(json.toString())
+        temp.renameTo(file)
+    }
+
+    companion object {
+        fun load(file: File): SegmentMap? {
+            if (!file.exists()) return null
+            return try {
+                val json = JSONObject(file.readText())
+                SegmentMap(
+                    url = json.getString("url"),
+                    totalBytes = json.getLong("totalBytes"),
+                    etag = if (json.isNull("etag")) null else json.getString("etag"),
+                    segmentSize = json.getLong("segmentSize")
+                ).apply {
+                    done = BitSet.valueOf(Base64.decode(json.getString("done"), Base64.NO_WRAP))
+                }
+            } catch (e: Exception) {
+                Log.w("ModelDownloadService", "Ignoring unreadable segment map: ${e.message}")
+                null
+            }
+        }
+    }
+}
+
+/**
+ * SHA-256 of a segmented download, fed in file order as the leading run of
+ * finished segments grows, so the digest is ready when the last one lands.
+ */
+private class OrderedHasher(private val channel: FileChannel, private val map: SegmentMap) {
+    private val digest = MessageDigest.getInstance("SHA-256")
+    private val buffer = ByteBuffer.allocateDirect(1024 * 1024)
+    private var next = 0
+
+    /** Hash every finished segment that directly follows those hashed. */
+    fun advance() {
+        while (next < map.segmentCount && map.done[next]) {
+            var position = map.start(next)
+            val end = position + map.length(next)
+            while (position < end) {
+                buffer.clear()
+                buffer.limit(minOf(buffer.capacity().toLong(), end - position).toInt())
+                val bytesRead = channel.read(buffer, position)
+                if (bytesRead <= 0) throw IOException("Cannot read back segment $next")
+                buffer.flip()
+                digest.update(buffer)
+                position += bytesRead
+            }
+            next++
+        }
+    }
+
+    fun finish(): ByteArray {
+        advance()
+        if (next < map.segmentCount) throw IOException("Segment $next missing")
+        return digest.digest()
+    }
+}
+
 /**
  * Download state sealed class.
  */
@@ -15,9 +15,13 @@ import kotlinx.coroutines.withContext
 object ToolManager {
     private const val TAG = "ToolManager"
 
-    // Tool call patterns
+    // Generation stops natively on the closing tag, which is then not part
+    // of the response
+    private const val FETCH_URL_CLOSE = "</fetch_url>"
+
+    // Tool call patterns; a call may end the text without its closing tag
     private val FETCH_URL_PATTERN = Regex(
-        """<fetch_url>\s*(https?://[^\s<]+)\s*</fetch_url>""",
+        """<fetch_url>\s*(https?://[^\s<]+)\s*(?:</fetch_url>|$)""",
         RegexOption.IGNORE_CASE
     )
 
@@ -26,6 +30,31 @@ object ToolManager {
         RegexOption.IGNORE_CASE
     )
 
+    /**
+     * GBNF grammar for tool-calling turns: free text, optionally ending in
+     * one well-formed fetch_url call. The text may contain "<" anywhere
+     * except as the start of "<fetch_url>", so code and comparisons come
+     * through, while a call always parses and never costs a re-generation.
+     */
+    val TOOL_CALL_GRAMMAR = """
+root ::= prose call?
+prose ::= ([^<] | "<" lt)*
+# lt ... lt9: matched "<" up to that many chars of "fetch_url"; any other
+# char completes plain text, and another "<" starts over
+lt ::= "<" lt | [^<f] | "f" lt1
+lt1 ::= "<" lt | [^<e] | "e" lt2
+lt2 ::= "<" lt | [^<t] | "t" lt3
+lt3 ::= "<" lt | [^<c] | "c" lt4
+lt4 ::= "<" lt | [^<h] | "h" lt5
+lt5 ::= "<" lt | [^<_] | "_" lt6
+lt6 ::= "<" lt | [^<u] | "u" lt7
+lt7 ::= "<" lt | [^<r] | "r" lt8
+lt8 ::= "<" lt | [^<l] | "l" lt9
+lt9 ::= "<" lt | [^<>]
+call ::= "<fetch_url>" url "</fetch_url>"
+url ::= "http" "s"? "://" [^ \t\n<>]+
+""".trim()
+
     /**
      * System prompt that teaches the model about available tools.
      */
@@ -99,6 +128,13 @@ Assistant: Let me fetch that page for you.
     /**
      * Generate a response with tool support.
      * This handles the full loop of generation -> tool execution -> follow-up.
+     *
+     * Generation halts natively the moment a tool call is complete. The
+     * first turn is constrained to valid tool syntax; turns after a tool
+     * output run unconstrained, so the answer is never shaped by the
+     * grammar. Each follow-up prompt extends the previous prompt and
+     * response with the tool output, so the session's KV cache is reused
+     * and only the tool output is prefilled.
      */
     suspend fun generateWithTools(
         prompt: String,
@@ -107,59 +143,60 @@ Assistant: Let me fetch that page for you.
         maxToolIterations: Int = 2
     ): Result<ToolGenerationResult> = withContext(Dispatchers.Default) {
         try {
-            val fullPrompt = buildPromptWithSystem(prompt, systemPrompt)
-            var currentPrompt = fullPrompt
-            var allResponses = mutableListOf<String>()
-            var allToolResults = mutableListOf<String>()
+            var currentPrompt = buildPromptWithSystem(prompt, systemPrompt)
+            val toolParams = params.copy(
+                grammar = TOOL_CALL_GRAMMAR,
+                stop = params.stop + FETCH_URL_CLOSE
+            )
+            // A follow-up may still call a tool; the stop string ends it there
+            val followUpParams = params.copy(stop = params.stop + FETCH_URL_CLOSE)
+            var lastResponse = ""
+            var pendingToolCall = false
+            var toolsUsed = false
             var iterations = 0
 
             while (iterations < maxToolIterations) {
                 iterations++
 
-                // Generate response
-                val result = LlamaBridge.generateAsync(currentPrompt, params)
+                // First turn constrained to valid tool syntax, then free text
+                val result = LlamaBridge.generateAsync(
+                    currentPrompt,
+                    if (iterations == 1) toolParams else followUpParams
+                )
                 if (result.isFailure) {
                     return@withContext Result.failure(result.exceptionOrNull()!!)
                 }
 
-                val response = result.getOrThrow()
-                allResponses.add(response)
+                lastResponse = result.getOrThrow()
 
                 // Process tool calls
-                val toolResult = processToolCalls(response, prompt)
-
-                if (!toolResult.hasToolCalls) {
+                val toolResult = processToolCalls(lastResponse, prompt)
+                pendingToolCall = toolResult.hasToolCalls
+                if (!pendingToolCall) {
                     // No more tool calls, we're done
                     break
                 }
+                toolsUsed = true
 
-                allToolResults.addAll(toolResult.toolResults)
-
-                // If tools were used, generate a follow-up with the results
-                val followUpPrompt = buildFollowUpPrompt(
-                    originalPrompt = prompt,
-                    previousResponse = response,
+                // Continue the same transcript with the tool output
+                currentPrompt = buildFollowUpPrompt(
+                    previousPrompt = currentPrompt,
+                    previousResponse = lastResponse,
                     toolResults = toolResult.toolResults.joinToString("\n")
                 )
-                currentPrompt = followUpPrompt
             }
 
-            // Combine all responses
-            val finalResponse = if (allToolResults.isEmpty()) {
-                allResponses.last()
+            // Out of iterations right after a tool call: answer from its
+            // output without offering tools again
+            val finalResponse = if (!pendingToolCall) {
+                lastResponse
             } else {
-                // Generate final summary with tool results
-                val summaryPrompt = buildSummaryPrompt(
-                    originalPrompt = prompt,
-                    toolResults = allToolResults.joinToString("\n")
-                )
-                val summaryResult = LlamaBridge.generateAsync(summaryPrompt, params)
-                summaryResult.getOrElse { allResponses.last() }
+                LlamaBridge.generateAsync(currentPrompt, params).getOrElse { lastResponse }
             }
 
             Result.success(ToolGenerationResult(
                 response = finalResponse,
-                toolsUsed = allToolResults.isNotEmpty(),
+                toolsUsed = toolsUsed,
                 iterations = iterations
             ))
 
@@ -197,15 +234,16 @@ User: $userPrompt
 Assistant: """
     }
 
-    @Suppress("UNUSED_PARAMETER")
+    /**
+     * Append the tool call's closing tag and its output to the transcript,
+     * so the prompt and response already in the KV cache stay a prefix.
+     */
     private fun buildFollowUpPrompt(
-        originalPrompt: String,
-        previousResponse: String, // Reserved for context
+        previousPrompt: String,
+        previousResponse: String,
         toolResults: String
     ): String {
-        return """Based on the user's question and the information retrieved:
-
-User's question: $originalPrompt
+        return """$previousPrompt$previousResponse$FETCH_URL_CLOSE
 
 Tool results:
 $toolResults
@@ -214,19 +252,6 @@ Now provide a helpful response using this information.
 Assistant: """
     }
 
-    private fun buildSummaryPrompt(
-        originalPrompt: String,
-        toolResults: String
-    ): String {
-        return """The user asked: $originalPrompt
-
-Here is the information retrieved from the web:
-$toolResults
-
-Provide a clear, helpful summary answering the user's question based on this information.
-Assistant: """
-    }
-
     /**
      * Simple URL fetch without full tool loop - for direct URL requests.
      */
@@ -0,0 +1,148 @@
+package com.nanoai.llm.vector
+
+import com.nanoai.llm.LlamaBridge
+import java.io.Closeable
+import java.io.File
+import java.nio.ByteBuffer
+
+/**
+ * NativeVectorIndex - Kotlin handle for the native vector index.
+ *
+ * Embeddings live in one aligned native matrix and are scanned with a
+ * NEON dot-product kernel. Rows are addressed by insertion order and must
+ * be normalized. An optional HNSW graph ([enableAnn]) makes search
+ * approximate and sublinear. Not thread-safe; [VectorStore] serializes
+ * access.
+ */
+class NativeVectorIndex private constructor(
+    private var handle: Long,
+    val dimension: Int
+) : Closeable {
+    constructor(dimension: Int) : this(LlamaBridge.vectorIndexCreate(dimension), dimension)
+
+    companion object {
+        /**
+         * Map a vector file written by [flush]. Rows past [maxRows] are
+         * ignored. Returns null if the file is missing or invalid.
+         */
+        fun open(file: File, maxRows: Int): NativeVectorIndex? {
+            val handle = LlamaBridge.vectorIndexOpen(file.absolutePath, maxRows)
+            if (handle == 0L) return null
+            return NativeVectorIndex(handle, LlamaBridge.vectorIndexDim(handle)).also {
+                it.size = LlamaBridge.vectorIndexSize(handle)
+            }
+        }
+    }
+
+    var size: Int = 0
+        private set
+
+    var annEnabled: Boolean = false
+        private set
+
+    init {
+        require(handle != 0L) { "Invalid vector dimension: $dimension" }
+    }
+
+    /**
+     * Append rows in order. All rows must have [dimension] values.
+     */
+    fun add(rows: List<FloatArray>): Boolean {
+        if (rows.isEmpty()) return true
+        val flat = FloatArray(rows.size * dimension)
+        rows.forEachIndexed { i, row -> row.copyInto(flat, i * dimension) }
+        val ok = LlamaBridge.vectorIndexAdd(handle, flat, rows.size)
+        if (ok) size += rows.size
+        return ok
+    }
+
+    /**
+     * Append [count] rows read in place from a direct buffer of native-order
+     * floats, such as one filled by [LlamaBridge.getEmbeddingsInto].
+     */
+    fun add(rows: ByteBuffer, count: Int): Boolean {
+        if (count <= 0) return true
+        val ok = LlamaBridge.vectorIndexAddBuffer(handle, rows, count)
+        if (ok) size += count
+        return ok
+    }
+
+    /**
+     * Remove rows by position; later rows shift down to stay in order.
+     */
+    fun remove(rows: Collection<Int>) {
+        if (rows.isEmpty()) return
+        val unique = rows.filter { it in 0 until size }.toSet()
+        LlamaBridge.vectorIndexRemove(handle, unique.toIntArray())
+        size -= unique.size
+    }
+
+    /**
+     * Build an HNSW graph over the current rows; later adds extend it and
+     * removals are tombstoned until periodic compaction.
+     *
+     * @param m Links per node
+     * @param efConstruction Beam width while inserting
+     */
+    fun enableAnn(m: Int, efConstruction: Int) {
+        LlamaBridge.vectorIndexEnableAnn(handle, m, efConstruction)
+        annEnabled = true
+    }
+
+    fun disableAnn() {
+        LlamaBridge.vectorIndexDisableAnn(handle)
+        annEnabled = false
+    }
+
+    /** Beam width for ANN queries; higher trades speed for recall. */
+    fun setEfSearch(ef: Int) {
+        LlamaBridge.vectorIndexSetEfSearch(handle, ef)
+    }
+
+    /**
+     * Persist to [file]. Appends new rows in place when possible; rewrites
+     * the file after removals.
+     */
+    fun flush(file: File): Boolean = LlamaBridge.vectorIndexFlush(handle, file.absolutePath)
+
+    /**
+     * Write the whole index to [staged] under [generation] without touching
+     * [file]. Renaming [staged] over [file] commits it; later [flush]
+     * calls append there.
+     */
+    fun stage(staged: File, file: File, generation: Long): Boolean =
+        LlamaBridge.vectorIndexStage(handle, staged.absolutePath, file.absolutePath, generation)
+
+    /** Generation stored in the vector file this index was opened from or staged to. */
+    val generation: Long
+        get() = LlamaBridge.vectorIndexGeneration(handle)
+
+    fun clear() {
+        LlamaBridge.vectorIndexClear(handle)
+        size = 0
+    }
+
+    /**
+     * Top-k rows by inner product with [query], best first. Uses the ANN
+     * graph when enabled unless [exact] is set.
+     */
+    fun search(
+        query: FloatArray,
+        topK: Int,
+        minScore: Float,
+        exact: Boolean = false
+    ): List<Pair<Int, Float>> {
+        if (topK <= 0 || size == 0) return emptyList()
+        val rows = IntArray(topK)
+        val scores = FloatArray(topK)
+        val count = LlamaBridge.vectorIndexSearch(handle, query, minScore, rows, scores, exact)
+        return List(count) { rows[it] to scores[it] }
+    }
+
+    override fun close() {
+        if (handle != 0L) {
+            LlamaBridge.vectorIndexFree(handle)
+            handle = 0L
+        }
+    }
+}
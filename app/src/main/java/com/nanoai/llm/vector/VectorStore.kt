@@ -8,32 +8,93 @@ import kotlinx.coroutines.Dispatchers
 import kotlinx.coroutines.sync.Mutex
 import kotlinx.coroutines.sync.withLock
 import kotlinx.coroutines.withContext
+import java.io.BufferedOutputStream
+import java.io.ByteArrayInputStream
+import java.io.DataInputStream
+import java.io.DataOutputStream
+import java.io.EOFException
 import java.io.File
+import java.io.FileOutputStream
+import java.io.RandomAccessFile
+import java.nio.ByteBuffer
+import java.nio.MappedByteBuffer
+import java.nio.channels.FileChannel
 import kotlin.math.sqrt
 
 /**
- * VectorStore - Simple in-memory vector store with disk persistence.
+ * VectorStore - Simple vector store with disk persistence.
  *
  * Uses cosine similarity for retrieval.
- * Stores vectors as normalized float arrays.
+ * Stores vectors as normalized float arrays in a [NativeVectorIndex] that
+ * performs the search scan.
+ *
+ * On disk the store is three append-only files:
+ * - vectors.bin: native row matrix, memory-mapped on open
+ * - chunks.txt: chunk text, memory-mapped and decoded on demand
+ * - chunks.meta: one small record per chunk, including its text offset
+ * A chunk is committed once its chunks.meta record is synced, so a crash
+ * mid-append leaves the previous contents intact. Deletions rewrite all
+ * three files on the next save under a new generation, stored in both the
+ * vectors.bin and chunks.meta headers. chunks.meta is renamed last, and
+ * load only pairs files of the same generation.
  */
 class VectorStore(
     private val context: Context,
-    private val storeName: String = "default"
+    private val storeName: String = "default",
+    private var annEfSearch: Int = DEFAULT_ANN_EF_SEARCH
 ) {
     companion object {
         private const val TAG = "VectorStore"
-        private const val STORE_FILE = "vectors.json"
-        private const val META_FILE = "metadata.json"
+        private const val VECTOR_FILE = "vectors.bin"
+        private const val CHUNK_META_FILE = "chunks.meta"
+        private const val CHUNK_TEXT_FILE = "chunks.txt"
+
+        // Gson files written before the binary format; migrated once on load
+        private const val LEGACY_STORE_FILE = "vectors.json"
+        private const val LEGACY_META_FILE = "metadata.json"
+
+        private const val CHUNK_META_MAGIC = 0x4E41434D // "NACM"
+        private const val CHUNK_META_VERSION = 2
+        private const val CHUNK_META_HEADER_BYTES = 20
+
+        // Switch from exact scan to HNSW above this many chunks
+        const val ANN_THRESHOLD = 20_000
+        private const val ANN_M = 16
+        private const val ANN_EF_CONSTRUCTION = 100
+        const val DEFAULT_ANN_EF_SEARCH = 64
     }
 
     private val storeDir: File = File(context.filesDir, "rag_data/$storeName").apply { mkdirs() }
-    private val gson = Gson()
+    private val vectorFile = File(storeDir, VECTOR_FILE)
+    private val metaFile = File(storeDir, CHUNK_META_FILE)
+    private val textFile = File(storeDir, CHUNK_TEXT_FILE)
+
+    // Staged by rewriteStore and renamed over the files above
+    private val vectorTmp = File(storeDir, "$VECTOR_FILE.tmp")
+    private val metaTmp = File(storeDir, "$CHUNK_META_FILE.tmp")
+    private val textTmp = File(storeDir, "$CHUNK_TEXT_FILE.tmp")
     private val mutex = Mutex()
 
-    // In-memory storage
-    private val documents = mutableListOf<DocumentChunk>()
-    private val embeddings = mutableListOf<FloatArray>()
+    // Chunk records; text stays in chunks.txt until a chunk is returned
+    private val documents = mutableListOf<ChunkRecord>()
+
+    // Native search index; row i is documents[i]
+    private var index: NativeVectorIndex? = null
+
+    // Read-only mapping of chunks.txt
+    private var textBuffer: MappedByteBuffer? = null
+
+    // documents[0, persistedChunks) are in chunks.meta, in order, unless
+    // layoutDirty says a deletion has not been written yet
+    private var persistedChunks = 0
+    private var layoutDirty = false
+
+    // Generation of the committed files; each rewrite bumps it
+    private var generation = 0L
+
+    /** True once the store is large enough to search through HNSW. */
+    val isApproximate: Boolean
+        get() = index?.annEnabled == true
 
     // Statistics
     var totalChunks: Int = 0
@@ -62,29 +123,29 @@ class VectorStore(
             embeddingDimension = normalized.size
         }
 
-        val chunk = DocumentChunk(
-            id = documents.size,
-            text = text,
-            metadata = metadata,
-            embeddingSize = normalized.size
-        )
-
-        documents.add(chunk)
-        embeddings.add(normalized)
+        val id = documents.size
+        documents.add(ChunkRecord(metadata, embeddingSize = normalized.size, pendingText = text))
+        indexRows(listOf(normalized))
         totalChunks = documents.size
 
-        Log.d(TAG, "Added chunk ${chunk.id}: ${text.take(50)}...")
-        chunk.id
+        Log.d(TAG, "Added chunk $id: ${text.take(50)}...")
+        id
     }
 
     /**
      * Add multiple chunks at once (more efficient).
+     *
+     * @param firstIndex Chunk index of chunks[0] within its source
+     * @param sourceChunks Chunks in the whole source
      */
     suspend fun addChunks(
         chunks: List<Pair<String, FloatArray>>,
-        source: String
+        source: String,
+        firstIndex: Int = 0,
+        sourceChunks: Int = chunks.size
     ): List<Int> = mutex.withLock {
         val ids = mutableListOf<Int>()
+        val added = mutableListOf<FloatArray>()
 
         for ((index, pair) in chunks.withIndex()) {
             val (text, embedding) = pair
@@ -96,66 +157,140 @@ class VectorStore(
 
             val metadata = ChunkMetadata(
                 source = source,
-                chunkIndex = index,
-                totalChunks = chunks.size,
+                chunkIndex = firstIndex + index,
+                totalChunks = sourceChunks,
                 timestamp = System.currentTimeMillis()
             )
 
-            val chunk = DocumentChunk(
-                id = documents.size,
-                text = text,
-                metadata = metadata,
-                embeddingSize = normalized.size
-            )
-
-            documents.add(chunk)
-            embeddings.add(normalized)
-            ids.add(chunk.id)
+            ids.add(documents.size)
+            documents.add(ChunkRecord(metadata, embeddingSize = normalized.size, pendingText = text))
+            added.add(normalized)
         }
+        indexRows(added)
 
         totalChunks = documents.size
         Log.i(TAG, "Added ${chunks.size} chunks from $source")
         ids
     }
 
+    /**
+     * Add chunks whose embeddings are already normalized rows in a direct
+     * buffer, as written by [com.nanoai.llm.LlamaBridge.getEmbeddingsInto].
+     * The rows go to the native index without passing through Java arrays,
+     * so the buffer can be reused for the next batch once this returns.
+     *
+     * @param firstIndex Chunk index of texts[0] within its source
+     * @param sourceChunks Chunks in the whole source
+     */
+    suspend fun addEmbeddedChunks(
+        texts: List<String>,
+        rows: ByteBuffer,
+        dimension: Int,
+        source: String,
+        firstIndex: Int = 0,
+        sourceChunks: Int = texts.size
+    ): List<Int> = mutex.withLock {
+        if (texts.isEmpty()) return@withLock emptyList()
+        if (embeddingDimension == 0) {
+            embeddingDimension = dimension
+        }
+        if (dimension != embeddingDimension) {
+            // Keep positions aligned with documents, as indexRows does
+            Log.w(TAG, "Embedding has $dimension dims, store has $embeddingDimension")
+            return@withLock addRecords(texts, source, firstIndex, sourceChunks, dimension).also {
+                indexRows(List(texts.size) { FloatArray(embeddingDimension) })
+            }
+        }
+
+        val ids = addRecords(texts, source, firstIndex, sourceChunks, dimension)
+        val target = index ?: NativeVectorIndex(embeddingDimension).also { index = it }
+        if (!target.add(rows, texts.size)) {
+            Log.e(TAG, "Failed to add ${texts.size} rows to native index")
+        }
+        enableAnnIfLarge(target)
+
+        Log.i(TAG, "Added ${texts.size} chunks from $source")
+        ids
+    }
+
+    private fun addRecords(
+        texts: List<String>,
+        source: String,
+        firstIndex: Int,
+        sourceChunks: Int,
+        dimension: Int
+    ): List<Int> {
+        val now = System.currentTimeMillis()
+        val ids = texts.mapIndexed { i, text ->
+            val metadata = ChunkMetadata(
+                source = source,
+                chunkIndex = firstIndex + i,
+                totalChunks = sourceChunks,
+                timestamp = now
+            )
+            documents.add(ChunkRecord(metadata, embeddingSize = dimension, pendingText = text))
+            documents.size - 1
+        }
+        totalChunks = documents.size
+        return ids
+    }
+
     /**
      * Search for similar chunks using cosine similarity.
      *
      * @param queryEmbedding Query vector (will be normalized)
      * @param topK Number of results to return
      * @param minSimilarity Minimum similarity threshold (0-1)
+     * @param exact Force a full scan even when the ANN index is active
      * @return List of matching chunks with scores
      */
     suspend fun search(
         queryEmbedding: FloatArray,
         topK: Int = 5,
-        minSimilarity: Float = 0.0f
+        minSimilarity: Float = 0.0f,
+        exact: Boolean = false
     ): List<SearchResult> = mutex.withLock {
-        if (embeddings.isEmpty()) {
+        val nativeIndex = index
+        if (documents.isEmpty() || nativeIndex == null) {
+            return@withLock emptyList()
+        }
+        if (queryEmbedding.size != embeddingDimension) {
+            Log.w(TAG, "Query has ${queryEmbedding.size} dims, store has $embeddingDimension")
             return@withLock emptyList()
         }
 
         val normalizedQuery = normalize(queryEmbedding)
 
-        // Calculate similarities
-        val similarities = embeddings.mapIndexed { index, embedding ->
-            val similarity = cosineSimilarity(normalizedQuery, embedding)
-            index to similarity
-        }
-
-        // Filter and sort
-        similarities
-            .filter { it.second >= minSimilarity }
-            .sortedByDescending { it.second }
-            .take(topK)
-            .map { (index, score) ->
+        // Native scan keeps a top-K heap, already filtered and sorted
+        nativeIndex.search(normalizedQuery, topK, minSimilarity, exact)
+            .map { (row, score) ->
                 SearchResult(
-                    chunk = documents[index],
+                    chunk = chunkAt(row),
                     score = score
                 )
             }
     }
 
+    /**
+     * Fraction of the exact top-K that the ANN index also returns for this
+     * query, or null while search is exact. For debugging recall.
+     */
+    suspend fun measureRecall(queryEmbedding: FloatArray, topK: Int = 5): Float? {
+        if (!isApproximate) return null
+        val exact = search(queryEmbedding, topK, -1f, exact = true).map { it.chunk.id }.toSet()
+        if (exact.isEmpty()) return null
+        val approx = search(queryEmbedding, topK, -1f)
+        return approx.count { it.chunk.id in exact }.toFloat() / exact.size
+    }
+
+    /**
+     * Set the ANN beam width used for queries once the store is approximate.
+     */
+    suspend fun setAnnEfSearch(ef: Int) = mutex.withLock {
+        annEfSearch = ef
+        index?.setEfSearch(ef)
+    }
+
     /**
      * Search and return just the text (convenience method).
      */
@@ -171,14 +306,16 @@ class VectorStore(
      * Get chunk by ID.
      */
     suspend fun getChunk(id: Int): DocumentChunk? = mutex.withLock {
-        documents.getOrNull(id)
+        if (id in documents.indices) chunkAt(id) else null
     }
 
     /**
      * Get all chunks from a source.
      */
     suspend fun getChunksBySource(source: String): List<DocumentChunk> = mutex.withLock {
-        documents.filter { it.metadata.source == source }
+        documents.indices
+            .filter { documents[it].metadata.source == source }
+            .map { chunkAt(it) }
     }
 
     /**
@@ -192,21 +329,13 @@ class VectorStore(
         if (toRemove.isEmpty()) return@withLock 0
 
         // Rebuild without removed items
-        val newDocs = mutableListOf<DocumentChunk>()
-        val newEmbeddings = mutableListOf<FloatArray>()
-
-        documents.forEachIndexed { index, chunk ->
-            if (index !in toRemove) {
-                newDocs.add(chunk.copy(id = newDocs.size))
-                newEmbeddings.add(embeddings[index])
-            }
-        }
+        val newDocs = documents.filterIndexed { index, _ -> index !in toRemove }
 
         documents.clear()
         documents.addAll(newDocs)
-        embeddings.clear()
-        embeddings.addAll(newEmbeddings)
+        index?.remove(toRemove)
         totalChunks = documents.size
+        layoutDirty = true
 
         Log.i(TAG, "Deleted ${toRemove.size} chunks from $source")
         toRemove.size
@@ -217,13 +346,17 @@ class VectorStore(
      */
     suspend fun clear() = mutex.withLock {
         documents.clear()
-        embeddings.clear()
+        index?.close()
+        index = null
+        textBuffer = null
+        persistedChunks = 0
+        layoutDirty = false
+        generation = 0
         totalChunks = 0
         embeddingDimension = 0
 
         // Delete files
-        File(storeDir, STORE_FILE).delete()
-        File(storeDir, META_FILE).delete()
+        listOf(vectorFile, metaFile, textFile, vectorTmp, metaTmp, textTmp).forEach { it.delete() }
 
         Log.i(TAG, "Cleared all data")
     }
@@ -249,27 +382,14 @@ class VectorStore(
 
     /**
      * Save to disk.
+     *
+     * Appends chunks added since the last save, or rewrites the store
+     * after a deletion.
      */
     suspend fun saveToDisk() = withContext(Dispatchers.IO) {
         mutex.withLock {
             try {
-                // Save metadata
-                val metaFile = File(storeDir, META_FILE)
-                val meta = StoreMeta(
-                    totalChunks = totalChunks,
-                    embeddingDimension = embeddingDimension,
-                    version = 1
-                )
-                metaFile.writeText(gson.toJson(meta))
-
-                // Save documents (without embeddings in JSON for size)
-                val storeFile = File(storeDir, STORE_FILE)
-                val storeData = StoreData(
-                    documents = documents.toList(),
-                    embeddings = embeddings.map { it.toList() }
-                )
-                storeFile.writeText(gson.toJson(storeData))
-
+                if (layoutDirty) rewriteStore() else appendPending()
                 Log.i(TAG, "Saved $totalChunks chunks to disk")
             } catch (e: Exception) {
                 Log.e(TAG, "Failed to save to disk", e)
@@ -277,60 +397,358 @@ class VectorStore(
         }
     }
 
+    /**
+     * Write-ahead append: text, then vectors, then the metadata records
+     * that commit them. Anything past the last synced record is ignored
+     * on load.
+     */
+    private fun appendPending() {
+        val nativeIndex = index ?: return
+        if (persistedChunks >= documents.size) return
+
+        val pending = documents.subList(persistedChunks, documents.size)
+        val committed = RandomAccessFile(textFile, "rw").use { raf ->
+            var offset = raf.length()
+            raf.seek(offset)
+            val records = pending.map { record ->
+                val bytes = record.pendingText.orEmpty().toByteArray(Charsets.UTF_8)
+                raf.write(bytes)
+                record.copy(textOffset = offset, textLength = bytes.size, pendingText = null)
+                    .also { offset += bytes.size }
+            }
+            raf.fd.sync()
+            records
+        }
+
+        check(nativeIndex.flush(vectorFile)) { "Failed to write $VECTOR_FILE" }
+
+        if (metaFile.length() < CHUNK_META_HEADER_BYTES) {
+            writeMetaFile(metaFile, emptyList(), nativeIndex.generation)
+        }
+        FileOutputStream(metaFile, true).use { fos ->
+            val out = DataOutputStream(BufferedOutputStream(fos))
+            committed.forEach { out.writeRecord(it) }
+            out.flush()
+            fos.fd.sync()
+        }
+
+        committed.forEachIndexed { i, record -> documents[persistedChunks + i] = record }
+        persistedChunks = documents.size
+        textBuffer = mapText()
+    }
+
+    /**
+     * Rewrite all three files without deleted chunks under the next
+     * generation. Each is staged next to its original and renamed into
+     * place, chunks.meta last; [recoverRewrite] finishes the renames if
+     * the process dies between them.
+     */
+    private fun rewriteStore() {
+        val next = generation + 1
+        val rewritten = FileOutputStream(textTmp).use { fos ->
+            val out = BufferedOutputStream(fos)
+            var offset = 0L
+            val records = documents.map { record ->
+                val bytes = readText(record).toByteArray(Charsets.UTF_8)
+                out.write(bytes)
+                record.copy(textOffset = offset, textLength = bytes.size, pendingText = null)
+                    .also { offset += bytes.size }
+            }
+            out.flush()
+            fos.fd.sync()
+            records
+        }
+        writeMetaFile(metaTmp, rewritten, next)
+
+        val nativeIndex = index
+        if (nativeIndex != null) {
+            check(nativeIndex.stage(vectorTmp, vectorFile, next)) { "Failed to write $VECTOR_FILE" }
+            check(vectorTmp.renameTo(vectorFile)) { "Failed to replace $VECTOR_FILE" }
+        } else {
+            vectorFile.delete()
+        }
+
+        textBuffer = null
+        check(textTmp.renameTo(textFile) && metaTmp.renameTo(metaFile)) {
+            "Failed to replace chunk files"
+        }
+
+        documents.clear()
+        documents.addAll(rewritten)
+        persistedChunks = documents.size
+        layoutDirty = false
+        generation = next
+        textBuffer = mapText()
+    }
+
+    /**
+     * Complete a rewrite whose vectors were renamed into place before the
+     * process died, or discard one that never got that far. The staged
+     * chunks.meta is kept only if its generation matches vectors.bin.
+     */
+    private fun recoverRewrite() {
+        if (metaTmp.exists()) {
+            val staged = readMetaGeneration(metaTmp)
+            val vectors = NativeVectorIndex.open(vectorFile, 0)?.use { it.generation }
+            if (staged != null && staged == vectors) {
+                Log.w(TAG, "Finishing interrupted rewrite to generation $staged")
+                check((!textTmp.exists() || textTmp.renameTo(textFile)) && metaTmp.renameTo(metaFile)) {
+                    "Failed to replace chunk files"
+                }
+            }
+        }
+        listOf(vectorTmp, metaTmp, textTmp).forEach { it.delete() }
+    }
+
     /**
      * Load from disk.
+     *
+     * Vectors and text are mapped rather than read, so only the metadata
+     * records are parsed up front.
      */
     private fun loadFromDisk() {
         try {
-            val metaFile = File(storeDir, META_FILE)
-            val storeFile = File(storeDir, STORE_FILE)
-
-            if (!metaFile.exists() || !storeFile.exists()) {
-                Log.d(TAG, "No existing data to load")
+            recoverRewrite()
+            if (!metaFile.exists()) {
+                if (File(storeDir, LEGACY_STORE_FILE).exists()) {
+                    migrateLegacyStore()
+                } else {
+                    Log.d(TAG, "No existing data to load")
+                }
                 return
             }
 
-            // Load metadata
-            val meta = gson.fromJson(metaFile.readText(), StoreMeta::class.java)
+            // Anything rejected below is replaced by the next save
+            layoutDirty = true
+            val (metaGeneration, records) = readMetaFile() ?: return
+            generation = metaGeneration
+            val nativeIndex = NativeVectorIndex.open(vectorFile, records.size)
+            if (nativeIndex == null) {
+                Log.w(TAG, "Missing or invalid $VECTOR_FILE, ignoring ${records.size} chunks")
+                return
+            }
 
-            // Load store data
-            val type = object : TypeToken<StoreData>() {}.type
-            val storeData: StoreData = gson.fromJson(storeFile.readText(), type)
+            // Rows pair with records by position, which only holds for the
+            // vectors written alongside these records
+            if (nativeIndex.generation != metaGeneration || nativeIndex.size != records.size) {
+                Log.w(
+                    TAG,
+                    "$VECTOR_FILE (generation ${nativeIndex.generation}, ${nativeIndex.size} rows) " +
+                        "does not match $CHUNK_META_FILE (generation $metaGeneration, " +
+                        "${records.size} chunks), ignoring both"
+                )
+                nativeIndex.close()
+                return
+            }
 
             documents.clear()
-            documents.addAll(storeData.documents)
-
-            embeddings.clear()
-            storeData.embeddings.forEach { list ->
-                embeddings.add(list.toFloatArray())
+            documents.addAll(records)
+            index = nativeIndex
+            textBuffer = mapText()
+
+            persistedChunks = documents.size
+            layoutDirty = false
+            totalChunks = documents.size
+            embeddingDimension = nativeIndex.dimension
+
+            if (nativeIndex.size >= ANN_THRESHOLD) {
+                Log.i(TAG, "Building ANN index over ${nativeIndex.size} chunks")
+                nativeIndex.enableAnn(ANN_M, ANN_EF_CONSTRUCTION)
+                nativeIndex.setEfSearch(annEfSearch)
             }
 
-            totalChunks = meta.totalChunks
-            embeddingDimension = meta.embeddingDimension
-
             Log.i(TAG, "Loaded $totalChunks chunks from disk")
         } catch (e: Exception) {
             Log.e(TAG, "Failed to load from disk", e)
         }
     }
 
-    // Math utilities
-    private fun normalize(vector: FloatArray): FloatArray {
-        val norm = sqrt(vector.map { it * it }.sum())
-        return if (norm > 0) {
-            vector.map { it / norm }.toFloatArray()
+    /**
+     * Convert a store saved by older versions as Gson JSON.
+     */
+    private fun migrateLegacyStore() {
+        val storeFile = File(storeDir, LEGACY_STORE_FILE)
+        val type = object : TypeToken<LegacyStoreData>() {}.type
+        val storeData: LegacyStoreData = Gson().fromJson(storeFile.readText(), type)
+
+        storeData.documents.forEach { chunk ->
+            documents.add(
+                ChunkRecord(chunk.metadata, embeddingSize = chunk.embeddingSize, pendingText = chunk.text)
+            )
+        }
+        val rows = storeData.embeddings.map { it.toFloatArray() }
+        embeddingDimension = rows.firstOrNull()?.size ?: 0
+        indexRows(rows)
+        totalChunks = documents.size
+
+        rewriteStore()
+        storeFile.delete()
+        File(storeDir, LEGACY_META_FILE).delete()
+        Log.i(TAG, "Migrated $totalChunks chunks from $LEGACY_STORE_FILE")
+    }
+
+    /**
+     * Read chunks.meta as its generation and records, or null if it is not
+     * a chunk metadata file.
+     */
+    private fun readMetaFile(): Pair<Long, List<ChunkRecord>>? {
+        val bytes = metaFile.readBytes()
+        val input = DataInputStream(ByteArrayInputStream(bytes))
+        val fileGeneration = input.readMetaHeader()
+        if (fileGeneration == null) {
+            Log.w(TAG, "Unrecognized $CHUNK_META_FILE, ignoring")
+            return null
+        }
+
+        val records = mutableListOf<ChunkRecord>()
+        var validBytes = bytes.size - input.available()
+        try {
+            while (input.available() > 0) {
+                records.add(input.readRecord())
+                validBytes = bytes.size - input.available()
+            }
+        } catch (e: EOFException) {
+            // Torn record from an interrupted append
+            Log.w(TAG, "Truncating partial record in $CHUNK_META_FILE")
+            RandomAccessFile(metaFile, "rw").use { it.setLength(validBytes.toLong()) }
+        }
+        return fileGeneration to records
+    }
+
+    private fun readMetaGeneration(file: File): Long? =
+        DataInputStream(file.inputStream().buffered()).use { it.readMetaHeader() }
+
+    // Generation from a chunks.meta header; version 1 files predate it
+    private fun DataInputStream.readMetaHeader(): Long? = try {
+        if (readInt() != CHUNK_META_MAGIC) {
+            null
         } else {
-            vector.copyOf()
+            val version = readInt()
+            readInt() // dimension; the vector file is authoritative
+            when (version) {
+                1 -> 0L
+                CHUNK_META_VERSION -> readLong()
+                else -> null
+            }
         }
+    } catch (e: EOFException) {
+        null
     }
 
-    private fun cosineSimilarity(a: FloatArray, b: FloatArray): Float {
-        if (a.size != b.size) return 0f
-        var dot = 0f
-        for (i in a.indices) {
-            dot += a[i] * b[i]
+    private fun writeMetaFile(file: File, records: List<ChunkRecord>, generation: Long) {
+        FileOutputStream(file).use { fos ->
+            val out = DataOutputStream(BufferedOutputStream(fos))
+            out.writeInt(CHUNK_META_MAGIC)
+            out.writeInt(CHUNK_META_VERSION)
+            out.writeInt(embeddingDimension)
+            out.writeLong(generation)
+            records.forEach { out.writeRecord(it) }
+            out.flush()
+            fos.fd.sync()
         }
-        return dot // Already normalized, so dot product = cosine
+    }
+
+    private fun DataOutputStream.writeRecord(record: ChunkRecord) {
+        val meta = record.metadata
+        writeUTF(meta.source)
+        writeInt(meta.chunkIndex)
+        writeInt(meta.totalChunks)
+        writeLong(meta.timestamp)
+        writeBoolean(meta.title != null)
+        meta.title?.let { writeUTF(it) }
+        writeBoolean(meta.url != null)
+        meta.url?.let { writeUTF(it) }
+        writeLong(record.textOffset)
+        writeInt(record.textLength)
+        writeInt(record.embeddingSize)
+    }
+
+    private fun DataInputStream.readRecord(): ChunkRecord {
+        val metadata = ChunkMetadata(
+            source = readUTF(),
+            chunkIndex = readInt(),
+            totalChunks = readInt(),
+            timestamp = readLong(),
+            title = if (readBoolean()) readUTF() else null,
+            url = if (readBoolean()) readUTF() else null
+        )
+        return ChunkRecord(
+            metadata = metadata,
+            textOffset = readLong(),
+            textLength = readInt(),
+            embeddingSize = readInt()
+        )
+    }
+
+    private fun mapText(): MappedByteBuffer? {
+        if (textFile.length() == 0L) return null
+        return RandomAccessFile(textFile, "r").use { raf ->
+            raf.channel.map(FileChannel.MapMode.READ_ONLY, 0, raf.length())
+        }
+    }
+
+    private fun readText(record: ChunkRecord): String {
+        record.pendingText?.let { return it }
+        val buffer = textBuffer ?: return ""
+        if (record.textOffset + record.textLength > buffer.capacity()) return ""
+        val bytes = ByteArray(record.textLength)
+        buffer.duplicate().apply { position(record.textOffset.toInt()) }.get(bytes)
+        return String(bytes, Charsets.UTF_8)
+    }
+
+    private fun chunkAt(id: Int): DocumentChunk {
+        val record = documents[id]
+        return DocumentChunk(
+            id = id,
+            text = readText(record),
+            metadata = record.metadata,
+            embeddingSize = record.embeddingSize
+        )
+    }
+
+    /**
+     * Append rows to the native index, creating it on first use. Rows of the
+     * wrong dimension are stored as zeros so positions stay aligned with
+     * [documents]; they never match a query.
+     */
+    private fun indexRows(rows: List<FloatArray>) {
+        if (rows.isEmpty() || embeddingDimension == 0) return
+        val target = index ?: NativeVectorIndex(embeddingDimension).also { index = it }
+        val sized = rows.map { row ->
+            if (row.size == embeddingDimension) row else {
+                Log.w(TAG, "Embedding has ${row.size} dims, store has $embeddingDimension")
+                FloatArray(embeddingDimension)
+            }
+        }
+        if (!target.add(sized)) {
+            Log.e(TAG, "Failed to add ${rows.size} rows to native index")
+        }
+        enableAnnIfLarge(target)
+    }
+
+    private fun enableAnnIfLarge(target: NativeVectorIndex) {
+        // Large corpora switch to HNSW; the graph then grows with each add
+        if (!target.annEnabled && target.size >= ANN_THRESHOLD) {
+            Log.i(TAG, "Building ANN index over ${target.size} chunks")
+            target.enableAnn(ANN_M, ANN_EF_CONSTRUCTION)
+            target.setEfSearch(annEfSearch)
+        }
+    }
+
+    // Math utilities
+    private fun normalize(vector: FloatArray): FloatArray {
+        var sum = 0f
+        for (v in vector) {
+            sum += v * v
+        }
+        val norm = sqrt(sum)
+        val result = vector.copyOf()
+        if (norm > 0) {
+            for (i in result.indices) {
+                result[i] /= norm
+            }
+        }
+        return result
     }
 }
 
@@ -375,13 +793,17 @@ data class VectorStoreStats(
 )
 
 // Internal persistence classes
-private data class StoreMeta(
-    val totalChunks: Int,
-    val embeddingDimension: Int,
-    val version: Int
+
+// Text is at textOffset in chunks.txt, or in pendingText until saved
+private data class ChunkRecord(
+    val metadata: ChunkMetadata,
+    val textOffset: Long = 0,
+    val textLength: Int = 0,
+    val embeddingSize: Int,
+    val pendingText: String? = null
 )
 
-private data class StoreData(
+private data class LegacyStoreData(
     val documents: List<DocumentChunk>,
     val embeddings: List<List<Float>>
 )